@@ -0,0 +1,470 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+/*
+ * Stand-in for ssh, so that ssh-tunneld can be benchmarked offline.
+ * It accepts the options ssh-tunneld passes, waits FAKE_SSH_DELAY_MS
+ * milliseconds (default 200) as if logging in, then serves SOCKS5 on
+ * the -D port: CONNECT only, no authentication, each connection
+ * relayed by a child process. Built as "ssh" and found through $PATH.
+ *
+ * FAKE_SSH_HOST_DELAYS ("host=ms,...") overrides the delay for
+ * particular hosts; a negative one makes ssh fail instead, as if the
+ * host could not be reached.
+ *
+ * With -M -S path it is a ControlMaster instead, listening on path.
+ * With -D as well, path only shows that it is ready (as when racing
+ * hosts), and it gives up if the -D port is taken.
+ * With -S path -W host:port it is a mux client: like real ssh, it
+ * passes its stdin and stdout to the master (over SCM_RIGHTS), which
+ * relays between them and host:port, and it exits when the master
+ * hangs up. This is not ssh's mux protocol, only its data path.
+ * Each -L port:host:port is listened on alongside, each connection
+ * relayed straight to host:port; as with ExitOnForwardFailure, it
+ * gives up if one of the ports is taken.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static int receive_all(int fd, unsigned char* buf, size_t len)
+{
+    size_t received = 0;
+    while (received < len)
+    {
+        ssize_t n = recv(fd, buf + received, len - received, 0);
+        if (n <= 0)
+            return -1;
+        received += (size_t) n;
+    }
+    return 0;
+}
+
+static int connect_to(const char* host, const char* port)
+{
+    struct addrinfo hints;
+    struct addrinfo* result;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &result) != 0)
+        return -1;
+    int fd = -1;
+    for (struct addrinfo* rp = result; rp != NULL; rp = rp->ai_next)
+    {
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+static const char* master_path = NULL;
+
+static void copy(int from, int to)
+{
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(from, buf, sizeof(buf))) > 0)
+    {
+        for (ssize_t sent = 0; sent < n; )
+        {
+            ssize_t m = write(to, buf + sent, (size_t) (n - sent));
+            if (m <= 0)
+                return;
+            sent += m;
+        }
+    }
+}
+
+static void relay(int a_in, int a_out, int b)
+{
+    /* One process per direction, so that neither can block the other;
+     * each passes on end-of-file as a half-close.
+     */
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        copy(a_in, b);
+        shutdown(b, SHUT_WR);
+        _exit(EXIT_SUCCESS);
+    }
+    copy(b, a_out);
+    if (shutdown(a_out, SHUT_WR) == -1)
+        close(a_out); /* a pipe */
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+}
+
+static void serve_socks5(int client)
+{
+    unsigned char buf[262];
+    /* Greeting: version, methods; we only offer "no authentication" */
+    if (receive_all(client, buf, 2) != 0 || buf[0] != 5
+            || receive_all(client, buf + 2, buf[1]) != 0)
+        return;
+    const unsigned char method[2] = { 5, 0 };
+    if (send(client, method, sizeof(method), 0) != sizeof(method))
+        return;
+
+    /* Request: version, command, reserved, address type */
+    if (receive_all(client, buf, 4) != 0 || buf[1] != 1)
+        return;
+    char host[256];
+    char port[8];
+    unsigned char address_type = buf[3];
+    if (address_type == 1)
+    {
+        if (receive_all(client, buf, 4) != 0)
+            return;
+        inet_ntop(AF_INET, buf, host, sizeof(host));
+    }
+    else if (address_type == 4)
+    {
+        if (receive_all(client, buf, 16) != 0)
+            return;
+        inet_ntop(AF_INET6, buf, host, sizeof(host));
+    }
+    else if (address_type == 3)
+    {
+        if (receive_all(client, buf, 1) != 0 || receive_all(client, buf + 1, buf[0]) != 0)
+            return;
+        memcpy(host, buf + 1, buf[0]);
+        host[buf[0]] = '\0';
+    }
+    else
+    {
+        return;
+    }
+    if (receive_all(client, buf, 2) != 0)
+        return;
+    snprintf(port, sizeof(port), "%u", ((unsigned int) buf[0] << 8) | buf[1]);
+
+    int upstream = connect_to(host, port);
+    unsigned char reply[10] = { 5, 0, 0, 1, 0, 0, 0, 0, 0, 0 };
+    if (upstream == -1)
+        reply[1] = 5; /* connection refused */
+    if (send(client, reply, sizeof(reply), 0) != sizeof(reply) || upstream == -1)
+        return;
+    relay(client, client, upstream);
+    close(upstream);
+}
+
+static void split_forward(const char* forward, char* host, size_t host_len, char* port)
+{
+    /* host:port, or [host]:port for IPv6 addresses */
+    const char* colon = strrchr(forward, ':');
+    size_t len = colon != NULL ? (size_t) (colon - forward) : strlen(forward);
+    if (len >= 2 && forward[0] == '[' && forward[len - 1] == ']')
+    {
+        forward += 1;
+        len -= 2;
+    }
+    if (len >= host_len)
+        len = host_len - 1;
+    memcpy(host, forward, len);
+    host[len] = '\0';
+    snprintf(port, 8, "%s", colon != NULL ? colon + 1 : "0");
+}
+
+static void serve_mux(int client)
+{
+    /* A forward request: "host:port", with the mux client's stdin
+     * and stdout attached
+     */
+    char request[300];
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    iov.iov_base = request;
+    iov.iov_len = sizeof(request) - 1;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    ssize_t n = recvmsg(client, &message, 0);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    if (n <= 0 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+        return;
+    int fds[2];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    request[n] = '\0';
+
+    char host[256];
+    char port[8];
+    split_forward(request, host, sizeof(host), port);
+    int upstream = connect_to(host, port);
+    if (upstream == -1)
+    {
+        fprintf(stderr, "fake ssh: cannot connect to %s\n", request);
+        return;
+    }
+    relay(fds[0], fds[1], upstream);
+    close(upstream);
+}
+
+static int mux_client(const char* path, const char* forward)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*) &address, sizeof(address)) == -1)
+    {
+        perror("fake ssh: control socket connect");
+        return 255;
+    }
+
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    int fds[2] = { STDIN_FILENO, STDOUT_FILENO };
+    struct iovec iov;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = (void*) forward;
+    iov.iov_len = strlen(forward);
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd, &message, 0) == -1)
+    {
+        perror("fake ssh: sendmsg");
+        return 255;
+    }
+    /* The master has our stdin and stdout now; wait for it to finish */
+    char byte;
+    while (read(fd, &byte, 1) > 0)
+        ;
+    return EXIT_SUCCESS;
+}
+
+static void serve_lane(int client, const char* forward)
+{
+    /* port:host:port */
+    char host[256];
+    char port[8];
+    const char* colon = strchr(forward, ':');
+    split_forward(colon != NULL ? colon + 1 : forward, host, sizeof(host), port);
+    int upstream = connect_to(host, port);
+    if (upstream == -1)
+        return;
+    relay(client, client, upstream);
+    close(upstream);
+}
+
+static void on_sigterm(int signum)
+{
+    (void) signum;
+    if (master_path != NULL)
+        unlink(master_path);
+    _exit(EXIT_SUCCESS);
+}
+
+static int listen_unix(const char* path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1
+            || bind(fd, (struct sockaddr*) &address, sizeof(address)) == -1
+            || listen(fd, SOMAXCONN) == -1)
+        return -1;
+    return fd;
+}
+
+static int listen_tcp(const char* port)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(struct sockaddr_in));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short) strtol(port, NULL, 10));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int yes = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1
+            || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1
+            || bind(fd, (struct sockaddr*) &address, sizeof(address)) == -1
+            || listen(fd, SOMAXCONN) == -1)
+        return -1;
+    return fd;
+}
+
+#define MAX_LANES 16
+
+int main(int argc, char** argv)
+{
+    const char* proxy_port = NULL;
+    const char* control_path = NULL;
+    const char* forward = NULL;
+    const char* lanes[MAX_LANES];
+    size_t n_lanes = 0;
+    int master = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-M") == 0)
+            master = 1;
+        else if (i == argc - 1)
+            break;
+        else if (strcmp(argv[i], "-D") == 0)
+            proxy_port = argv[++i];
+        else if (strcmp(argv[i], "-S") == 0)
+            control_path = argv[++i];
+        else if (strcmp(argv[i], "-W") == 0)
+            forward = argv[++i];
+        else if (strcmp(argv[i], "-L") == 0 && n_lanes < MAX_LANES)
+            lanes[n_lanes++] = argv[++i];
+        else if (strcmp(argv[i], "-F") == 0 || strcmp(argv[i], "-o") == 0
+                || strcmp(argv[i], "-p") == 0)
+            i += 1;
+    }
+    if (forward != NULL && control_path != NULL && ! master)
+        return mux_client(control_path, forward);
+    if (proxy_port == NULL && ! (master && control_path != NULL))
+    {
+        fprintf(stderr, "%s: need -D port, -M -S path or -S path -W host:port\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char* delay = getenv("FAKE_SSH_DELAY_MS");
+    long delay_ms = delay != NULL ? strtol(delay, NULL, 10) : 200;
+    const char* host_delays = getenv("FAKE_SSH_HOST_DELAYS");
+    size_t host_len = strlen(argv[argc - 1]);
+    for (const char* p = host_delays; p != NULL && *p != '\0'; )
+    {
+        if (strncmp(p, argv[argc - 1], host_len) == 0 && p[host_len] == '=')
+            delay_ms = strtol(p + host_len + 1, NULL, 10);
+        p = strchr(p, ',');
+        if (p != NULL)
+            p += 1;
+    }
+    if (delay_ms < 0)
+    {
+        fprintf(stderr, "fake ssh: connect to host %s: Connection refused\n", argv[argc - 1]);
+        return 255;
+    }
+    struct timespec pause;
+    pause.tv_sec = delay_ms / 1000;
+    pause.tv_nsec = (delay_ms % 1000) * 1000000L;
+    while (nanosleep(&pause, &pause) == -1 && errno == EINTR)
+        ;
+
+    int listen_fd;
+    if (master && proxy_port == NULL)
+    {
+        master_path = control_path;
+        signal(SIGTERM, on_sigterm);
+        listen_fd = listen_unix(control_path);
+    }
+    else
+    {
+        listen_fd = listen_tcp(proxy_port);
+    }
+    if (listen_fd == -1)
+    {
+        perror("fake ssh: listen");
+        return 255;
+    }
+    if (master && proxy_port != NULL)
+    {
+        /* like ssh, after the forwarding; never accepted */
+        master_path = control_path;
+        signal(SIGTERM, on_sigterm);
+        if (listen_unix(control_path) == -1)
+        {
+            perror("fake ssh: listen");
+            return 255;
+        }
+        master = 0;
+    }
+
+    /* pollfds[0] is the proxy or master; lanes[i] is pollfds[i + 1] */
+    struct pollfd pollfds[MAX_LANES + 1];
+    pollfds[0].fd = listen_fd;
+    for (size_t i = 0; i < n_lanes; ++i)
+    {
+        char port[8];
+        snprintf(port, sizeof(port), "%.*s", (int) strcspn(lanes[i], ":"), lanes[i]);
+        pollfds[i + 1].fd = listen_tcp(port);
+        if (pollfds[i + 1].fd == -1)
+        {
+            perror("fake ssh: listen");
+            return 255;
+        }
+    }
+    for (size_t i = 0; i <= n_lanes; ++i)
+        pollfds[i].events = POLLIN;
+
+    signal(SIGCHLD, SIG_IGN); /* relay children reap themselves */
+    signal(SIGPIPE, SIG_IGN);
+    while (1)
+    {
+        if (poll(pollfds, n_lanes + 1, -1) == -1)
+            continue;
+        for (size_t i = 0; i <= n_lanes; ++i)
+        {
+            if (pollfds[i].revents == 0)
+                continue;
+            int client = accept(pollfds[i].fd, NULL, NULL);
+            if (client == -1)
+                continue;
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                for (size_t j = 0; j <= n_lanes; ++j)
+                    close(pollfds[j].fd);
+                signal(SIGTERM, SIG_DFL);
+                signal(SIGCHLD, SIG_DFL);
+                if (i > 0)
+                    serve_lane(client, lanes[i - 1]);
+                else if (master)
+                    serve_mux(client);
+                else
+                    serve_socks5(client);
+                _exit(EXIT_SUCCESS);
+            }
+            close(client);
+        }
+    }
+}
@@ -0,0 +1,953 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+/*
+ * Load generator for ssh-tunneld's control port. Each scenario drives
+ * a running ssh-tunneld (normally one using the fake ssh in this
+ * directory) and reports latency percentiles and throughput:
+ *
+ *   cycle   clients concurrent connections, each repeating a 'C' then
+ *           a 'D' request, count cycles in all, on a warm tunnel
+ *   cold    count sequential 'C' requests, each on a stopped tunnel
+ *   race    the same, on an upstream with several candidate hosts, then
+ *           each host's races won and smoothed time; with -w host,
+ *           fails unless that host won every race and is rated fastest
+ *   linger  count sequential 'C'/'D' cycles a few ms apart; needs
+ *           ssh-tunneld -k, and reports how many reused the tunnel
+ *   kill    count rounds of clients framed sessions, half of them
+ *           reset while the tunnel starts and the rest once granted;
+ *           measures how long until every lease has been released
+ *   session count sequential ssh-tunnelc sessions to a local echo server,
+ *           each timed until its first byte comes back, on a warm tunnel
+ *   bulk    count megabytes echoed through one ssh-tunnelc session
+ *   startup count sequential ssh-tunnelc runs, each timed from exec until
+ *           its first byte comes back and until it exits, next to the
+ *           same for a program that does nothing (true), so that the
+ *           cost of ssh-tunnelc's own start-up can be seen
+ *
+ * The last three run the ssh-tunnelc given with -e (with -m dir passed
+ * on, to use ControlMaster mode), so that the SOCKS5 and ControlMaster
+ * data paths can be compared. With -L port, their echo server listens
+ * on that port rather than an ephemeral one, for ssh-tunneld to have a
+ * fast lane to (see lane.h).
+ *
+ * Exits with a failure status if ssh-tunneld stops making progress or
+ * leaks a lease.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+#define STALL_TIMEOUT_MS 10000
+
+#define BULK_CHUNK 65536
+
+static struct sockaddr_in control_address;
+static const char* control_port = "1081";
+static const char* tunnelc_path = "ssh-tunnelc";
+static const char* master_dir = NULL;
+static const char* lane_port = NULL; /* the echo server's, if fixed */
+static pid_t echo_pid = 0; /* killed on failure, too */
+static const char* expected_winner = NULL;
+
+static long long now_usec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec pause;
+    pause.tv_sec = ms / 1000;
+    pause.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&pause, &pause) == -1 && errno == EINTR)
+        ;
+}
+
+static void fail(const char* message)
+{
+    fprintf(stderr, "loadgen: %s\n", message);
+    if (echo_pid > 0)
+        kill(echo_pid, SIGTERM);
+    exit(EXIT_FAILURE);
+}
+
+/* Latency samples, in microseconds */
+struct samples {
+    long long* values;
+    size_t count;
+    size_t cap;
+};
+
+static void record(struct samples* samples, long long usec)
+{
+    if (samples->count == samples->cap)
+    {
+        samples->cap = samples->cap ? samples->cap * 2 : 1024;
+        samples->values = realloc(samples->values, samples->cap * sizeof(long long));
+        if (samples->values == NULL)
+            fail("out of memory");
+    }
+    samples->values[samples->count++] = usec;
+}
+
+static int compare_samples(const void* a, const void* b)
+{
+    long long x = *(const long long*) a;
+    long long y = *(const long long*) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(const struct samples* samples, double fraction)
+{
+    size_t index = (size_t) (fraction * (double) samples->count);
+    if (index >= samples->count)
+        index = samples->count - 1;
+    return (double) samples->values[index] / 1000.0;
+}
+
+static void report(const char* name, struct samples* samples, double seconds)
+{
+    if (samples->count == 0)
+    {
+        printf("%-14s no samples\n", name);
+        return;
+    }
+    qsort(samples->values, samples->count, sizeof(long long), compare_samples);
+    printf("%-14s %8zu ops %9.1f ops/s   p50 %8.3f ms   p99 %8.3f ms   p999 %8.3f ms   max %8.3f ms\n",
+            name, samples->count, seconds > 0 ? (double) samples->count / seconds : 0.0,
+            percentile_ms(samples, 0.50), percentile_ms(samples, 0.99),
+            percentile_ms(samples, 0.999), percentile_ms(samples, 1.0));
+    samples->count = 0;
+}
+
+static int open_control(int nonblocking)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        fail("socket() failed; raise the open file limit?");
+    if (nonblocking)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (connect(fd, (struct sockaddr*) &control_address, sizeof(control_address)) == -1
+            && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void reset_close(int fd)
+{
+    /* Close with RST, as a killed process's half-open connection
+     * would eventually be; the daemon sees an error, not EOF.
+     */
+    struct linger linger;
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+static void receive_all(int fd, unsigned char* buf, size_t len)
+{
+    size_t received = 0;
+    while (received < len)
+    {
+        ssize_t n = recv(fd, buf + received, len - received, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            fail("ssh-tunneld closed the control connection");
+        received += (size_t) n;
+    }
+}
+
+/* A one-byte request on its own connection, waiting for the reply */
+static void legacy_request(unsigned char message)
+{
+    int fd = open_control(0);
+    unsigned char reply;
+    if (fd == -1)
+        fail("cannot connect to ssh-tunneld");
+    if (send(fd, &message, 1, 0) != 1)
+        fail("send() failed");
+    receive_all(fd, &reply, 1);
+    if (reply != message)
+        fail("unexpected reply");
+    close(fd);
+}
+
+static void send_frame(int fd, unsigned int opcode, unsigned long request_id,
+        const unsigned char* payload, size_t len)
+{
+    unsigned char frame[PROTO_HEADER_LEN + 256];
+    struct proto_header header;
+    header.version = PROTO_VERSION;
+    header.opcode = opcode;
+    header.status = PROTO_OK;
+    header.request_id = request_id;
+    header.length = len;
+    proto_put_header(frame, &header);
+    if (len > 0)
+        memcpy(frame + PROTO_HEADER_LEN, payload, len);
+    if (send(fd, frame, PROTO_HEADER_LEN + len, 0) != (ssize_t) (PROTO_HEADER_LEN + len))
+        fail("send() failed");
+}
+
+/* Leases held and clients waiting, over every tunnel, and how many
+ * tunnels are running (not stopped) and lingering
+ */
+struct totals {
+    unsigned long leases;
+    unsigned long waiting;
+    unsigned int running;
+    unsigned int lingering;
+};
+
+static struct totals read_stats(int fd)
+{
+    static unsigned char payload[PROTO_MAX_PAYLOAD];
+    unsigned char header_bytes[PROTO_HEADER_LEN];
+    struct proto_header header;
+    struct totals totals;
+    memset(&totals, 0, sizeof(totals));
+
+    send_frame(fd, PROTO_STATS, 0, NULL, 0);
+    receive_all(fd, header_bytes, sizeof(header_bytes));
+    if (proto_get_header(header_bytes, &header) == -1 || header.status != PROTO_OK)
+        fail("STATS failed");
+    receive_all(fd, payload, header.length);
+    unsigned int n_tunnels = proto_get16(payload);
+    for (unsigned int i = 0; i < n_tunnels; ++i)
+    {
+        const unsigned char* entry = payload + 2 + 11 * i;
+        if (entry[2] != 0)
+            totals.running += 1;
+        if (entry[2] == 3)
+            totals.lingering += 1;
+        totals.leases += proto_get32(entry + 3);
+        totals.waiting += proto_get32(entry + 7);
+    }
+    return totals;
+}
+
+/* Wait until no lease is held and no client waits, and if stopped is
+ * set, until every tunnel has stopped; returns how long that took.
+ */
+static long long wait_for_idle(int stats_fd, int stopped)
+{
+    long long started = now_usec();
+    while (1)
+    {
+        struct totals totals = read_stats(stats_fd);
+        if (totals.leases == 0 && totals.waiting == 0 && (! stopped || totals.running == 0))
+            return now_usec() - started;
+        if (now_usec() - started > STALL_TIMEOUT_MS * 1000LL)
+        {
+            fprintf(stderr, "loadgen: leases=%lu waiting=%lu\n", totals.leases, totals.waiting);
+            fail("ssh-tunneld did not settle; leaked lease?");
+        }
+        sleep_ms(1);
+    }
+}
+
+static void wait_for_daemon(void)
+{
+    for (int i = 0; i < 500; ++i)
+    {
+        int fd = open_control(0);
+        if (fd != -1)
+        {
+            close(fd);
+            return;
+        }
+        sleep_ms(10);
+    }
+    fail("ssh-tunneld is not listening");
+}
+
+static int hold_lease(void)
+{
+    /* Take a lease on a framed connection, and keep it until the
+     * connection is closed
+     */
+    int fd = open_control(0);
+    unsigned char reply[PROTO_HEADER_LEN + 6];
+    if (fd == -1)
+        fail("cannot connect to ssh-tunneld");
+    send_frame(fd, PROTO_ACQUIRE, 1, NULL, 0);
+    receive_all(fd, reply, sizeof(reply));
+    return fd;
+}
+
+enum slot_state {
+    SLOT_IDLE,
+    SLOT_CONNECTING,
+    SLOT_WAITING
+};
+
+struct slot {
+    int fd;
+    enum slot_state state;
+    unsigned char request;
+    long long started;
+};
+
+static void slot_start(struct slot* slot, unsigned char request)
+{
+    slot->fd = open_control(1);
+    if (slot->fd == -1)
+        fail("cannot connect to ssh-tunneld");
+    slot->request = request;
+    slot->state = SLOT_CONNECTING;
+    slot->started = now_usec();
+}
+
+static void scenario_cycle(int n_clients, long n_cycles)
+{
+    struct slot* slots = calloc((size_t) n_clients, sizeof(struct slot));
+    struct pollfd* fds = calloc((size_t) n_clients, sizeof(struct pollfd));
+    struct samples acquire = { NULL, 0, 0 };
+    struct samples release = { NULL, 0, 0 };
+    if (slots == NULL || fds == NULL)
+        fail("out of memory");
+
+    /* Hold a lease throughout, so that the tunnel stays up and only
+     * the control path is measured.
+     */
+    int hold_fd = hold_lease();
+
+    long started_cycles = 0;
+    long finished_cycles = 0;
+    long long started = now_usec();
+    for (int i = 0; i < n_clients && started_cycles < n_cycles; ++i, ++started_cycles)
+        slot_start(&slots[i], 'C');
+
+    while (finished_cycles < n_cycles)
+    {
+        for (int i = 0; i < n_clients; ++i)
+        {
+            fds[i].fd = slots[i].state == SLOT_IDLE ? -1 : slots[i].fd;
+            fds[i].events = slots[i].state == SLOT_CONNECTING ? POLLOUT : POLLIN;
+            fds[i].revents = 0;
+        }
+        int ready = poll(fds, (nfds_t) n_clients, STALL_TIMEOUT_MS);
+        if (ready == 0)
+            fail("no progress; ssh-tunneld stalled");
+        if (ready == -1)
+            continue;
+        for (int i = 0; i < n_clients; ++i)
+        {
+            struct slot* slot = &slots[i];
+            if (fds[i].revents == 0)
+                continue;
+            if (slot->state == SLOT_CONNECTING)
+            {
+                int error = 0;
+                socklen_t len = sizeof(error);
+                getsockopt(slot->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+                if (error != 0 || send(slot->fd, &slot->request, 1, 0) != 1)
+                    fail("cannot connect to ssh-tunneld");
+                slot->state = SLOT_WAITING;
+                continue;
+            }
+            unsigned char reply;
+            ssize_t n = recv(slot->fd, &reply, 1, 0);
+            if (n == -1 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (n != 1 || reply != slot->request)
+                fail("bad reply from ssh-tunneld");
+            close(slot->fd);
+            slot->state = SLOT_IDLE;
+            if (slot->request == 'C')
+            {
+                record(&acquire, now_usec() - slot->started);
+                slot_start(slot, 'D');
+                continue;
+            }
+            record(&release, now_usec() - slot->started);
+            finished_cycles += 1;
+            if (started_cycles < n_cycles)
+            {
+                started_cycles += 1;
+                slot_start(slot, 'C');
+            }
+        }
+    }
+    double seconds = (double) (now_usec() - started) / 1e6;
+    close(hold_fd);
+
+    printf("cycle: %d clients, %ld C/D cycles, %.0f cycles/s\n",
+            n_clients, n_cycles, (double) n_cycles / seconds);
+    report("  acquire", &acquire, seconds);
+    report("  release", &release, seconds);
+    free(acquire.values);
+    free(release.values);
+    free(slots);
+    free(fds);
+}
+
+static void scenario_cold(long count)
+{
+    struct samples acquire = { NULL, 0, 0 };
+    int stats_fd = open_control(0);
+    if (stats_fd == -1)
+        fail("cannot connect to ssh-tunneld");
+    long long started = now_usec();
+    for (long i = 0; i < count; ++i)
+    {
+        wait_for_idle(stats_fd, 1);
+        long long t0 = now_usec();
+        legacy_request('C');
+        record(&acquire, now_usec() - t0);
+        legacy_request('D');
+    }
+    double seconds = (double) (now_usec() - started) / 1e6;
+    close(stats_fd);
+    printf("cold: %ld cold starts\n", count);
+    report("  acquire", &acquire, seconds);
+    free(acquire.values);
+}
+
+/* The value of each line of ssh-tunneld's metrics that starts with
+ * name (which includes any other label wanted) and has a host="..."
+ * label; returns how many were found
+ */
+#define MAX_HOSTS 8
+struct host_value {
+    char host[64];
+    double value;
+};
+
+static size_t read_host_metric(const char* metrics, const char* name,
+        const char* filter, struct host_value* values)
+{
+    size_t n = 0;
+    size_t name_len = strlen(name);
+    for (const char* line = metrics; line != NULL && *line != '\0' && n < MAX_HOSTS; )
+    {
+        const char* end = strchr(line, '\n');
+        const char* host = strstr(line, "host=\"");
+        const char* label = filter != NULL ? strstr(line, filter) : line;
+        if (strncmp(line, name, name_len) == 0 && host != NULL && (end == NULL || host < end)
+                && label != NULL && (end == NULL || label < end))
+        {
+            host += 6;
+            size_t len = strcspn(host, "\"");
+            if (len >= sizeof(values[n].host))
+                len = sizeof(values[n].host) - 1;
+            memcpy(values[n].host, host, len);
+            values[n].host[len] = '\0';
+            const char* value = strchr(host, ' ');
+            values[n].value = value != NULL ? strtod(value, NULL) : 0.0;
+            n += 1;
+        }
+        line = end != NULL ? end + 1 : NULL;
+    }
+    return n;
+}
+
+/* Check the racing statistics after races races: with -w host, that
+ * host must have won each and be rated fastest. Prints them if print.
+ */
+static void check_race(long races, int print)
+{
+    static unsigned char metrics[PROTO_MAX_PAYLOAD + 1];
+    int fd = open_control(0);
+    unsigned char header_bytes[PROTO_HEADER_LEN];
+    struct proto_header header;
+    if (fd == -1)
+        fail("cannot connect to ssh-tunneld");
+    send_frame(fd, PROTO_METRICS, 0, NULL, 0);
+    receive_all(fd, header_bytes, sizeof(header_bytes));
+    if (proto_get_header(header_bytes, &header) == -1 || header.status != PROTO_OK)
+        fail("METRICS failed");
+    receive_all(fd, metrics, header.length);
+    metrics[header.length] = '\0';
+    close(fd);
+
+    struct host_value wins[MAX_HOSTS];
+    struct host_value ready[MAX_HOSTS];
+    size_t n_wins = read_host_metric((char*) metrics,
+            "ssh_tunneld_candidate_races_total{", "result=\"won\"", wins);
+    size_t n_ready = read_host_metric((char*) metrics,
+            "ssh_tunneld_candidate_ready_seconds{", NULL, ready);
+    if (n_wins == 0 || n_wins != n_ready)
+        fail("no racing statistics; is there more than one host?");
+
+    /* Both are rendered host by host, in the same order */
+    int ok = expected_winner == NULL;
+    for (size_t i = 0; i < n_wins; ++i)
+    {
+        if (print)
+            printf("  %-16s won %4.0f of %ld races, rated %.3f s\n", wins[i].host,
+                    wins[i].value, races, ready[i].value);
+        if (expected_winner != NULL && strcmp(wins[i].host, expected_winner) == 0)
+        {
+            ok = wins[i].value == (double) races;
+            for (size_t j = 0; j < n_ready; ++j)
+            {
+                if (j != i && ready[j].value <= ready[i].value)
+                    ok = 0;
+            }
+        }
+    }
+    if (! ok)
+    {
+        fprintf(stderr, "loadgen: after race %ld\n", races);
+        fail("the fastest host did not win every race, or is not rated fastest");
+    }
+}
+
+static void scenario_race(long count)
+{
+    /* As cold, checking the ratings after each race, since a host
+     * misrated after one race may still win the next (only later)
+     */
+    struct samples acquire = { NULL, 0, 0 };
+    int stats_fd = open_control(0);
+    if (stats_fd == -1)
+        fail("cannot connect to ssh-tunneld");
+    long long started = now_usec();
+    for (long i = 0; i < count; ++i)
+    {
+        wait_for_idle(stats_fd, 1);
+        long long t0 = now_usec();
+        legacy_request('C');
+        record(&acquire, now_usec() - t0);
+        legacy_request('D');
+        check_race(i + 1, 0);
+    }
+    double seconds = (double) (now_usec() - started) / 1e6;
+    close(stats_fd);
+    printf("race: %ld cold starts, racing hosts\n", count);
+    report("  acquire", &acquire, seconds);
+    free(acquire.values);
+    check_race(count, 1);
+}
+
+static void scenario_linger(long count)
+{
+    struct samples acquire = { NULL, 0, 0 };
+    long hits = 0;
+    int stats_fd = open_control(0);
+    if (stats_fd == -1)
+        fail("cannot connect to ssh-tunneld");
+    long long started = now_usec();
+    for (long i = 0; i < count; ++i)
+    {
+        if (read_stats(stats_fd).lingering > 0)
+            hits += 1;
+        long long t0 = now_usec();
+        legacy_request('C');
+        record(&acquire, now_usec() - t0);
+        legacy_request('D');
+        sleep_ms(5);
+    }
+    double seconds = (double) (now_usec() - started) / 1e6;
+    close(stats_fd);
+    printf("linger: %ld cycles, %ld found the tunnel lingering\n", count, hits);
+    report("  acquire", &acquire, seconds);
+    free(acquire.values);
+}
+
+static void scenario_kill(int n_clients, long rounds)
+{
+    struct samples settle = { NULL, 0, 0 };
+    int* fds = calloc((size_t) n_clients, sizeof(int));
+    int stats_fd = open_control(0);
+    if (fds == NULL)
+        fail("out of memory");
+    if (stats_fd == -1)
+        fail("cannot connect to ssh-tunneld");
+
+    long long started = now_usec();
+    for (long round = 0; round < rounds; ++round)
+    {
+        wait_for_idle(stats_fd, 0);
+        for (int i = 0; i < n_clients; ++i)
+        {
+            fds[i] = open_control(0);
+            if (fds[i] == -1)
+                fail("cannot connect to ssh-tunneld");
+            send_frame(fds[i], PROTO_ACQUIRE, (unsigned long) i, NULL, 0);
+        }
+        /* Half die while parked on the starting tunnel ... */
+        for (int i = 0; i < n_clients; i += 2)
+            reset_close(fds[i]);
+        /* ... the rest once they hold their lease */
+        for (int i = 1; i < n_clients; i += 2)
+        {
+            unsigned char reply[PROTO_HEADER_LEN + 6];
+            receive_all(fds[i], reply, sizeof(reply));
+        }
+        for (int i = 1; i < n_clients; i += 2)
+            reset_close(fds[i]);
+        record(&settle, wait_for_idle(stats_fd, 0));
+    }
+    double seconds = (double) (now_usec() - started) / 1e6;
+    close(stats_fd);
+    printf("kill: %ld rounds of %d sessions, all leases released\n", rounds, n_clients);
+    report("  settle", &settle, seconds);
+    free(settle.values);
+    free(fds);
+}
+
+static void start_echo_server(char* port, size_t len)
+{
+    /* Echo every connection back to itself, on an ephemeral port
+     * unless there is a lane to it
+     */
+    struct sockaddr_in address;
+    socklen_t address_len = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (lane_port != NULL)
+        address.sin_port = htons((unsigned short) atoi(lane_port));
+    const int yes = 1;
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1
+            || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1
+            || bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) == -1
+            || listen(listen_fd, SOMAXCONN) == -1
+            || getsockname(listen_fd, (struct sockaddr*) &address, &address_len) == -1)
+        fail("cannot start the echo server");
+    snprintf(port, len, "%u", ntohs(address.sin_port));
+
+    pid_t pid = fork();
+    if (pid == -1)
+        fail("fork() failed");
+    if (pid > 0)
+    {
+        close(listen_fd);
+        echo_pid = pid;
+        return;
+    }
+    signal(SIGCHLD, SIG_IGN);
+    while (1)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1)
+            continue;
+        if (fork() == 0)
+        {
+            static char buf[BULK_CHUNK];
+            ssize_t n;
+            while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+            {
+                for (ssize_t sent = 0; sent < n; )
+                {
+                    ssize_t m = send(fd, buf + sent, (size_t) (n - sent), 0);
+                    if (m <= 0)
+                        _exit(EXIT_FAILURE);
+                    sent += m;
+                }
+            }
+            _exit(EXIT_SUCCESS);
+        }
+        close(fd);
+    }
+}
+
+static void stop_echo_server(void)
+{
+    kill(echo_pid, SIGTERM);
+    waitpid(echo_pid, NULL, 0);
+    echo_pid = 0;
+}
+
+extern char** environ;
+
+static pid_t spawn(char** argv, int* fd)
+{
+    /* Run argv with *fd connected to its stdin and stdout. posix_spawn()
+     * rather than fork(), so that our own size does not count.
+     */
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        fail("socketpair() failed");
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    if (posix_spawn_file_actions_init(&actions) != 0
+            || posix_spawn_file_actions_adddup2(&actions, sv[1], STDIN_FILENO) != 0
+            || posix_spawn_file_actions_adddup2(&actions, sv[1], STDOUT_FILENO) != 0
+            || posix_spawn_file_actions_addclose(&actions, sv[0]) != 0
+            || posix_spawn_file_actions_addclose(&actions, sv[1]) != 0
+            || posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ) != 0)
+        fail("cannot run ssh-tunnelc");
+    posix_spawn_file_actions_destroy(&actions);
+    close(sv[1]);
+    *fd = sv[0];
+    return pid;
+}
+
+static pid_t start_session(const char* port, int* fd)
+{
+    /* Run ssh-tunnelc to 127.0.0.1:port, as ssh would run it as a
+     * ProxyCommand; *fd is connected to its stdin and stdout.
+     */
+    char* argv[] = {
+        (char*) tunnelc_path, "-t", (char*) control_port, "-m", (char*) master_dir,
+        "127.0.0.1", (char*) port, NULL
+    };
+    if (master_dir == NULL)
+    {
+        argv[3] = argv[5];
+        argv[4] = argv[6];
+        argv[5] = NULL;
+    }
+    return spawn(argv, fd);
+}
+
+static void finish_session(pid_t pid, int fd)
+{
+    /* Half-close, drain the echo and check that ssh-tunnelc succeeded */
+    char buf[BULK_CHUNK];
+    int status;
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, buf, sizeof(buf), 0) > 0)
+        ;
+    close(fd);
+    if (waitpid(pid, &status, 0) == -1 || ! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fail("ssh-tunnelc failed");
+}
+
+static const char* path_name(void)
+{
+    if (master_dir != NULL)
+        return "ControlMaster";
+    return lane_port != NULL ? "fast lane" : "SOCKS5";
+}
+
+static void scenario_session(long count)
+{
+    struct samples setup = { NULL, 0, 0 };
+    char port[8];
+    start_echo_server(port, sizeof(port));
+    int hold_fd = hold_lease();
+
+    long long started = now_usec();
+    for (long i = 0; i < count; ++i)
+    {
+        int fd;
+        unsigned char byte = 'x';
+        long long t0 = now_usec();
+        pid_t pid = start_session(port, &fd);
+        if (send(fd, &byte, 1, 0) != 1)
+            fail("send() failed");
+        receive_all(fd, &byte, 1);
+        record(&setup, now_usec() - t0);
+        finish_session(pid, fd);
+    }
+    double seconds = (double) (now_usec() - started) / 1e6;
+    close(hold_fd);
+    stop_echo_server();
+    printf("session: %ld %s sessions, first byte echoed\n", count, path_name());
+    report("  setup", &setup, seconds);
+    free(setup.values);
+}
+
+static void scenario_startup(long count)
+{
+    struct samples baseline = { NULL, 0, 0 };
+    struct samples first_byte = { NULL, 0, 0 };
+    struct samples total = { NULL, 0, 0 };
+    char port[8];
+    start_echo_server(port, sizeof(port));
+    int hold_fd = hold_lease();
+    char* true_argv[] = { "true", NULL };
+
+    long long started = now_usec();
+    for (long i = 0; i < count; ++i)
+    {
+        int fd;
+        long long t0 = now_usec();
+        pid_t pid = spawn(true_argv, &fd);
+        if (waitpid(pid, NULL, 0) == -1)
+            fail("waitpid() failed");
+        record(&baseline, now_usec() - t0);
+        close(fd);
+
+        unsigned char byte = 'x';
+        t0 = now_usec();
+        pid = start_session(port, &fd);
+        if (send(fd, &byte, 1, 0) != 1)
+            fail("send() failed");
+        receive_all(fd, &byte, 1);
+        record(&first_byte, now_usec() - t0);
+        finish_session(pid, fd);
+        record(&total, now_usec() - t0);
+    }
+    double seconds = (double) (now_usec() - started) / 1e6;
+    close(hold_fd);
+    stop_echo_server();
+    printf("startup: %ld %s runs of ssh-tunnelc, from exec; baseline is true(1)\n",
+            count, path_name());
+    report("  baseline", &baseline, seconds);
+    report("  first byte", &first_byte, seconds);
+    report("  exit", &total, seconds);
+    free(baseline.values);
+    free(first_byte.values);
+    free(total.values);
+}
+
+static void scenario_bulk(long megabytes)
+{
+    static char out[BULK_CHUNK];
+    static char in[BULK_CHUNK];
+    char port[8];
+    start_echo_server(port, sizeof(port));
+    int hold_fd = hold_lease();
+    long long total = megabytes * 1024 * 1024;
+    long long sent = 0;
+    long long received = 0;
+    int fd;
+
+    memset(out, 'x', sizeof(out));
+    pid_t pid = start_session(port, &fd);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    long long started = now_usec();
+    while (received < total)
+    {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN | (sent < total ? POLLOUT : 0);
+        if (poll(&pfd, 1, STALL_TIMEOUT_MS) == 0)
+            fail("no progress; bulk transfer stalled");
+        if (sent < total && (pfd.revents & POLLOUT))
+        {
+            size_t len = total - sent < BULK_CHUNK ? (size_t) (total - sent) : BULK_CHUNK;
+            ssize_t n = send(fd, out, len, 0);
+            if (n > 0)
+                sent += n;
+            else if (errno != EAGAIN && errno != EINTR)
+                fail("send() failed");
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t n = recv(fd, in, sizeof(in), 0);
+            if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+                fail("session closed during bulk transfer");
+            if (n > 0)
+                received += n;
+        }
+    }
+    double seconds = (double) (now_usec() - started) / 1e6;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    finish_session(pid, fd);
+    close(hold_fd);
+    stop_echo_server();
+    printf("bulk: %ld MB echoed through one %s session in %.2f s, %.1f MB/s each way\n",
+            megabytes, path_name(), seconds, (double) megabytes / seconds);
+}
+
+static void usage(const char* program_name)
+{
+    fprintf(stderr,
+            "Usage:\n %s [-c clients] [-e ssh-tunnelc] [-L port] [-m dir] [-n count]\n"
+            "    [-t port] [-w host] cycle|cold|race|linger|kill|session|bulk|startup ...\n",
+            program_name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    int n_clients = 1000;
+    long count = 20000;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:e:L:m:n:t:w:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                n_clients = atoi(optarg);
+                break;
+            case 'e':
+                tunnelc_path = optarg;
+                break;
+            case 'L':
+                lane_port = optarg;
+                break;
+            case 'm':
+                master_dir = optarg;
+                break;
+            case 'n':
+                count = atol(optarg);
+                break;
+            case 't':
+                control_port = optarg;
+                break;
+            case 'w':
+                expected_winner = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc || n_clients <= 0 || count <= 0)
+        usage(argv[0]);
+
+    /* Every concurrent client needs a descriptor */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    memset(&control_address, 0, sizeof(control_address));
+    control_address.sin_family = AF_INET;
+    control_address.sin_port = htons((unsigned short) atoi(control_port));
+    control_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    wait_for_daemon();
+
+    for (int i = optind; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "cycle") == 0)
+            scenario_cycle(n_clients, count);
+        else if (strcmp(argv[i], "cold") == 0)
+            scenario_cold(count);
+        else if (strcmp(argv[i], "race") == 0)
+            scenario_race(count);
+        else if (strcmp(argv[i], "linger") == 0)
+            scenario_linger(count);
+        else if (strcmp(argv[i], "kill") == 0)
+            scenario_kill(n_clients, count);
+        else if (strcmp(argv[i], "session") == 0)
+            scenario_session(count);
+        else if (strcmp(argv[i], "bulk") == 0)
+            scenario_bulk(count);
+        else if (strcmp(argv[i], "startup") == 0)
+            scenario_startup(count);
+        else
+            usage(argv[0]);
+        fflush(stdout);
+    }
+    return EXIT_SUCCESS;
+}
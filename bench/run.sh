@@ -0,0 +1,105 @@
+#!/bin/sh
+#
+# This file is part of ssh-tunnel.
+# See the LICENSE file in the top-level directory
+# of the source distribution for further details.
+#
+# Run ssh-tunneld against the fake ssh in this directory and drive it
+# with loadgen. Everything stays on the loopback interface. Settings
+# can be overridden from the environment:
+#
+#   BENCH_PORT         control port (default 21081)
+#   BENCH_PROXY_PORT   SOCKS5 port of the fake ssh (default 21090)
+#   BENCH_ECHO_PORT    echo server with a fast lane to it (default 21100)
+#   BENCH_LANE_PORT    local port of the fast lane (default 21110)
+#   BENCH_CLIENTS      concurrent clients (default 1000)
+#   BENCH_CYCLES       C/D cycles in the cycle scenario (default 20000)
+#   BENCH_ROUNDS       cold starts, linger cycles and kill rounds (default 20)
+#   BENCH_SESSIONS     ssh-tunnelc sessions timed per data path, and runs
+#                      timed from exec (default 200)
+#   BENCH_BULK_MB      megabytes echoed through one session (default 256)
+#   FAKE_SSH_DELAY_MS  time the fake ssh takes to "log in" (default 200)
+#   BENCH_RACE_DELAYS  the same for the two hosts raced (FAKE_SSH_HOST_DELAYS;
+#                      default bench-fast=300,bench-slow=600)
+
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+tunneld="$here/../ssh-tunneld/ssh-tunneld"
+port=${BENCH_PORT:-21081}
+proxy_port=${BENCH_PROXY_PORT:-21090}
+echo_port=${BENCH_ECHO_PORT:-21100}
+lane_port=${BENCH_LANE_PORT:-21110}
+clients=${BENCH_CLIENTS:-1000}
+cycles=${BENCH_CYCLES:-20000}
+rounds=${BENCH_ROUNDS:-20}
+sessions=${BENCH_SESSIONS:-200}
+bulk_mb=${BENCH_BULK_MB:-256}
+tunnelc="$here/../ssh-tunnelc/ssh-tunnelc"
+FAKE_SSH_DELAY_MS=${FAKE_SSH_DELAY_MS:-200}
+race_delays=${BENCH_RACE_DELAYS:-bench-fast=300,bench-slow=600}
+hosts=bench-host
+export FAKE_SSH_DELAY_MS
+log="${TMPDIR:-/tmp}/ssh-tunneld-bench.$$.log"
+master_dir=$(mktemp -d "${TMPDIR:-/tmp}/ssh-tunneld-bench.XXXXXX")
+lanes="$master_dir/lanes"
+pid=
+
+stop_tunneld()
+{
+    if [ -n "$pid" ]; then
+        kill "$pid" 2>/dev/null || true
+        wait "$pid" 2>/dev/null || true
+        pid=
+    fi
+}
+
+start_tunneld()
+{
+    stop_tunneld
+    PATH="$here:$PATH" "$tunneld" -f -t "$port" -d "$proxy_port" "$@" $hosts 2>>"$log" &
+    pid=$!
+}
+
+trap 'stop_tunneld; rm -rf "$master_dir"' EXIT
+trap 'exit 1' INT TERM
+
+echo "ssh-tunneld benchmark: fake ssh delay ${FAKE_SSH_DELAY_MS}ms, log in $log"
+
+start_tunneld
+"$here/loadgen" -t "$port" -c "$clients" -n "$cycles" cycle
+"$here/loadgen" -t "$port" -n "$rounds" cold
+"$here/loadgen" -t "$port" -c "$clients" -n "$rounds" kill
+
+# Racing: the faster host must win every race and be started first,
+# so that no cold start after the first waits for the stagger
+hosts="bench-fast bench-slow"
+FAKE_SSH_HOST_DELAYS=$race_delays
+export FAKE_SSH_HOST_DELAYS
+start_tunneld
+"$here/loadgen" -t "$port" -n "$rounds" -w bench-fast race
+unset FAKE_SSH_HOST_DELAYS
+hosts=bench-host
+
+start_tunneld -k 5
+"$here/loadgen" -t "$port" -n "$rounds" linger
+
+# Data path: SOCKS5 through "ssh -D", then ControlMaster with "ssh -W"
+PATH="$here:$PATH" "$here/loadgen" -t "$port" -e "$tunnelc" -n "$sessions" session
+PATH="$here:$PATH" "$here/loadgen" -t "$port" -e "$tunnelc" -n "$sessions" startup
+PATH="$here:$PATH" "$here/loadgen" -t "$port" -e "$tunnelc" -n "$bulk_mb" bulk
+
+# Fast lane: "ssh -L" straight to the echo server, without SOCKS5
+echo "lane default 127.0.0.1 $echo_port $lane_port" >"$lanes"
+start_tunneld -u "$lanes"
+PATH="$here:$PATH" "$here/loadgen" -t "$port" -e "$tunnelc" -L "$echo_port" -n "$sessions" session
+PATH="$here:$PATH" "$here/loadgen" -t "$port" -e "$tunnelc" -L "$echo_port" -n "$sessions" startup
+PATH="$here:$PATH" "$here/loadgen" -t "$port" -e "$tunnelc" -L "$echo_port" -n "$bulk_mb" bulk
+
+start_tunneld -m "$master_dir"
+PATH="$here:$PATH" "$here/loadgen" -t "$port" -e "$tunnelc" -m "$master_dir" -n "$sessions" session
+PATH="$here:$PATH" "$here/loadgen" -t "$port" -e "$tunnelc" -m "$master_dir" -n "$sessions" startup
+PATH="$here:$PATH" "$here/loadgen" -t "$port" -e "$tunnelc" -m "$master_dir" -n "$bulk_mb" bulk
+
+stop_tunneld
+rm -f "$log"
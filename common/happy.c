@@ -0,0 +1,373 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "happy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define HAPPY_FILE_VERSION 1
+
+struct failure {
+    struct sockaddr_storage addr;
+    socklen_t addrlen; /* 0 if the entry is unused */
+    long long failed_ms; /* wall clock, to outlive the process */
+};
+
+/* Addresses that failed recently, and whether that has changed since
+ * happy_load()
+ */
+static struct failure failures[HAPPY_FAILURE_CACHE];
+static int failures_changed = 0;
+
+static long long clock_ms(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static long long now_ms(void)
+{
+    return clock_ms(CLOCK_MONOTONIC);
+}
+
+static long long wall_ms(void)
+{
+    return clock_ms(CLOCK_REALTIME);
+}
+
+static struct failure* find_failure(const struct addrinfo* address)
+{
+    for (size_t i = 0; i < HAPPY_FAILURE_CACHE; ++i)
+    {
+        if (failures[i].addrlen != 0 && failures[i].addrlen == address->ai_addrlen
+                && memcmp(&failures[i].addr, address->ai_addr, address->ai_addrlen) == 0)
+            return &failures[i];
+    }
+    return NULL;
+}
+
+static int recent(const struct failure* failure, long long now)
+{
+    /* One from the future means the clock was set back */
+    return failure->addrlen != 0 && now - failure->failed_ms < HAPPY_FAILURE_MS
+        && now >= failure->failed_ms;
+}
+
+static int failed_recently(const struct addrinfo* address, long long now)
+{
+    struct failure* failure = find_failure(address);
+    return failure != NULL && recent(failure, now);
+}
+
+static void remember_failure(const struct addrinfo* address)
+{
+    long long now = wall_ms();
+    if (address->ai_addrlen > sizeof(struct sockaddr_storage))
+        return;
+    struct failure* failure = find_failure(address);
+    if (failure == NULL)
+    {
+        /* An unused entry, or else the oldest */
+        failure = &failures[0];
+        for (size_t i = 1; i < HAPPY_FAILURE_CACHE && failure->addrlen != 0; ++i)
+        {
+            if (failures[i].addrlen == 0 || failures[i].failed_ms < failure->failed_ms)
+                failure = &failures[i];
+        }
+        memcpy(&failure->addr, address->ai_addr, address->ai_addrlen);
+        failure->addrlen = address->ai_addrlen;
+    }
+    failure->failed_ms = now;
+    failures_changed = 1;
+}
+
+static void forget_failure(const struct addrinfo* address)
+{
+    struct failure* failure = find_failure(address);
+    if (failure != NULL)
+    {
+        failure->addrlen = 0;
+        failures_changed = 1;
+    }
+}
+
+/* Alternate between the family of the first address and any other */
+static size_t interleave(const struct addrinfo** in, size_t n, const struct addrinfo** out)
+{
+    size_t first = 0;
+    size_t other = 0;
+    size_t k = 0;
+    while (k < n)
+    {
+        while (first < n && in[first]->ai_family != in[0]->ai_family)
+            first += 1;
+        if (first < n)
+            out[k++] = in[first++];
+        while (other < n && in[other]->ai_family == in[0]->ai_family)
+            other += 1;
+        if (other < n)
+            out[k++] = in[other++];
+    }
+    return k;
+}
+
+/* The order to try the addresses in (RFC 8305, section 4) */
+static size_t order_addresses(const struct addrinfo* list,
+        const struct addrinfo** order, long long now)
+{
+    const struct addrinfo* fresh[HAPPY_MAX_ATTEMPTS];
+    const struct addrinfo* stale[HAPPY_MAX_ATTEMPTS];
+    size_t n_fresh = 0;
+    size_t n_stale = 0;
+    for (const struct addrinfo* rp = list;
+            rp != NULL && n_fresh + n_stale < HAPPY_MAX_ATTEMPTS; rp = rp->ai_next)
+    {
+        if (failed_recently(rp, now))
+            stale[n_stale++] = rp;
+        else
+            fresh[n_fresh++] = rp;
+    }
+    size_t n = interleave(fresh, n_fresh, order);
+    return n + interleave(stale, n_stale, order + n);
+}
+
+/* Start connecting to address, with the socket in pfd; returns 1 if it
+ * connected at once, 0 if it is in progress, or -1 (with errno) if it
+ * failed.
+ */
+static int start_attempt(const struct addrinfo* address, struct pollfd* pfd, int* flags)
+{
+    pfd->events = POLLOUT;
+    pfd->revents = 0;
+    pfd->fd = socket(address->ai_family, SOCK_STREAM, address->ai_protocol);
+    if (pfd->fd == -1)
+        return -1;
+    *flags = fcntl(pfd->fd, F_GETFL, 0);
+    if (*flags != -1 && fcntl(pfd->fd, F_SETFL, *flags | O_NONBLOCK) != -1)
+    {
+        if (connect(pfd->fd, address->ai_addr, address->ai_addrlen) == 0)
+            return 1;
+        if (errno == EINPROGRESS || errno == EINTR)
+            return 0;
+    }
+    int error = errno;
+    close(pfd->fd);
+    pfd->fd = -1;
+    errno = error;
+    return -1;
+}
+
+int happy_connect(const struct addrinfo* list, int timeout_ms,
+        const struct addrinfo** winner)
+{
+    const struct addrinfo* order[HAPPY_MAX_ATTEMPTS];
+    struct pollfd pfds[HAPPY_MAX_ATTEMPTS]; /* fd -1 once finished */
+    int flags[HAPPY_MAX_ATTEMPTS];
+    long long now = now_ms();
+    long long deadline = now + timeout_ms;
+    size_t n = order_addresses(list, order, wall_ms());
+    size_t started = 0;
+    size_t running = 0;
+    size_t won = 0;
+    long long next_start = now;
+    int fd = -1;
+    int error = EHOSTUNREACH;
+
+    while (fd == -1)
+    {
+        now = now_ms();
+        if (now >= deadline)
+        {
+            error = ETIMEDOUT;
+            break;
+        }
+        if (started < n && now >= next_start)
+        {
+            size_t i = started++;
+            next_start = now + HAPPY_ATTEMPT_DELAY_MS;
+            int result = start_attempt(order[i], &pfds[i], &flags[i]);
+            if (result == 1)
+            {
+                fd = pfds[i].fd;
+                won = i;
+            }
+            else if (result == 0)
+            {
+                running += 1;
+            }
+            else
+            {
+                error = errno;
+                remember_failure(order[i]);
+                next_start = now; /* the next one at once */
+            }
+            continue;
+        }
+        if (running == 0 && started == n)
+            break; /* every one failed */
+
+        long long wait = deadline - now;
+        if (started < n && next_start - now < wait)
+            wait = next_start - now;
+        if (poll(pfds, (nfds_t) started, (int) wait) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            error = errno;
+            break;
+        }
+        for (size_t i = 0; i < started && fd == -1; ++i)
+        {
+            if (pfds[i].fd == -1 || pfds[i].revents == 0)
+                continue;
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &so_error, &len) == 0
+                    && so_error == 0)
+            {
+                fd = pfds[i].fd;
+                won = i;
+                break;
+            }
+            error = so_error != 0 ? so_error : errno;
+            close(pfds[i].fd);
+            pfds[i].fd = -1;
+            running -= 1;
+            remember_failure(order[i]);
+            next_start = now;
+        }
+    }
+
+    /* Those still connecting lost; if they started first, they are
+     * slower than the winner, and are tried after it next time.
+     */
+    now = now_ms();
+    for (size_t i = 0; i < started; ++i)
+    {
+        if (pfds[i].fd == -1 || (fd != -1 && i == won))
+            continue;
+        close(pfds[i].fd);
+        if (fd == -1 || i < won)
+            remember_failure(order[i]);
+    }
+    if (fd == -1)
+    {
+        errno = error;
+        return -1;
+    }
+
+    forget_failure(order[won]);
+    if (fcntl(fd, F_SETFL, flags[won]) == -1)
+    {
+        error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    if (winner != NULL)
+        *winner = order[won];
+    return fd;
+}
+
+void happy_load(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return;
+    char line[256];
+    char host[128];
+    char port[8];
+    long long failed_ms;
+    int version = 0;
+    size_t n = 0;
+    if (fgets(line, sizeof(line), file) != NULL
+            && sscanf(line, "ssh-tunnel-failures %d", &version) == 1
+            && version == HAPPY_FILE_VERSION)
+    {
+        while (n < HAPPY_FAILURE_CACHE && fgets(line, sizeof(line), file) != NULL)
+        {
+            /* Damaged lines are skipped; this is only a hint */
+            struct addrinfo hints;
+            struct addrinfo* address = NULL;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+            hints.ai_socktype = SOCK_STREAM;
+            if (sscanf(line, "%127s %7s %lld", host, port, &failed_ms) != 3
+                    || getaddrinfo(host, port, &hints, &address) != 0)
+                continue;
+            if (address->ai_addrlen <= sizeof(struct sockaddr_storage))
+            {
+                memcpy(&failures[n].addr, address->ai_addr, address->ai_addrlen);
+                failures[n].addrlen = address->ai_addrlen;
+                failures[n].failed_ms = failed_ms;
+                n += 1;
+            }
+            freeaddrinfo(address);
+        }
+    }
+    fclose(file);
+    failures_changed = 0;
+}
+
+void happy_save(const char* path)
+{
+    if (! failures_changed)
+        return;
+    failures_changed = 0;
+
+    /* Write a new file and rename it over the old, so that a run
+     * reading it meanwhile sees one or the other
+     */
+    long long now = wall_ms();
+    size_t len = strlen(path);
+    char* temporary = malloc(len + 8);
+    if (temporary == NULL)
+        return;
+    memcpy(temporary, path, len);
+    memcpy(temporary + len, ".XXXXXX", 8);
+    int fd = mkstemp(temporary);
+    FILE* file = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (file == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+            unlink(temporary);
+        }
+        free(temporary);
+        return;
+    }
+    fprintf(file, "ssh-tunnel-failures %d\n", HAPPY_FILE_VERSION);
+    for (size_t i = 0; i < HAPPY_FAILURE_CACHE; ++i)
+    {
+        char host[128];
+        char port[8];
+        if (! recent(&failures[i], now)
+                || getnameinfo((struct sockaddr*) &failures[i].addr, failures[i].addrlen,
+                    host, sizeof(host), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+            continue;
+        fprintf(file, "%s %s %lld\n", host, port, failures[i].failed_ms);
+    }
+    int failed = ferror(file);
+    failed |= fclose(file) != 0;
+    if (failed || rename(temporary, path) != 0)
+        unlink(temporary);
+    free(temporary);
+}
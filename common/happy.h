@@ -0,0 +1,61 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNEL_HAPPY_H
+#define SSH_TUNNEL_HAPPY_H
+
+#include <netdb.h>
+
+/*
+ * Happy Eyeballs (RFC 8305) connect, for a name with several addresses.
+ *
+ * The addresses are tried in the order getaddrinfo() returned them,
+ * but alternating between address families (starting with the family
+ * of the first), and with any that failed recently moved to the end.
+ * A new attempt is started every HAPPY_ATTEMPT_DELAY_MS, or as soon as
+ * one fails, without giving up on the earlier ones; the first to
+ * connect wins and the rest are closed. So an address whose route
+ * blackholes costs HAPPY_ATTEMPT_DELAY_MS, rather than the system's
+ * TCP connect timeout.
+ *
+ * An address that failed, or that was started before the winner but
+ * had not connected when it did, is remembered for HAPPY_FAILURE_MS
+ * (up to HAPPY_FAILURE_CACHE of them), so that later connects try the
+ * working address first. Nothing is allocated and only
+ * async-signal-safe functions are called, so a connect may be made
+ * from a signal handler.
+ *
+ * A program that runs once per connection (as ssh-tunnelc does) keeps
+ * the failures in a file with happy_load() and happy_save(), so that
+ * the next run does not pay for the same dead address again:
+ *
+ *   ssh-tunnel-failures 1
+ *   <numeric address> <port> <failed, in ms since the epoch>
+ */
+#define HAPPY_ATTEMPT_DELAY_MS 250
+#define HAPPY_MAX_ATTEMPTS 16 /* addresses beyond these are not tried */
+#define HAPPY_FAILURE_CACHE 8
+#define HAPPY_FAILURE_MS (10 * 60 * 1000)
+
+/* Connect to one of the addresses in list within timeout_ms. Returns a
+ * (blocking) socket descriptor, with the address it is connected to in
+ * *winner if winner is not NULL; or -1, with errno ETIMEDOUT if
+ * timeout_ms passed first, or the error of the last attempt to fail.
+ */
+int happy_connect(const struct addrinfo* list, int timeout_ms,
+        const struct addrinfo** winner);
+
+/* Read the failures remembered in path; a missing or damaged file is
+ * ignored, as the failures are only a hint
+ */
+void happy_load(const char* path);
+
+/* Write the failures still remembered to path, if they have changed
+ * since happy_load(); errors are ignored. Not for signal handlers.
+ */
+void happy_save(const char* path);
+
+#endif
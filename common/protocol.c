@@ -0,0 +1,93 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "protocol.h"
+
+#include <stdio.h>
+
+void proto_put16(unsigned char* buf, unsigned int value)
+{
+    buf[0] = (unsigned char) ((value >> 8) & 0xff);
+    buf[1] = (unsigned char) (value & 0xff);
+}
+
+void proto_put32(unsigned char* buf, unsigned long value)
+{
+    buf[0] = (unsigned char) ((value >> 24) & 0xff);
+    buf[1] = (unsigned char) ((value >> 16) & 0xff);
+    buf[2] = (unsigned char) ((value >> 8) & 0xff);
+    buf[3] = (unsigned char) (value & 0xff);
+}
+
+unsigned int proto_get16(const unsigned char* buf)
+{
+    return ((unsigned int) buf[0] << 8) | buf[1];
+}
+
+unsigned long proto_get32(const unsigned char* buf)
+{
+    return ((unsigned long) buf[0] << 24) | ((unsigned long) buf[1] << 16)
+        | ((unsigned long) buf[2] << 8) | buf[3];
+}
+
+void proto_put_header(unsigned char* buf, const struct proto_header* header)
+{
+    buf[0] = PROTO_MAGIC;
+    buf[1] = (unsigned char) header->version;
+    buf[2] = (unsigned char) header->opcode;
+    buf[3] = (unsigned char) header->status;
+    proto_put32(buf + 4, header->request_id);
+    proto_put16(buf + 8, (unsigned int) header->length);
+}
+
+int proto_get_header(const unsigned char* buf, struct proto_header* header)
+{
+    if (buf[0] != PROTO_MAGIC)
+        return -1;
+    header->version = buf[1];
+    header->opcode = buf[2];
+    header->status = buf[3];
+    header->request_id = proto_get32(buf + 4);
+    header->length = proto_get16(buf + 8);
+    return 0;
+}
+
+const char* proto_status_string(unsigned int status)
+{
+    switch (status)
+    {
+        case PROTO_OK:
+            return "success";
+        case PROTO_E_VERSION:
+            return "unsupported protocol version";
+        case PROTO_E_MALFORMED:
+            return "malformed request";
+        case PROTO_E_OPCODE:
+            return "unknown request";
+        case PROTO_E_NO_ROUTE:
+            return "no upstream for destination";
+        case PROTO_E_NO_LEASE:
+            return "unknown lease";
+        case PROTO_E_LIMIT:
+            return "too many leases";
+        case PROTO_E_RESOURCES:
+            return "out of resources";
+        case PROTO_E_TUNNEL:
+            return "tunnel failed to start";
+        default:
+            return "unknown error";
+    }
+}
+
+int proto_master_path(char* buf, size_t len, const char* dir, unsigned int port)
+{
+    int n = snprintf(buf, len, "%s/ssh-tunneld-%u", dir, port);
+    if (n < 0 || (size_t) n >= len || n >= PROTO_MASTER_PATH_MAX)
+        return -1;
+    return 0;
+}
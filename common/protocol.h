@@ -0,0 +1,118 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNEL_PROTOCOL_H
+#define SSH_TUNNEL_PROTOCOL_H
+
+#include <stddef.h>
+
+/*
+ * Framed control protocol, shared by ssh-tunneld and ssh-tunnelc.
+ *
+ * A connection whose first byte is PROTO_MAGIC (which is not one of
+ * the single-byte opcodes) carries frames in both directions for as
+ * long as it stays open. Every frame starts with a fixed header, all
+ * integers big-endian:
+ *
+ *   0  magic       PROTO_MAGIC
+ *   1  version     PROTO_VERSION
+ *   2  opcode      PROTO_ACQUIRE, ...
+ *   3  status      0 in requests; PROTO_OK or an error in replies
+ *   4  request id  4 bytes, chosen by the client, echoed in the reply
+ *   8  length      2 bytes, length of the payload that follows
+ *
+ * Requests may be pipelined: a client can send several without
+ * waiting, and replies (matched by request id) may come back in a
+ * different order, since an acquire waits for its tunnel to start.
+ *
+ *   ACQUIRE  payload: destination host (may be empty, for the default
+ *            upstream), optionally followed by a NUL byte and the
+ *            destination port (2). Reply: lease id (4), proxy port (2),
+ *            then, if the request gave the port, the local port of a
+ *            fast lane to the destination (2), or 0 if there is none
+ *            (older servers ignore the port, and send no lane). Leases
+ *            belong to the connection and are released when it closes
+ *            (or, once it has sent a HEARTBEAT, when they expire).
+ *            If the tunnel cannot be started, the reply has status
+ *            PROTO_E_TUNNEL and a human-readable reason as payload.
+ *   RELEASE  payload: lease id (4); also abandons a pending acquire.
+ *            Reply: empty.
+ *   STATS    payload: empty. Reply: number of tunnels (2), then for
+ *            each: proxy port (2), state (1), leases (4), waiting (4).
+ *   PING     payload: anything; echoed back.
+ *   METRICS  payload: empty. Reply: ssh-tunneld's metrics in the
+ *            Prometheus text format.
+ *   HEARTBEAT payload: empty, to renew every lease of the connection,
+ *            or a lease id (4), to renew that one. Reply: the lease
+ *            time-to-live in seconds (2), or 0 if leases never expire.
+ *            From the first heartbeat on, each of the connection's
+ *            leases is released (as by RELEASE) if it is not renewed
+ *            within that time, and the connection is closed once that
+ *            leaves it with none; so a client on another host that crashes
+ *            or is cut off does not hold its leases forever, even
+ *            though its connection may never be seen to close. Clients
+ *            should send one every third of the time-to-live.
+ *
+ * A bad magic byte, version or length ends the connection after the
+ * error reply, since the stream cannot be resynchronised.
+ */
+#define PROTO_MAGIC 0xA5
+#define PROTO_VERSION 1
+#define PROTO_HEADER_LEN 10
+#define PROTO_MAX_REQUEST 512 /* largest request payload accepted */
+#define PROTO_MAX_PAYLOAD 65535
+
+#define PROTO_ACQUIRE 1
+#define PROTO_RELEASE 2
+#define PROTO_STATS 3
+#define PROTO_PING 4
+#define PROTO_METRICS 5
+#define PROTO_HEARTBEAT 6
+
+#define PROTO_OK 0
+#define PROTO_E_VERSION 1 /* unsupported version */
+#define PROTO_E_MALFORMED 2 /* bad magic, length or payload */
+#define PROTO_E_OPCODE 3 /* unknown opcode */
+#define PROTO_E_NO_ROUTE 4 /* no upstream for the destination */
+#define PROTO_E_NO_LEASE 5 /* unknown lease id */
+#define PROTO_E_LIMIT 6 /* too many leases on one connection */
+#define PROTO_E_RESOURCES 7 /* out of memory */
+#define PROTO_E_TUNNEL 8 /* ssh failed, or was not ready in time */
+
+struct proto_header {
+    unsigned int version;
+    unsigned int opcode;
+    unsigned int status;
+    unsigned long request_id;
+    size_t length;
+};
+
+/* Write the header into buf, which has room for PROTO_HEADER_LEN bytes */
+void proto_put_header(unsigned char* buf, const struct proto_header* header);
+
+/* Read a header from buf; returns -1 if the magic byte is wrong */
+int proto_get_header(const unsigned char* buf, struct proto_header* header);
+
+void proto_put16(unsigned char* buf, unsigned int value);
+void proto_put32(unsigned char* buf, unsigned long value);
+unsigned int proto_get16(const unsigned char* buf);
+unsigned long proto_get32(const unsigned char* buf);
+
+/* Human-readable description of a status code */
+const char* proto_status_string(unsigned int status);
+
+/*
+ * In ControlMaster mode (ssh-tunneld -m dir), a tunnel's ssh process
+ * is a master listening on a Unix domain socket in dir instead of a
+ * SOCKS5 proxy, and its proxy port only names the socket. Both sides
+ * build the path the same way: dir/ssh-tunneld-<port>. Returns -1 if
+ * it would not fit in len bytes or in a socket address.
+ */
+#define PROTO_MASTER_PATH_MAX 104 /* smallest sun_path in common use */
+
+int proto_master_path(char* buf, size_t len, const char* dir, unsigned int port);
+
+#endif
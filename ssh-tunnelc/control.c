@@ -4,50 +4,319 @@
  * of the source distribution for further details.
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
 
 #include "control.h"
+#include "happy.h"
+#include "protocol.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 
 /* Global variables */
 char* tunneld_host;
 char* tunneld_port;
+char* tunneld_socket = NULL;
+int tunneld_timeout = 60;
+
+/* End of the current exchange, in monotonic milliseconds */
+static long long deadline = 0;
+
+/* Proxy port assigned by ssh-tunneld; 0 if none */
+static unsigned int assigned_port = 0;
+
+/* Local port of a fast lane to the destination; 0 if none */
+static unsigned int assigned_lane = 0;
+
+/* Control connection that holds our lease for the whole session;
+ * -1 if the lease was taken with a one-shot message instead.
+ */
+static int session_fd = -1;
+
+/* HEARTBEAT frame sent on session_fd, when ssh-tunneld wants them */
+static unsigned char heartbeat_frame[PROTO_HEADER_LEN];
+
+/* Address that a name given to establish_connection() resolved to, and
+ * the name; ssh-tunneld's host is usually also the SOCKS5 proxy's, and
+ * is connected to again to release the lease.
+ */
+static struct sockaddr_storage resolved_address;
+static socklen_t resolved_address_len = 0;
+static const char* resolved_host = NULL;
 
 /* Internal helper functions - declarations */
-int establish_connection(const char* hostname, const char* port);
-void send_message(const char* hostname, const char* port, char message);
+int open_control_connection(void);
+int receive_all(int sock_fd, unsigned char* buf, size_t len);
+int acquire_lease(const char* destination, size_t destination_len, int destination_port);
+void start_heartbeats(unsigned int ttl_seconds);
+void report_failure(int sock_fd, size_t reason_len);
+int send_message(const unsigned char* message, size_t message_len,
+        unsigned char* reply, size_t reply_len);
+static int parse_port(const char* port);
 
 /* Definitions of functions declared in the header */
-void connection_start(void)
+void connection_start(const char* destination, const char* destination_port,
+        char* proxy_port, char* lane_port, size_t len)
 {
-    send_message(tunneld_host, tunneld_port, 'C');
+    /* Tell ssh-tunneld where we are going, so that it can pick the
+     * upstream and the least-loaded tunnel to it, and keep the control
+     * connection open: ssh-tunneld releases the lease when it closes,
+     * even if we are killed. A daemon that predates the framed
+     * protocol hangs up without replying, in which case fall back to
+     * 'C' and the default proxy port.
+     */
+    deadline_start();
+    size_t destination_len = strlen(destination);
+    if (destination_len <= 255
+            && acquire_lease(destination, destination_len,
+                destination_port != NULL ? parse_port(destination_port) : -1) == 0)
+    {
+        snprintf(proxy_port, len, "%u", assigned_port);
+        if (assigned_lane != 0)
+            snprintf(lane_port, len, "%u", assigned_lane);
+        return;
+    }
+
+    const unsigned char request = 'C';
+    unsigned char reply[1];
+    if (send_message(&request, 1, reply, 1) != 0)
+    {
+        fprintf(stderr, "Connection to ssh-tunneld closed unexpectedly. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
 void connection_stop(void)
 {
-    send_message(tunneld_host, tunneld_port, 'D');
+    if (session_fd != -1)
+    {
+        /* Closing the session connection releases the lease; this
+         * is all that is needed, and is safe in a signal handler.
+         * Forget it first, so that a heartbeat does not use it.
+         */
+        int fd = session_fd;
+        session_fd = -1;
+        close(fd);
+        return;
+    }
+
+    /* The address resolved for the request is reused, so nothing
+     * here calls getaddrinfo() (which a signal handler must not).
+     */
+    unsigned char request[3] = { 'D', 0, 0 };
+    size_t request_len = 1;
+    unsigned char reply[1];
+    deadline_start();
+    if (assigned_port != 0)
+    {
+        request[0] = 'R';
+        request[1] = (unsigned char) (assigned_port >> 8);
+        request[2] = (unsigned char) (assigned_port & 0xff);
+        request_len = 3;
+    }
+    if (send_message(request, request_len, reply, 1) != 0)
+    {
+        fprintf(stderr, "Connection to ssh-tunneld closed unexpectedly. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static long long now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void deadline_start(void)
+{
+    deadline = now_ms() + (long long) tunneld_timeout * 1000;
+}
+
+int deadline_wait(int fd, short events)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    while (1)
+    {
+        long long remaining = deadline - now_ms();
+        if (remaining < 0)
+            remaining = 0;
+        pfd.revents = 0;
+        int n = poll(&pfd, 1, (int) remaining);
+        if (n > 0)
+            return 0; /* ready, or an error for the caller to see */
+        if (n == 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (errno != EINTR)
+            return -1;
+    }
 }
 
 /* Internal helper functions - definitions */
+int establish_local_connection(const char* path)
+{
+    /*
+     * Connects to the Unix domain socket at path.
+     * Returns a socket descriptor, or -1 on error.
+     */
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd == -1)
+        return -1;
+    if (connect(socket_fd, (struct sockaddr*) &address, sizeof(struct sockaddr_un)) == -1)
+    {
+        perror(path);
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+static int parse_port(const char* port)
+{
+    /* Returns the port number, or -1 if port is not numeric
+     * (a service name, which only the resolver can look up).
+     */
+    char* end = NULL;
+    long value = strtol(port, &end, 10);
+    if (end == port || *end != '\0' || value < 0 || value > 65535)
+        return -1;
+    return (int) value;
+}
+
+static void set_port(struct sockaddr_storage* address, int port)
+{
+    if (address->ss_family == AF_INET6)
+        ((struct sockaddr_in6*) address)->sin6_port = htons((unsigned short) port);
+    else
+        ((struct sockaddr_in*) address)->sin_port = htons((unsigned short) port);
+}
+
+static int numeric_address(const char* hostname, int port,
+        struct sockaddr_storage* address, socklen_t* address_len)
+{
+    /* Fill in address if hostname is an IPv4 or IPv6 literal, which
+     * is the usual case (127.0.0.1 by default); returns -1 if it is
+     * a name to be resolved.
+     */
+    memset(address, 0, sizeof(struct sockaddr_storage));
+    struct sockaddr_in* v4 = (struct sockaddr_in*) address;
+    struct sockaddr_in6* v6 = (struct sockaddr_in6*) address;
+    if (inet_pton(AF_INET, hostname, &v4->sin_addr) == 1)
+    {
+        v4->sin_family = AF_INET;
+        *address_len = sizeof(struct sockaddr_in);
+    }
+    else if (inet_pton(AF_INET6, hostname, &v6->sin6_addr) == 1)
+    {
+        v6->sin6_family = AF_INET6;
+        *address_len = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+        return -1;
+    }
+    set_port(address, port);
+    return 0;
+}
+
+static int connect_addresses(const struct addrinfo* list, const char* hostname,
+        const char* port, const struct addrinfo** winner)
+{
+    /* Connect to one of the addresses (see happy.h), giving up at
+     * the deadline. Returns a socket descriptor, or -1 on error.
+     */
+    long long remaining = deadline - now_ms();
+    if (remaining < 0)
+        remaining = 0;
+    int socket_fd = happy_connect(list, (int) remaining, winner);
+    if (socket_fd == -1 && errno == ETIMEDOUT)
+        fprintf(stderr, "Timed out connecting to %s:%s\n", hostname, port);
+    return socket_fd;
+}
+
+static int connect_address(const struct sockaddr* address, socklen_t address_len,
+        const char* hostname, const char* port)
+{
+    struct addrinfo single;
+    memset(&single, 0, sizeof(struct addrinfo));
+    single.ai_family = address->sa_family;
+    single.ai_socktype = SOCK_STREAM;
+    single.ai_addr = (struct sockaddr*) address;
+    single.ai_addrlen = address_len;
+    return connect_addresses(&single, hostname, port, NULL);
+}
+
 int establish_connection(const char* hostname, const char* port)
 {
     /*
      * Looks up hostname:port and attempts to connect to it.
      * Returns a socket descriptor if a successful connection
      * was established, or -1 on error.
+     *
+     * Numeric addresses are used as they are, and a name that
+     * was resolved before is not resolved again, so that
+     * getaddrinfo() (slow, and not safe in a signal handler) is
+     * called at most once per run, and only for a real name.
      */
     struct addrinfo hints;
-    struct addrinfo *result, *rp;
-    int socket_fd;
+    struct addrinfo* result;
+    struct sockaddr_storage address;
+    socklen_t address_len = 0;
+    int socket_fd = -1;
     int gai_return_value;
 
+    int port_number = parse_port(port);
+    if (port_number != -1)
+    {
+        if (numeric_address(hostname, port_number, &address, &address_len) == 0)
+        {
+            socket_fd = connect_address((struct sockaddr*) &address, address_len,
+                    hostname, port);
+            if (socket_fd == -1)
+                fprintf(stderr, "Could not connect to %s:%s\n", hostname, port);
+            return socket_fd;
+        }
+        if (resolved_host != NULL && strcmp(resolved_host, hostname) == 0)
+        {
+            address = resolved_address;
+            set_port(&address, port_number);
+            socket_fd = connect_address((struct sockaddr*) &address,
+                    resolved_address_len, hostname, port);
+            if (socket_fd != -1)
+                return socket_fd;
+            /* Perhaps the name now means somewhere else */
+        }
+    }
+
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
@@ -61,26 +330,23 @@ int establish_connection(const char* hostname, const char* port)
     }
 
     /*
-     * Try each address returned by getaddrinfo
-     * in turn
+     * Race the addresses returned by getaddrinfo, so that
+     * one that does not answer (an IPv6 route that goes
+     * nowhere, say) does not hold up the others
      */
-    for(rp = result; rp != NULL; rp = rp->ai_next)
-    {
-        socket_fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (socket_fd == -1)
-            continue;
-
-        if (connect(socket_fd, rp->ai_addr, rp->ai_addrlen) != -1)
-            break; /* Successfully connected */
-
-        close(socket_fd);
-    }
-
-    if (rp == NULL)
+    const struct addrinfo* winner = NULL;
+    socket_fd = connect_addresses(result, hostname, port, &winner);
+    if (socket_fd == -1)
     {
         /* no attempt to connect succeeded */
         fprintf(stderr, "Could not connect to %s:%s\n", hostname, port);
-        socket_fd = -1;
+    }
+    else if (winner->ai_addrlen <= sizeof(resolved_address))
+    {
+        /* Remember the address that worked, for next time */
+        memcpy(&resolved_address, winner->ai_addr, winner->ai_addrlen);
+        resolved_address_len = winner->ai_addrlen;
+        resolved_host = hostname;
     }
 
     freeaddrinfo(result); /* no longer need the address structures */
@@ -88,20 +354,227 @@ int establish_connection(const char* hostname, const char* port)
     return socket_fd;
 }
 
-void send_message(const char* hostname, const char* port, char message)
+int open_control_connection(void)
 {
-    /* Connect to ssh-tunneld and deliver the message
-     * to either open or close a connection.
-     * Expect ssh-tunneld to be listening on port 1081.
+    /* Connect to ssh-tunneld, over its Unix domain socket if one
+     * was given. Exits if ssh-tunneld cannot be reached.
      */
-    int sock_fd = establish_connection(hostname, port);
+    int sock_fd = tunneld_socket != NULL
+        ? establish_local_connection(tunneld_socket)
+        : establish_connection(tunneld_host, tunneld_port);
     if (sock_fd == -1)
     {
-        fprintf(stderr, "Could not connect to ssh-tunneld running on %s:%s\n", hostname, port);
+        if (tunneld_socket != NULL)
+            fprintf(stderr, "Could not connect to ssh-tunneld on %s\n", tunneld_socket);
+        else
+            fprintf(stderr, "Could not connect to ssh-tunneld running on %s:%s\n",
+                    tunneld_host, tunneld_port);
+        exit(EXIT_FAILURE);
+    }
+    return sock_fd;
+}
+
+int receive_all(int sock_fd, unsigned char* buf, size_t len)
+{
+    /* Read exactly len bytes. Returns -1 if the
+     * connection was closed first.
+     */
+    size_t received = 0;
+    while (received < len)
+    {
+        if (deadline_wait(sock_fd, POLLIN) == -1)
+        {
+            if (errno == ETIMEDOUT)
+                fprintf(stderr, "No reply from ssh-tunneld within %d seconds. Exiting.\n",
+                        tunneld_timeout);
+            else
+                perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        ssize_t n = recv(sock_fd, buf + received, len - received, 0);
+        if (n == 0)
+            return -1;
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("recv");
+            exit(EXIT_FAILURE);
+        }
+        received += (size_t) n;
+    }
+    return 0;
+}
+
+int acquire_lease(const char* destination, size_t destination_len, int destination_port)
+{
+    /* Take a lease with a framed ACQUIRE, and keep the connection
+     * open as session_fd. Returns -1 if ssh-tunneld closed the
+     * connection without replying (it does not speak frames).
+     *
+     * A HEARTBEAT goes first, in the same packet: from then on the
+     * lease is released if we stop renewing it (say, our host is cut
+     * off from ssh-tunneld's), and the reply says how often to renew.
+     * ssh-tunneld answers it at once, so its reply comes first; one
+     * that predates heartbeats answers it with an error, and its
+     * leases never expire.
+     *
+     * The destination port, if it is numeric, follows the host after a
+     * NUL; ssh-tunneld then says in its reply whether there is a fast
+     * lane to it (one that does not know of lanes sees only the host).
+     */
+    unsigned char request[2 * PROTO_HEADER_LEN + 255 + 3];
+    unsigned char reply[PROTO_HEADER_LEN + 8];
+    size_t payload_len = destination_len;
+    unsigned int ttl_seconds = 0;
+    struct proto_header header;
+    header.version = PROTO_VERSION;
+    header.opcode = PROTO_HEARTBEAT;
+    header.status = PROTO_OK;
+    header.request_id = 2;
+    header.length = 0;
+    proto_put_header(request, &header);
+    memcpy(request + 2 * PROTO_HEADER_LEN, destination, destination_len);
+    if (destination_port > 0)
+    {
+        request[2 * PROTO_HEADER_LEN + destination_len] = '\0';
+        proto_put16(request + 2 * PROTO_HEADER_LEN + destination_len + 1,
+                (unsigned int) destination_port);
+        payload_len += 3;
+    }
+    header.opcode = PROTO_ACQUIRE;
+    header.request_id = 1;
+    header.length = payload_len;
+    proto_put_header(request + PROTO_HEADER_LEN, &header);
+
+    int sock_fd = open_control_connection();
+    size_t request_len = 2 * PROTO_HEADER_LEN + payload_len;
+    if (send(sock_fd, request, request_len, 0) != (ssize_t) request_len)
+    {
+        perror("send");
+        exit(EXIT_FAILURE);
+    }
+    while (1)
+    {
+        if (receive_all(sock_fd, reply, PROTO_HEADER_LEN) == -1)
+        {
+            close(sock_fd);
+            return -1;
+        }
+        if (proto_get_header(reply, &header) == -1
+                || header.opcode != PROTO_HEARTBEAT || header.request_id != 2)
+            break;
+        if (header.length > 6 || receive_all(sock_fd, reply + PROTO_HEADER_LEN,
+                    header.length) == -1)
+        {
+            fprintf(stderr, "Received incorrect response from ssh-tunneld. Exiting.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (header.status == PROTO_OK && header.length == 2)
+            ttl_seconds = proto_get16(reply + PROTO_HEADER_LEN);
+    }
+    if (proto_get_header(reply, &header) == -1
+            || header.opcode != PROTO_ACQUIRE || header.request_id != 1)
+    {
+        fprintf(stderr, "Received incorrect response from ssh-tunneld. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (header.status == PROTO_E_TUNNEL)
+    {
+        fprintf(stderr, "ssh-tunneld refused the tunnel: %s", proto_status_string(header.status));
+        report_failure(sock_fd, header.length);
+    }
+    if (header.status != PROTO_OK)
+    {
+        fprintf(stderr, "ssh-tunneld refused the tunnel: %s. Exiting.\n",
+                proto_status_string(header.status));
+        exit(EXIT_FAILURE);
+    }
+    if ((header.length != 6 && header.length != 8)
+            || receive_all(sock_fd, reply + PROTO_HEADER_LEN, header.length) == -1)
+    {
+        fprintf(stderr, "Received incorrect response from ssh-tunneld. Exiting.\n");
         exit(EXIT_FAILURE);
     }
+    assigned_port = proto_get16(reply + PROTO_HEADER_LEN + 4);
+    if (header.length == 8)
+        assigned_lane = proto_get16(reply + PROTO_HEADER_LEN + 6);
+    session_fd = sock_fd;
+    if (ttl_seconds > 0)
+        start_heartbeats(ttl_seconds);
+    return 0;
+}
+
+static void on_heartbeat(int signum)
+{
+    (void) signum;
+    int saved_errno = errno;
+    int fd = session_fd;
+    if (fd != -1)
+    {
+        /* Throw away the replies to earlier heartbeats, then send
+         * another; the socket is non-blocking, so neither waits.
+         */
+        unsigned char discard[256];
+        while (recv(fd, discard, sizeof(discard), 0) > 0)
+            continue;
+        /* If this fails, so be it: the lease goes if ssh-tunneld has */
+        (void) send(fd, heartbeat_frame, sizeof(heartbeat_frame), 0);
+    }
+    errno = saved_errno;
+}
+
+void start_heartbeats(unsigned int ttl_seconds)
+{
+    /* Renew the lease from a SIGALRM handler every third of its
+     * time-to-live, whatever the rest of the program is doing (which
+     * may be waiting for ssh -W to exit).
+     */
+    struct proto_header header;
+    header.version = PROTO_VERSION;
+    header.opcode = PROTO_HEARTBEAT;
+    header.status = PROTO_OK;
+    header.request_id = 3;
+    header.length = 0;
+    proto_put_header(heartbeat_frame, &header);
+
+    int flags = fcntl(session_fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(session_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+        return;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = on_heartbeat;
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGALRM, &sa, NULL) != 0)
+    {
+        perror("sigaction");
+        return;
+    }
+    long long interval_ms = (long long) ttl_seconds * 1000 / 3;
+    struct itimerval timer;
+    timer.it_interval.tv_sec = (time_t) (interval_ms / 1000);
+    timer.it_interval.tv_usec = (suseconds_t) (interval_ms % 1000) * 1000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_REAL, &timer, NULL) != 0)
+        perror("setitimer");
+}
+
+int send_message(const unsigned char* message, size_t message_len,
+        unsigned char* reply, size_t reply_len)
+{
+    /* Connect to ssh-tunneld and deliver the message
+     * to either open or close a connection.
+     * Expect ssh-tunneld to be listening on port 1081.
+     * The reply must echo the message's first byte.
+     * Returns 0 on success, or -1 if ssh-tunneld closed
+     * the connection without replying.
+     */
+    int sock_fd = open_control_connection();
     /* now send a message to the ssh-tunneld */
-    if (send(sock_fd, &message, sizeof(message), 0) != 1)
+    if (send(sock_fd, message, message_len, 0) != (ssize_t) message_len)
     {
         perror("send");
         exit(EXIT_FAILURE);
@@ -109,19 +582,43 @@ void send_message(const char* hostname, const char* port, char message)
     /* read the response that tells us when the tunnel is active (or that our disconnect request
      * was acknowledge)
      */
-    char buffer[1];
-    if (recv(sock_fd, &buffer, sizeof(buffer), 0) != 1)
+    if (receive_all(sock_fd, reply, reply_len) == -1)
     {
-        perror("recv");
-        exit(EXIT_FAILURE);
+        close(sock_fd);
+        return -1;
+    }
+    if (reply[0] == 'E')
+    {
+        /* the tunnel could not be started; a reason follows */
+        unsigned char reason_len = 0;
+        fprintf(stderr, "ssh-tunneld could not start the tunnel");
+        if (receive_all(sock_fd, &reason_len, 1) == -1)
+            reason_len = 0;
+        report_failure(sock_fd, reason_len);
     }
-    if (buffer[0] != message)
+    if (reply[0] != message[0])
     {
         fprintf(stderr, "Received incorrect response from ssh-tunneld. Exiting.\n");
         exit(EXIT_FAILURE);
     }
     /* finally close the socket */
     close(sock_fd);
+    return 0;
 }
 
-
+void report_failure(int sock_fd, size_t reason_len)
+{
+    /* Finish the message begun by the caller with the reason that
+     * ssh-tunneld sent (reason_len bytes), then exit.
+     */
+    unsigned char reason[256];
+    if (reason_len >= sizeof(reason))
+        reason_len = sizeof(reason) - 1;
+    if (reason_len == 0 || receive_all(sock_fd, reason, reason_len) == -1)
+        reason_len = 0;
+    reason[reason_len] = '\0';
+    if (reason_len > 0)
+        fprintf(stderr, " (%s)", (const char*) reason);
+    fprintf(stderr, ". Exiting.\n");
+    exit(EXIT_FAILURE);
+}
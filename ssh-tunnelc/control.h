@@ -7,10 +7,37 @@
 #ifndef SSH_TUNNELC_CONTROL_H
 #define SSH_TUNNELC_CONTROL_H
 
-void connection_start(void);
+#include <stddef.h>
+
+/* Ask ssh-tunneld for a tunnel towards destination. If it
+ * assigns a proxy port, the port is written to proxy_port; if it has
+ * a fast lane to destination_port (which may be NULL, to ask for
+ * none), the lane's port to lane_port. Both have room for len bytes.
+ */
+void connection_start(const char* destination, const char* destination_port,
+        char* proxy_port, char* lane_port, size_t len);
 void connection_stop(void);
 
+/* Connect to hostname:port; returns a socket, or -1 on error */
+int establish_connection(const char* hostname, const char* port);
+
+/* Connect to the Unix domain socket at path; returns -1 on error */
+int establish_local_connection(const char* path);
+
+/* Start the deadline (tunneld_timeout seconds from now) for an
+ * exchange with ssh-tunneld or the SOCKS5 proxy. Connects and replies
+ * that take longer are given up on rather than waited for forever.
+ */
+void deadline_start(void);
+
+/* Wait until fd is ready for events (POLLIN or POLLOUT), or the
+ * deadline passes; returns 0 if ready, or -1 with errno ETIMEDOUT.
+ */
+int deadline_wait(int fd, short events);
+
 extern char* tunneld_host;
 extern char* tunneld_port;
+extern char* tunneld_socket; /* Unix domain socket path, or NULL */
+extern int tunneld_timeout; /* seconds */
 
 #endif
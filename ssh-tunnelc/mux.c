@@ -0,0 +1,84 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "mux.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+static volatile pid_t ssh_process = 0;
+
+int mux_forward(const char* control_path, const char* host, const char* port)
+{
+    /* -W takes host:port, with IPv6 addresses in brackets */
+    char forward[300];
+    const char* format = strchr(host, ':') != NULL ? "[%s]:%s" : "%s:%s";
+    int n = snprintf(forward, sizeof(forward), format, host, port);
+    if (n < 0 || (size_t) n >= sizeof(forward))
+    {
+        fprintf(stderr, "Destination too long: %s\n", host);
+        return -1;
+    }
+    char* argv[] = {
+        "ssh",
+        "-F",
+        "/dev/null",
+        "-o",
+        "ControlMaster=no",
+        "-o",
+        "ProxyCommand=false",
+        "-S",
+        (char*) control_path,
+        "-W",
+        forward,
+        "ssh-tunneld",
+        NULL
+    };
+
+    /* posix_spawnp() rather than fork() and exec: it need not copy
+     * our page tables (glibc uses a vfork-like clone), and ssh is
+     * run for every session.
+     */
+    pid_t pid;
+    int error = posix_spawnp(&pid, "ssh", NULL, NULL, argv, environ);
+    if (error != 0)
+    {
+        fprintf(stderr, "ssh: %s\n", strerror(error));
+        return -1;
+    }
+    ssh_process = pid;
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+    {
+        if (errno != EINTR)
+        {
+            perror("waitpid");
+            return -1;
+        }
+    }
+    ssh_process = 0;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+void mux_stop(void)
+{
+    pid_t pid = ssh_process;
+    if (pid > 0)
+        kill(pid, SIGTERM);
+}
@@ -0,0 +1,28 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELC_MUX_H
+#define SSH_TUNNELC_MUX_H
+
+/*
+ * Open a channel to host:port through the ssh ControlMaster listening
+ * on control_path, by running "ssh -S control_path -W host:port" on
+ * our stdin and stdout, and wait for it to finish. The mux client
+ * hands those descriptors to the master, so no data passes through
+ * this process or a SOCKS5 proxy.
+ *
+ * ssh is run without any ssh_config, and may not fall back to a
+ * connection of its own if the master is missing, since that would
+ * run this command again through ProxyCommand.
+ *
+ * Returns 0 if ssh exited successfully, -1 otherwise.
+ */
+int mux_forward(const char* control_path, const char* host, const char* port);
+
+/* Terminate the ssh process, if running; async-signal-safe */
+void mux_stop(void);
+
+#endif
@@ -4,7 +4,7 @@
  * of the source distribution for further details.
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
 #define _POSIX_C_SOURCE 200809L
 #include "options.h"
 
@@ -13,43 +13,45 @@
 #include <string.h>
 #include <unistd.h>
 
-char *checked_strdup(const char *s)
-{
-    /* Wrap strdup() and check for NULL return value,
-     * indicating that memory allocation failed. */
-    char *duplicate = strdup(s); /* NULL check follows */
-    if (duplicate == NULL)
-    {
-        fprintf(stderr, "Unable to allocate memory. Exiting.\n");
-        exit(EXIT_FAILURE);
-    }
-    return duplicate;
-}
-
 void print_usage(const char* program_name)
 {
     fprintf(stderr,
-            "Usage:\n %s [-h hostname] [-p port] [-t port] ssh_hostname ssh_port\n\n", program_name);
+            "Usage:\n %s [-h hostname] [-m dir] [-p port] [-s path] [-t port] [-w seconds] ssh_hostname ssh_port\n\n", program_name);
     fprintf(stderr,
             " -h hostname\n    SOCKS5 proxy and ssh-tunneld hostname.\n    Default: 127.0.0.1.\n\n");
+    fprintf(stderr,
+            " -m dir\n    Connect through ssh-tunneld's ControlMaster sockets in dir\n"
+            "    (ssh-tunneld -m dir) with ssh -W, instead of through SOCKS5.\n\n");
     fprintf(stderr,
             " -p port\n    SOCKS5 proxy port.\n    Default: 1080.\n\n");
+    fprintf(stderr,
+            " -s path\n    ssh-tunneld control socket; used instead of the control port.\n\n");
     fprintf(stderr,
             " -t port\n    ssh-tunneld control port.\n    Default: 1081.\n\n");
+    fprintf(stderr,
+            " -w seconds\n    Give up if ssh-tunneld or the SOCKS5 proxy does not connect or reply\n"
+            "    within this long.\n    Default: 60.\n\n");
 }
 
 void process_arguments(int argc, char** argv, struct program_options* options)
 {
     /*
-     * Usage: progname [-h hostname] [-p port] [-t port] ssh_hostname ssh_port
+     * Usage: progname [-h hostname] [-m dir] [-p port] [-s path] [-t port] [-w seconds]
+     *                 ssh_hostname ssh_port
      *
      * Options:
      * -h hostname
      *    sets proxy_host : hostname of both the SOCKS5 proxy *and* the ssh-tunneld process
+     * -m dir
+     *    sets master_dir : directory of ssh-tunneld's ControlMaster sockets
      * -p port
      *    sets proxy_port : port for the SOCKS5 proxy
+     * -s path
+     *    sets tunnel_socket : Unix domain socket of the ssh-tunneld process
      * -t port
      *    sets tun_port : port for the ssh-tunneld process
+     * -w seconds
+     *    sets timeout_seconds : connect and reply deadline (default 60)
      *
      * ssh_hostname and ssh_port are set from the remaining values of argv after option
      * processing has completed. These must always be present.
@@ -60,7 +62,11 @@ void process_arguments(int argc, char** argv, struct program_options* options)
     int set_proxy_port = 0;
     int set_tun_port = 0;
 
-    while ((opt = getopt(argc, argv, "h:p:t:")) != -1)
+    options->tunnel_socket = NULL;
+    options->master_dir = NULL;
+    options->timeout_seconds = 0;
+
+    while ((opt = getopt(argc, argv, "h:m:p:s:t:w:")) != -1)
     {
         switch (opt)
         {
@@ -72,6 +78,10 @@ void process_arguments(int argc, char** argv, struct program_options* options)
                     set_proxy_host = 1;
                 }
                 break;
+            case 'm':
+                if (options->master_dir == NULL)
+                    options->master_dir = optarg;
+                break;
             case 'p':
                 if (! set_proxy_port)
                 {
@@ -79,6 +89,10 @@ void process_arguments(int argc, char** argv, struct program_options* options)
                     set_proxy_port = 1;
                 }
                 break;
+            case 's':
+                if (options->tunnel_socket == NULL)
+                    options->tunnel_socket = optarg;
+                break;
             case 't':
                 if (! set_tun_port)
                 {
@@ -86,6 +100,20 @@ void process_arguments(int argc, char** argv, struct program_options* options)
                     set_tun_port = 1;
                 }
                 break;
+            case 'w':
+                if (options->timeout_seconds == 0)
+                {
+                    char* end = NULL;
+                    long value = strtol(optarg, &end, 10);
+                    if (end == optarg || *end != '\0' || value <= 0 || value > 86400)
+                    {
+                        fprintf(stderr, "Invalid timeout: %s\n\n", optarg);
+                        print_usage(argv[0]);
+                        exit(EXIT_FAILURE);
+                    }
+                    options->timeout_seconds = (int) value;
+                }
+                break;
             default:
                 print_usage(argv[0]);
                 exit(EXIT_FAILURE);
@@ -102,20 +130,15 @@ void process_arguments(int argc, char** argv, struct program_options* options)
     options->remote_host = argv[optind];
     options->remote_port = argv[optind+1];
 
-    /* And set default values if we didn't receive them from the options */
+    /* And set default values if we didn't receive them from the options;
+     * they are never modified or freed, so need no copy.
+     */
     if (! set_proxy_host)
-    {
-        char* default_proxy_host = "127.0.0.1";
-        options->proxy_host = checked_strdup(default_proxy_host);
-    }
+        options->proxy_host = "127.0.0.1";
     if (! set_proxy_port)
-    {
-        char* default_proxy_port = "1080";
-        options->proxy_port = checked_strdup(default_proxy_port);
-    }
+        options->proxy_port = "1080";
     if (! set_tun_port)
-    {
-        char* default_tun_port = "1081";
-        options->tunnel_port = checked_strdup(default_tun_port);
-    }
+        options->tunnel_port = "1081";
+    if (options->timeout_seconds == 0)
+        options->timeout_seconds = 60;
 }
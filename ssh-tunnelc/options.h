@@ -13,6 +13,11 @@ struct program_options {
     char* proxy_port;
     /* Port used by ssh-tunneld */
     char* tunnel_port;
+    char* tunnel_socket; /* Unix domain socket used by ssh-tunneld */
+    /* ssh-tunneld's ControlMaster socket directory, or NULL for SOCKS5 */
+    char* master_dir;
+    /* Give up on ssh-tunneld or the proxy after this long */
+    int timeout_seconds;
     /* Remote tunnelled endpoint */
     char* remote_host;
     char* remote_port;
@@ -0,0 +1,222 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* splice() */
+#endif
+#define _XOPEN_SOURCE 600
+
+#include "relay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Bytes moved per transfer; also the default Linux pipe capacity */
+#define RELAY_CHUNK 65536
+
+/*
+ * One direction of the relay. Data is read from "from" into either
+ * the kernel pipe (splice mode) or the user-space buffer, and written
+ * from there to "to". A direction only reads again once everything
+ * it previously read has been written out.
+ */
+struct direction {
+    int from;
+    int to;
+    int pipe_fds[2]; /* -1 when using the buffer */
+    char buffer[RELAY_CHUNK];
+    size_t offset;
+    size_t pending;
+    int done;
+};
+
+static void use_buffer(struct direction* dir)
+{
+    if (dir->pipe_fds[0] != -1)
+    {
+        close(dir->pipe_fds[0]);
+        close(dir->pipe_fds[1]);
+        dir->pipe_fds[0] = dir->pipe_fds[1] = -1;
+    }
+}
+
+static void direction_init(struct direction* dir, int from, int to)
+{
+    dir->from = from;
+    dir->to = to;
+    dir->offset = 0;
+    dir->pending = 0;
+    dir->done = 0;
+    dir->pipe_fds[0] = dir->pipe_fds[1] = -1;
+#if defined(__linux__)
+    if (pipe(dir->pipe_fds) == -1)
+        dir->pipe_fds[0] = dir->pipe_fds[1] = -1;
+#endif
+}
+
+/* Returns bytes read, 0 on end-of-file, -1 with errno set on error */
+static ssize_t fill(struct direction* dir)
+{
+#if defined(__linux__)
+    if (dir->pipe_fds[1] != -1)
+    {
+        ssize_t n = splice(dir->from, NULL, dir->pipe_fds[1], NULL,
+                RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n != -1 || errno != EINVAL)
+            return n;
+        /* This pair of descriptors cannot be spliced; the pipe is
+         * still empty, so fall back to copying.
+         */
+        use_buffer(dir);
+    }
+#endif
+    dir->offset = 0;
+    return read(dir->from, dir->buffer, sizeof(dir->buffer));
+}
+
+/* Returns bytes written, or -1 with errno set on error */
+static ssize_t drain(struct direction* dir)
+{
+#if defined(__linux__)
+    if (dir->pipe_fds[0] != -1)
+    {
+        ssize_t n = splice(dir->pipe_fds[0], NULL, dir->to, NULL,
+                dir->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n != -1 || errno != EINVAL)
+            return n;
+        /* Destination cannot be spliced to; recover the data
+         * already in the pipe and carry on copying.
+         */
+        size_t recovered = 0;
+        while (recovered < dir->pending)
+        {
+            ssize_t r = read(dir->pipe_fds[0], dir->buffer + recovered,
+                    dir->pending - recovered);
+            if (r <= 0)
+                return -1;
+            recovered += (size_t) r;
+        }
+        dir->offset = 0;
+        use_buffer(dir);
+    }
+#endif
+    return write(dir->to, dir->buffer + dir->offset, dir->pending);
+}
+
+static int transfer_failed(void)
+{
+    return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+}
+
+int relay(int in_fd, int out_fd, int sock_fd)
+{
+    /* static: each direction carries a RELAY_CHUNK buffer */
+    static struct direction up; /* in_fd -> sock_fd */
+    static struct direction down; /* sock_fd -> out_fd */
+    int result = 0;
+
+    /* Only our own socket is made non-blocking; in_fd and out_fd are
+     * shared with the parent ssh process, and are only touched after
+     * poll() has said they are ready.
+     */
+    int flags = fcntl(sock_fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+        return -1;
+    }
+
+    direction_init(&up, in_fd, sock_fd);
+    direction_init(&down, sock_fd, out_fd);
+    struct direction* dirs[2] = { &up, &down };
+
+    while (! (up.done && down.done))
+    {
+        struct pollfd fds[2];
+        for (int i = 0; i < 2; ++i)
+        {
+            struct direction* dir = dirs[i];
+            fds[i].revents = 0;
+            if (dir->done)
+            {
+                fds[i].fd = -1;
+                fds[i].events = 0;
+            }
+            else if (dir->pending == 0)
+            {
+                fds[i].fd = dir->from;
+                fds[i].events = POLLIN;
+            }
+            else
+            {
+                fds[i].fd = dir->to;
+                fds[i].events = POLLOUT;
+            }
+        }
+
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            result = -1;
+            break;
+        }
+
+        for (int i = 0; i < 2; ++i)
+        {
+            struct direction* dir = dirs[i];
+            if (fds[i].revents == 0)
+                continue;
+
+            if (dir->pending == 0)
+            {
+                ssize_t n = fill(dir);
+                if (n > 0)
+                {
+                    dir->pending = (size_t) n;
+                }
+                else if (n == 0 || transfer_failed())
+                {
+                    /* End of input: pass the half-close on */
+                    if (n == -1)
+                        result = -1;
+                    dir->done = 1;
+                    if (dir == &up)
+                        shutdown(sock_fd, SHUT_WR);
+                    else
+                        close(out_fd);
+                }
+            }
+            else
+            {
+                ssize_t n = drain(dir);
+                if (n > 0)
+                {
+                    dir->pending -= (size_t) n;
+                    dir->offset += (size_t) n;
+                }
+                else if (n == -1 && transfer_failed())
+                {
+                    /* Nobody is listening on this side any more */
+                    result = -1;
+                    up.done = down.done = 1;
+                }
+            }
+        }
+    }
+
+    use_buffer(&up);
+    use_buffer(&down);
+    return result;
+}
@@ -0,0 +1,24 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELC_RELAY_H
+#define SSH_TUNNELC_RELAY_H
+
+/*
+ * Copy data in both directions between (in_fd, out_fd) and sock_fd
+ * until both directions have finished. End-of-file on in_fd is passed
+ * on as a half-close of sock_fd, and end-of-file on sock_fd closes
+ * out_fd, so either side may finish sending first.
+ *
+ * On Linux the data is moved with splice() through a pipe, so it never
+ * passes through user space; elsewhere (or if splice() is refused for
+ * these descriptors) read() and write() are used instead.
+ *
+ * Returns 0 when both directions completed cleanly, -1 on error.
+ */
+int relay(int in_fd, int out_fd, int sock_fd);
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "socks.h"
+#include "control.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Protocol constants from RFC 1928 */
+#define SOCKS_VERSION 0x05
+#define SOCKS_AUTH_NONE 0x00
+#define SOCKS_CMD_CONNECT 0x01
+#define SOCKS_ATYP_IPV4 0x01
+#define SOCKS_ATYP_DOMAIN 0x03
+#define SOCKS_ATYP_IPV6 0x04
+
+static const char* socks_reply_reason(unsigned char code)
+{
+    switch (code)
+    {
+        case 0x01: return "general SOCKS server failure";
+        case 0x02: return "connection not allowed by ruleset";
+        case 0x03: return "network unreachable";
+        case 0x04: return "host unreachable";
+        case 0x05: return "connection refused";
+        case 0x06: return "TTL expired";
+        case 0x07: return "command not supported";
+        case 0x08: return "address type not supported";
+        default: return "unknown error";
+    }
+}
+
+static int write_full(int fd, const unsigned char* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+static int read_full(int fd, unsigned char* data, size_t len)
+{
+    while (len > 0)
+    {
+        if (deadline_wait(fd, POLLIN) == -1)
+            return -1;
+        ssize_t n = read(fd, data, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+static int parse_port(const char* port, unsigned int* result)
+{
+    char* end = NULL;
+    long value = strtol(port, &end, 10);
+    if (end == port || *end != '\0' || value <= 0 || value > 65535)
+        return -1;
+    *result = (unsigned int) value;
+    return 0;
+}
+
+int socks5_connect(const char* proxy_host, const char* proxy_port,
+        const char* host, const char* port)
+{
+    /* Largest request: 4 header bytes, 1 length byte,
+     * 255 bytes of domain name and 2 bytes of port.
+     */
+    unsigned char request[4 + 1 + 255 + 2];
+    unsigned char reply[4 + 255 + 2];
+    size_t len = 0;
+    unsigned int port_number = 0;
+
+    if (parse_port(port, &port_number) != 0)
+    {
+        fprintf(stderr, "Invalid port: %s\n", port);
+        return -1;
+    }
+
+    /* Build the CONNECT request before connecting, so that
+     * a bad hostname does not cost a round trip to the proxy.
+     */
+    request[len++] = SOCKS_VERSION;
+    request[len++] = SOCKS_CMD_CONNECT;
+    request[len++] = 0x00; /* reserved */
+    if (inet_pton(AF_INET, host, request + len + 1) == 1)
+    {
+        request[len++] = SOCKS_ATYP_IPV4;
+        len += 4;
+    }
+    else if (inet_pton(AF_INET6, host, request + len + 1) == 1)
+    {
+        request[len++] = SOCKS_ATYP_IPV6;
+        len += 16;
+    }
+    else
+    {
+        /* Let the proxy resolve the name at the far end */
+        size_t host_len = strlen(host);
+        if (host_len == 0 || host_len > 255)
+        {
+            fprintf(stderr, "Invalid hostname: %s\n", host);
+            return -1;
+        }
+        request[len++] = SOCKS_ATYP_DOMAIN;
+        request[len++] = (unsigned char) host_len;
+        memcpy(request + len, host, host_len);
+        len += host_len;
+    }
+    request[len++] = (unsigned char) (port_number >> 8);
+    request[len++] = (unsigned char) (port_number & 0xff);
+
+    deadline_start();
+    int sock_fd = establish_connection(proxy_host, proxy_port);
+    if (sock_fd == -1)
+        return -1;
+
+    /* Offer only "no authentication" and send the CONNECT request
+     * straight after it, saving a round trip; ssh -D always accepts.
+     */
+    const unsigned char greeting[] = { SOCKS_VERSION, 1, SOCKS_AUTH_NONE };
+    if (write_full(sock_fd, greeting, sizeof(greeting)) != 0
+            || write_full(sock_fd, request, len) != 0)
+    {
+        perror("SOCKS5 request");
+        close(sock_fd);
+        return -1;
+    }
+
+    errno = 0;
+    if (read_full(sock_fd, reply, 2) != 0
+            || reply[0] != SOCKS_VERSION || reply[1] != SOCKS_AUTH_NONE)
+    {
+        if (errno == ETIMEDOUT)
+            fprintf(stderr, "No reply from SOCKS5 proxy within %d seconds.\n", tunneld_timeout);
+        else
+            fprintf(stderr, "SOCKS5 proxy refused authentication method.\n");
+        close(sock_fd);
+        return -1;
+    }
+
+    /* ssh answers once the far end has accepted, or refused, the
+     * connection; it gives up after its ConnectTimeout.
+     */
+    errno = 0;
+    if (read_full(sock_fd, reply, 4) != 0 || reply[0] != SOCKS_VERSION)
+    {
+        if (errno == ETIMEDOUT)
+            fprintf(stderr, "No reply from SOCKS5 proxy within %d seconds.\n", tunneld_timeout);
+        else
+            fprintf(stderr, "Invalid reply from SOCKS5 proxy.\n");
+        close(sock_fd);
+        return -1;
+    }
+    if (reply[1] != 0x00)
+    {
+        fprintf(stderr, "SOCKS5 connect to %s:%s failed: %s.\n",
+                host, port, socks_reply_reason(reply[1]));
+        close(sock_fd);
+        return -1;
+    }
+
+    /* Skip the bound address, which we have no use for */
+    size_t skip = 0;
+    switch (reply[3])
+    {
+        case SOCKS_ATYP_IPV4:
+            skip = 4 + 2;
+            break;
+        case SOCKS_ATYP_IPV6:
+            skip = 16 + 2;
+            break;
+        case SOCKS_ATYP_DOMAIN:
+            if (read_full(sock_fd, reply, 1) != 0)
+                skip = sizeof(reply) + 1; /* force the error below */
+            else
+                skip = (size_t) reply[0] + 2;
+            break;
+        default:
+            skip = sizeof(reply) + 1;
+            break;
+    }
+    if (skip > sizeof(reply) || read_full(sock_fd, reply, skip) != 0)
+    {
+        fprintf(stderr, "Invalid reply from SOCKS5 proxy.\n");
+        close(sock_fd);
+        return -1;
+    }
+
+    return sock_fd;
+}
@@ -0,0 +1,19 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELC_SOCKS_H
+#define SSH_TUNNELC_SOCKS_H
+
+/*
+ * Connect to the SOCKS5 proxy at proxy_host:proxy_port and ask it to
+ * CONNECT to host:port (RFC 1928, no authentication). Returns the
+ * connected socket, ready to carry data, or -1 on error (after
+ * printing a message to stderr).
+ */
+int socks5_connect(const char* proxy_host, const char* proxy_port,
+        const char* host, const char* port);
+
+#endif
@@ -4,7 +4,7 @@
  * of the source distribution for further details.
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,15 +13,23 @@
 #include <unistd.h>
 
 #include <sys/types.h>
-#include <sys/wait.h>
 
 /* Project headers */
 #include "control.h"
+#include "happy.h"
+#include "mux.h"
 #include "options.h"
+#include "relay.h"
+#include "socks.h"
+#include "protocol.h"
+
+/* Addresses that would not connect, remembered between runs in this
+ * file in $HOME (see happy.h)
+ */
+#define FAILURES_FILE ".ssh-tunnelc-failures"
 
 void sig_handler(int signum);
 
-char* build_host_port(const char* host, const char* port);
 void register_signal_handlers();
 
 int main(int argc, char** argv)
@@ -32,18 +40,21 @@ int main(int argc, char** argv)
     /* Set tunneld_host to point to proxy_host */
     tunneld_host = options.proxy_host;
     tunneld_port = options.tunnel_port;
-    char* proxy_host_port = build_host_port(options.proxy_host,
-            options.proxy_port);
-    if (proxy_host_port == NULL)
-    {
-        /* malloc() failed */
-        fprintf(stderr, "Unable to allocate memory. Exiting.\n");
-        return EXIT_FAILURE;
-    }
-    
-    /* Deal with SIGTERM, SIGCHLD, SIGHUP and SIGINT */
+    tunneld_socket = options.tunnel_socket;
+    tunneld_timeout = options.timeout_seconds;
+
+    /* Deal with SIGTERM, SIGHUP and SIGINT */
     register_signal_handlers();
-    
+
+    char failures_path[1024] = "";
+    const char* home = getenv("HOME");
+    if (home != NULL && home[0] == '/'
+            && (size_t) snprintf(failures_path, sizeof(failures_path), "%s/%s", home,
+                FAILURES_FILE) < sizeof(failures_path))
+        happy_load(failures_path);
+    else
+        failures_path[0] = '\0';
+
     /* Send a message to ssh-tunneld telling it we
      * want to open an ssh connection through the tunnel
      * While we do this, block SIGINT and SIGTERM so
@@ -57,66 +68,76 @@ int main(int argc, char** argv)
     {
         perror("Failed to block SIGINT and SIGTERM");
     }
-    connection_start();
+    char proxy_port[8] = "";
+    char lane_port[8] = "";
+    /* Only SOCKS5 mode can use a fast lane; ask for one there */
+    connection_start(options.remote_host,
+            options.master_dir == NULL ? options.remote_port : NULL,
+            proxy_port, lane_port, sizeof(proxy_port));
     if (sigprocmask(SIG_UNBLOCK, &sigmask, NULL) == -1)
     {
         perror("Failed to unblock SIGINT and SIGTERM");
     }
+    if (failures_path[0] != '\0')
+        happy_save(failures_path);
 
-    /* fork and execute:
-     * nc -X 5 -x proxyhost:proxyport host port
-     */
-    pid_t id = fork();
-    if (id < 0)
+    const char* tunnel_port = proxy_port[0] != '\0' ? proxy_port : options.proxy_port;
+    int status = EXIT_SUCCESS;
+    if (options.master_dir != NULL)
     {
-        /* something went wrong... */
-        fprintf(stderr, "fork() failed.\n");
-        exit(EXIT_FAILURE);
-    }
-    else if (id == 0)
-    {
-        /* in child process */
-        int status = execlp("nc", "nc", "-X", "5", "-x", proxy_host_port,
-                options.remote_host, options.remote_port, (char *) NULL);
-        /* if the exec succeeded, we should never get here */
-        if (status == -1)
+        /* Open a channel over the tunnel's ssh ControlMaster */
+        char control_path[PROTO_MASTER_PATH_MAX];
+        if (proto_master_path(control_path, sizeof(control_path), options.master_dir,
+                    (unsigned int) strtoul(tunnel_port, NULL, 10)) != 0)
+        {
+            fprintf(stderr, "ControlMaster socket path too long.\n");
+            status = EXIT_FAILURE;
+        }
+        else if (mux_forward(control_path, options.remote_host, options.remote_port) != 0)
         {
-            fprintf(stderr, "Failed to execute nc.\n");
-            exit(EXIT_FAILURE);
+            status = EXIT_FAILURE;
         }
     }
     else
     {
-        /* in parent process; id is the process id
-         * of the child. Wait for it to finish.
+        /* Connect straight to the fast lane to the remote host, if
+         * there is one; otherwise (or if it is not there after all) ask
+         * the SOCKS5 proxy for a connection. Then shuttle data between
+         * it and our stdin / stdout.
          */
-        wait(NULL);
-
-        if (proxy_host_port != NULL)
-            free(proxy_host_port);
+        int sock_fd = -1;
+        if (lane_port[0] != '\0')
+        {
+            deadline_start();
+            sock_fd = establish_connection(options.proxy_host, lane_port);
+        }
+        if (sock_fd == -1)
+            sock_fd = socks5_connect(options.proxy_host, tunnel_port,
+                    options.remote_host, options.remote_port);
+        if (failures_path[0] != '\0')
+            happy_save(failures_path);
+        if (sock_fd == -1)
+        {
+            status = EXIT_FAILURE;
+        }
+        else
+        {
+            if (relay(STDIN_FILENO, STDOUT_FILENO, sock_fd) != 0)
+                status = EXIT_FAILURE;
+            close(sock_fd);
+        }
     }
-    return EXIT_SUCCESS;
-}
 
-char* build_host_port(const char* host, const char* port)
-{
-    /* Obtain sufficient memory */
-    size_t host_len = strlen(host);
-    size_t port_len = strlen(port);
-    size_t result_len = host_len + port_len + 2; /* colon and null char */
-    char* result = malloc(result_len * sizeof(char));
-    if (result == NULL)
+    /* Tell ssh-tunneld we are done. Block signals first, so that
+     * a late SIGTERM cannot make us send the message twice.
+     */
+    if (sigaddset(&sigmask, SIGHUP) == -1
+            || sigprocmask(SIG_BLOCK, &sigmask, NULL) == -1)
     {
-        /* malloc() failed */
-        return NULL;
+        perror("Failed to block SIGINT and SIGTERM");
     }
-
-    /* Build the string "host:port" and ensure that it is null-terminated */
-    strncpy(result, host, host_len);
-    result[host_len] = ':';
-    strncpy(result + host_len + 1, port, port_len);
-    result[host_len + port_len + 1] = '\0';
-    return result;
+    connection_stop();
+    return status;
 }
 
 void register_signal_handlers()
@@ -125,14 +146,8 @@ void register_signal_handlers()
     memset(&sa, 0, sizeof(struct sigaction));
     sa.sa_handler = sig_handler;
     sigaddset(&(sa.sa_mask), SIGTERM);
-    sigaddset(&(sa.sa_mask), SIGCHLD);
     sigaddset(&(sa.sa_mask), SIGHUP);
     sigaddset(&(sa.sa_mask), SIGINT);
-    sa.sa_flags = SA_NOCLDSTOP;
-    if (sigaction(SIGCHLD, &sa, NULL) != 0)
-    {
-        perror("sigaction");
-    }
     if (sigaction(SIGTERM, &sa, NULL) != 0)
     {
         perror("sigaction");
@@ -145,16 +160,25 @@ void register_signal_handlers()
     {
         perror("sigaction");
     }
+
+    /* A closed stdout or proxy connection is reported
+     * by write() failing, rather than by a signal.
+     */
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) != 0)
+    {
+        perror("sigaction");
+    }
 }
 
 void sig_handler(int signum)
 {
     switch (signum)
     {
-        case SIGCHLD:
         case SIGTERM:
         case SIGINT:
         case SIGHUP:
+            mux_stop();
             connection_stop();
             exit(EXIT_SUCCESS);
             break;
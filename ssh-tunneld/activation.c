@@ -0,0 +1,171 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "activation.h"
+#include "event.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* systemd passes its sockets from this descriptor onwards */
+#define LISTEN_FDS_START 3
+
+static int parse_fd(const char* value, const char** end)
+{
+    char* stop = NULL;
+    errno = 0;
+    long fd = strtol(value, &stop, 10);
+    if (errno != 0 || stop == value || fd < 0 || fd > INT_MAX)
+        return -1;
+    *end = stop;
+    return (int) fd;
+}
+
+/* Is the index'th name in the colon-separated LISTEN_FDNAMES "socks"? */
+static int named_socks(const char* names, size_t index)
+{
+    if (names == NULL)
+        return 0;
+    for (size_t i = 0; i < index; ++i)
+    {
+        names = strchr(names, ':');
+        if (names == NULL)
+            return 0;
+        names += 1;
+    }
+    return strncmp(names, "socks", 5) == 0 && (names[5] == ':' || names[5] == '\0');
+}
+
+static unsigned int bound_port(const struct sockaddr_storage* addr)
+{
+    if (addr->ss_family == AF_INET)
+        return ntohs(((const struct sockaddr_in*) addr)->sin_port);
+    if (addr->ss_family == AF_INET6)
+        return ntohs(((const struct sockaddr_in6*) addr)->sin6_port);
+    return 0;
+}
+
+static void add_socket(int fd, int named, const char* socks_port,
+        struct activation_socket* socket_out)
+{
+    int type = 0;
+    socklen_t len = sizeof(int);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1 || type != SOCK_STREAM)
+    {
+        fprintf(stderr, "Inherited descriptor %d is not a stream socket. Exiting.\n", fd);
+        exit(EXIT_FAILURE);
+    }
+#ifdef SO_ACCEPTCONN
+    int listening = 0;
+    len = sizeof(int);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 && ! listening)
+    {
+        fprintf(stderr, "Inherited socket %d is not listening. Exiting.\n", fd);
+        exit(EXIT_FAILURE);
+    }
+#endif
+    struct sockaddr_storage addr;
+    len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    if (getsockname(fd, (struct sockaddr*) &addr, &len) == -1)
+    {
+        fprintf(stderr, "Cannot get address of inherited socket %d. Exiting.\n", fd);
+        exit(EXIT_FAILURE);
+    }
+
+    /* daemonize() closes the standard descriptors; move off them */
+    if (fd <= STDERR_FILENO)
+    {
+        int moved = fcntl(fd, F_DUPFD, STDERR_FILENO + 1);
+        if (moved == -1)
+        {
+            fprintf(stderr, "Cannot move inherited socket %d. Exiting.\n", fd);
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        fd = moved;
+    }
+    /* Not for the ssh processes */
+    set_cloexec(fd);
+
+    socket_out->fd = fd;
+    if (addr.ss_family == AF_UNIX)
+        socket_out->kind = ACTIVATION_CONTROL_UNIX;
+    else if (named || (socks_port != NULL
+                && bound_port(&addr) == (unsigned int) atoi(socks_port)))
+        socket_out->kind = ACTIVATION_SOCKS;
+    else
+        socket_out->kind = ACTIVATION_CONTROL_TCP;
+}
+
+size_t activation_collect(const char* fd_list, const char* socks_port,
+        struct activation_socket* sockets)
+{
+    size_t n = 0;
+    if (fd_list != NULL)
+    {
+        const char* p = fd_list;
+        while (1)
+        {
+            const char* end = NULL;
+            int fd = parse_fd(p, &end);
+            if (fd == -1 || (*end != ',' && *end != '\0'))
+            {
+                fprintf(stderr, "Invalid inherited descriptor list: %s\n", fd_list);
+                exit(EXIT_FAILURE);
+            }
+            if (n == ACTIVATION_MAX_FDS)
+            {
+                fprintf(stderr, "Too many inherited descriptors (at most %d). Exiting.\n",
+                        ACTIVATION_MAX_FDS);
+                exit(EXIT_FAILURE);
+            }
+            add_socket(fd, 0, socks_port, &sockets[n]);
+            n += 1;
+            if (*end == '\0')
+                break;
+            p = end + 1;
+        }
+        return n;
+    }
+
+    /* The variables are meant for us only if LISTEN_PID is our pid */
+    const char* pid = getenv("LISTEN_PID");
+    const char* fds = getenv("LISTEN_FDS");
+    if (pid == NULL || fds == NULL || atol(pid) != (long) getpid())
+        return 0;
+    const char* end = NULL;
+    int count = parse_fd(fds, &end);
+    if (count == -1 || *end != '\0' || count > ACTIVATION_MAX_FDS)
+    {
+        fprintf(stderr, "Invalid LISTEN_FDS: %s. Exiting.\n", fds);
+        exit(EXIT_FAILURE);
+    }
+    const char* names = getenv("LISTEN_FDNAMES");
+    for (int i = 0; i < count; ++i)
+    {
+        add_socket(LISTEN_FDS_START + i, named_socks(names, (size_t) i), socks_port,
+                &sockets[n]);
+        n += 1;
+    }
+
+    /* Nor for the ssh processes we start */
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    return n;
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_ACTIVATION_H
+#define SSH_TUNNELD_ACTIVATION_H
+
+#include <stddef.h>
+
+/*
+ * Listening sockets opened for us by whoever started ssh-tunneld:
+ * systemd socket activation (LISTEN_PID, LISTEN_FDS and, if set,
+ * LISTEN_FDNAMES), or the descriptors given with -i (for inetd in
+ * "wait" mode, or any other launcher). The launcher keeps listening
+ * while ssh-tunneld is not running, so the first connection starts it
+ * and no connection is refused while it restarts.
+ *
+ * Each socket is put to the use its address suggests: a Unix domain
+ * socket is a control socket (as with -s); a TCP socket is the SOCKS5
+ * front-end if it is named "socks" in LISTEN_FDNAMES or is bound to
+ * the -x port, and a control port (as with -t) otherwise. Whatever is
+ * inherited replaces the corresponding socket ssh-tunneld would open.
+ */
+#define ACTIVATION_MAX_FDS 16
+
+enum activation_kind {
+    ACTIVATION_CONTROL_TCP,
+    ACTIVATION_CONTROL_UNIX,
+    ACTIVATION_SOCKS
+};
+
+struct activation_socket {
+    int fd;
+    enum activation_kind kind;
+};
+
+/* Collect the inherited listening sockets into sockets (at most
+ * ACTIVATION_MAX_FDS), from fd_list (comma-separated descriptors,
+ * from -i) if it is not NULL, or else from the environment. Returns
+ * how many there are. Must be called before daemonize(), which forks
+ * and so changes our pid. Exits on a descriptor that is not a
+ * listening stream socket.
+ */
+size_t activation_collect(const char* fd_list, const char* socks_port,
+        struct activation_socket* sockets);
+
+#endif
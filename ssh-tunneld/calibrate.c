@@ -0,0 +1,268 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "calibrate.h"
+#include "event.h"
+#include "profile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#define CALIBRATE_VERSION 1
+
+struct timing {
+    const char* cipher;
+    long rate; /* MB/s */
+};
+
+/* Run ssh to host with cipher, and send it bytes of data to throw
+ * away; returns how long that took (in microseconds), or -1 if ssh
+ * failed, as it does if either end does not support the cipher.
+ */
+static long long time_ssh(const char* cipher, char* host, char* port, size_t bytes)
+{
+    static const char buffer[65536]; /* zeros; compression is off */
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    long long started = event_now_usec();
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        char* argv[] = {
+            "ssh",
+            "-T",
+            "-o",
+            "BatchMode=yes",
+            "-o",
+            "Compression=no",
+            "-c",
+            (char*) cipher,
+            "-p",
+            port,
+            host,
+            "cat > /dev/null",
+            NULL
+        };
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (dup2(fds[0], STDIN_FILENO) == -1
+                || (null_fd != -1 && dup2(null_fd, STDOUT_FILENO) == -1))
+            _exit(EXIT_FAILURE);
+        if (null_fd > STDOUT_FILENO)
+            close(null_fd);
+        close(fds[0]);
+        close(fds[1]);
+        execvp("ssh", argv);
+        _exit(EXIT_FAILURE);
+    }
+
+    close(fds[0]);
+    int failed = 0;
+    while (bytes > 0 && ! failed)
+    {
+        size_t len = bytes < sizeof(buffer) ? bytes : sizeof(buffer);
+        ssize_t n = write(fds[1], buffer, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            failed = 1; /* ssh has gone */
+        else
+            bytes -= (size_t) n;
+    }
+    close(fds[1]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    if (failed || ! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return event_now_usec() - started;
+}
+
+static void save(const char* filename, const struct timing* timings, size_t n)
+{
+    char* temporary = malloc(strlen(filename) + 5);
+    if (temporary == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(temporary, "%s.tmp", filename);
+
+    FILE* file = fopen(temporary, "w");
+    int failed = file == NULL;
+    if (file != NULL)
+    {
+        fprintf(file, "ssh-tunneld-ciphers %d\n", CALIBRATE_VERSION);
+        for (size_t i = 0; i < n; ++i)
+            fprintf(file, "%s %ld\n", timings[i].cipher, timings[i].rate);
+        failed = ferror(file);
+        failed |= fclose(file) != 0;
+    }
+    if (failed || rename(temporary, filename) != 0)
+    {
+        perror(filename);
+        unlink(temporary);
+        exit(EXIT_FAILURE);
+    }
+    free(temporary);
+}
+
+static int is_loopback(const struct sockaddr* address)
+{
+    if (address->sa_family == AF_INET)
+    {
+        const struct sockaddr_in* v4 = (const struct sockaddr_in*) address;
+        return (ntohl(v4->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (address->sa_family == AF_INET6)
+    {
+        const struct in6_addr* v6 = &((const struct sockaddr_in6*) address)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(v6)
+            || (IN6_IS_ADDR_V4MAPPED(v6) && v6->s6_addr[12] == 127);
+    }
+    return 0;
+}
+
+/* The timings are of this CPU only if host is this machine: refuse
+ * any other. A name that does not resolve may be an ssh_config alias,
+ * which only ssh can look up; that is allowed, with a warning.
+ */
+static void check_local(const char* host)
+{
+    struct addrinfo hints;
+    struct addrinfo* list = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &list) != 0)
+    {
+        fprintf(stderr, "Warning: cannot resolve %s; calibrating on the assumption that "
+                "it is this machine.\n", host);
+        return;
+    }
+    for (const struct addrinfo* rp = list; rp != NULL; rp = rp->ai_next)
+    {
+        if (! is_loopback(rp->ai_addr))
+        {
+            fprintf(stderr, "%s is not a loopback address; timing ssh to it would measure "
+                    "the network, not this CPU. Use localhost.\n", host);
+            exit(EXIT_FAILURE);
+        }
+    }
+    freeaddrinfo(list);
+}
+
+void calibrate(const char* filename, char* host, char* port)
+{
+    static const char* ciphers[] = { CALIBRATE_CIPHERS };
+    const size_t n_ciphers = sizeof(ciphers) / sizeof(ciphers[0]);
+    struct timing timings[sizeof(ciphers) / sizeof(ciphers[0])];
+    size_t n = 0;
+
+    check_local(host);
+
+    /* ssh may exit before reading everything we send */
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0); /* in order with ssh's messages */
+
+    printf("Timing %d MB through ssh to %s with each cipher.\n", CALIBRATE_MB, host);
+    for (size_t i = 0; i < n_ciphers; ++i)
+    {
+        long long login = time_ssh(ciphers[i], host, port, 0);
+        long long total = login < 0 ? -1
+            : time_ssh(ciphers[i], host, port, (size_t) CALIBRATE_MB * 1024 * 1024);
+        if (total < 0)
+        {
+            printf("  %-32s not available\n", ciphers[i]);
+            continue;
+        }
+        long long usec = total > login ? total - login : 1;
+        long rate = (long) (CALIBRATE_MB * 1000000LL / usec);
+        printf("  %-32s %6ld MB/s\n", ciphers[i], rate);
+
+        /* Fastest first */
+        size_t j = n++;
+        while (j > 0 && timings[j - 1].rate < rate)
+        {
+            timings[j] = timings[j - 1];
+            j -= 1;
+        }
+        timings[j].cipher = ciphers[i];
+        timings[j].rate = rate;
+    }
+    if (n == 0)
+    {
+        fprintf(stderr, "No cipher could be timed; is %s reachable without a password?\n",
+                host);
+        exit(EXIT_FAILURE);
+    }
+    save(filename, timings, n);
+    printf("Bulk tunnels started with -g %s will prefer %s.\n", filename, timings[0].cipher);
+    exit(EXIT_SUCCESS);
+}
+
+/* Returns -1 if the file is damaged */
+static int read_ciphers(FILE* file, char* ciphers, size_t size)
+{
+    char line[256];
+    char cipher[128];
+    long rate;
+    int version = 0;
+    size_t len = 0;
+    if (fgets(line, sizeof(line), file) == NULL
+            || sscanf(line, "ssh-tunneld-ciphers %d", &version) != 1
+            || version != CALIBRATE_VERSION)
+        return -1;
+    ciphers[0] = '\0';
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (sscanf(line, "%127s %ld", cipher, &rate) != 2
+                || strspn(cipher, "abcdefghijklmnopqrstuvwxyz0123456789@.-") != strlen(cipher))
+            return -1;
+        int n = snprintf(ciphers + len, size - len, "%s%s", len > 0 ? "," : "", cipher);
+        if (n < 0 || (size_t) n >= size - len)
+            return -1;
+        len += (size_t) n;
+    }
+    return len > 0 ? 0 : -1;
+}
+
+void calibrate_load(const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        if (errno != ENOENT)
+            perror(filename);
+        return;
+    }
+    char ciphers[256];
+    if (read_ciphers(file, ciphers, sizeof(ciphers)) == 0)
+        profile_rank_ciphers(ciphers);
+    else
+        fprintf(stderr, "%s: Damaged cipher calibration; using the default order.\n", filename);
+    fclose(file);
+}
@@ -0,0 +1,42 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_CALIBRATE_H
+#define SSH_TUNNELD_CALIBRATE_H
+
+/*
+ * Cipher calibration, for the bulk profile (see profile.h).
+ *
+ * "ssh-tunneld -q -g file hostname" times each of CALIBRATE_CIPHERS
+ * through ssh to hostname: it logs in once to do nothing, then again
+ * to send CALIBRATE_MB of data to "cat > /dev/null", and takes the
+ * difference as the time to encrypt, send and decrypt that much. With
+ * hostname "localhost" (and an sshd running there), that is this
+ * CPU's cost alone; a hostname that resolves to any other address is
+ * refused. The ciphers that worked are written to file,
+ * fastest first, with their rates in MB/s:
+ *
+ *   ssh-tunneld-ciphers 1
+ *   <cipher> <MB/s>
+ *
+ * A later "ssh-tunneld -g file" offers them in that order for bulk
+ * tunnels.
+ */
+#define CALIBRATE_MB 256
+#define CALIBRATE_CIPHERS \
+    "aes128-gcm@openssh.com", "aes256-gcm@openssh.com", \
+    "chacha20-poly1305@openssh.com", "aes128-ctr", "aes256-ctr"
+
+/* Time the ciphers, write the results to filename, and exit */
+void calibrate(const char* filename, char* host, char* port);
+
+/* Rank the bulk profile's ciphers by filename. A missing file is not
+ * an error; an unreadable or damaged one is reported on stderr, and
+ * the default order is kept.
+ */
+void calibrate_load(const char* filename);
+
+#endif
@@ -0,0 +1,981 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* struct ucred */
+#endif
+#define _XOPEN_SOURCE 600
+
+#include "clients.h"
+#include "event.h"
+#include "logging.h"
+#include "metrics.h"
+#include "upgrade.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+static void on_accept(int fd, short revents, void* data);
+static void on_client(int fd, short revents, void* data);
+static void on_granted(struct waiter* waiter);
+static void on_failed(struct waiter* waiter, const char* reason);
+static void on_lease_granted(struct waiter* waiter);
+static void on_lease_failed(struct waiter* waiter, const char* reason);
+static void on_lease_expired(struct wheel_entry* entry);
+
+struct listener {
+    struct upstream_table* upstreams;
+    int check_peer;
+};
+
+static unsigned int n_clients = 0;
+static struct client* all_clients = NULL;
+
+/* Expiry of the leases of every connection that sends heartbeats */
+static struct wheel lease_wheel;
+static int lease_ttl_seconds = 0;
+
+void clients_init(int ttl_seconds)
+{
+    lease_ttl_seconds = ttl_seconds;
+    wheel_init(&lease_wheel, CLIENT_LEASE_TICK_MS);
+}
+
+void clients_listen(int listen_fd, struct upstream_table* upstreams, int check_peer)
+{
+    struct listener* listener = malloc(sizeof(struct listener));
+    if (listener == NULL)
+    {
+        write_log_error("Unable to allocate memory. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    listener->upstreams = upstreams;
+    listener->check_peer = check_peer;
+    if (set_nonblocking(listen_fd) == -1
+            || set_cloexec(listen_fd) == -1
+            || event_add(listen_fd, POLLIN, on_accept, listener) == -1)
+    {
+        write_log_error("Error registering control socket. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+unsigned int clients_open(void)
+{
+    return n_clients;
+}
+
+static void client_link(struct client* client)
+{
+    client->prev = NULL;
+    client->next = all_clients;
+    if (all_clients != NULL)
+        all_clients->prev = client;
+    all_clients = client;
+    n_clients += 1;
+}
+
+/* Push back a framed lease's expiry, if its client heartbeats */
+static void lease_renew(struct lease* lease)
+{
+    if (lease->client->heartbeats && lease_ttl_seconds > 0)
+        wheel_schedule(&lease_wheel, &lease->expiry, (long long) lease_ttl_seconds * 1000,
+                on_lease_expired);
+}
+
+/* Give back a framed lease, or stop waiting for it */
+static void lease_end(struct lease* lease)
+{
+    wheel_cancel(&lease_wheel, &lease->expiry);
+    if (lease->granted)
+        tunnel_release(lease->tunnel);
+    else
+        tunnel_cancel(lease->tunnel, &lease->waiter);
+}
+
+static void client_close(struct client* client)
+{
+    while (client->leases != NULL)
+    {
+        struct lease* lease = client->leases;
+        client->leases = lease->next;
+        lease_end(lease);
+        free(lease);
+    }
+    if (client->holds_lease)
+    {
+        /* End of a session connection is an implicit 'D' */
+        tunnel_release(client->tunnel);
+    }
+    else if (client->tunnel != NULL)
+    {
+        tunnel_cancel(client->tunnel, &client->waiter);
+    }
+    event_remove(client->fd);
+    close(client->fd);
+    if (client->prev != NULL)
+        client->prev->next = client->next;
+    else
+        all_clients = client->next;
+    if (client->next != NULL)
+        client->next->prev = client->prev;
+    free(client->out);
+    free(client);
+    n_clients -= 1;
+}
+
+static void update_events(struct client* client)
+{
+    short events = POLLIN;
+    if (client->out_off < client->out_len || client->close_after_write)
+        events |= POLLOUT;
+    event_modify(client->fd, events);
+}
+
+/* Write as much pending output as the socket will take. Returns -1 if
+ * the client has gone away (and has been freed).
+ */
+static int client_flush(struct client* client)
+{
+    while (client->out_off < client->out_len)
+    {
+        ssize_t n = send(client->fd, client->out + client->out_off,
+                client->out_len - client->out_off, 0);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            client_close(client);
+            return -1;
+        }
+        client->out_off += (size_t) n;
+    }
+
+    if (client->out_off == client->out_len)
+    {
+        client->out_off = client->out_len = 0;
+        if (client->close_after_write)
+        {
+            client_close(client);
+            return -1;
+        }
+    }
+    update_events(client);
+    return 0;
+}
+
+/* Append to the pending output. If there is no memory for it, the
+ * connection is closed once the output already queued has been sent.
+ */
+static void client_queue(struct client* client, const void* data, size_t len)
+{
+    if (client->out_len + len > client->out_cap)
+    {
+        size_t new_cap = client->out_cap ? client->out_cap : 16;
+        while (new_cap < client->out_len + len)
+            new_cap *= 2;
+        char* out = realloc(client->out, new_cap);
+        if (out == NULL)
+        {
+            write_log_warn("Unable to allocate memory for reply. Closing connection.");
+            client->close_after_write = 1;
+            return;
+        }
+        client->out = out;
+        client->out_cap = new_cap;
+    }
+    memcpy(client->out + client->out_len, data, len);
+    client->out_len += len;
+}
+
+/* Queue a reply and, unless a batch of pipelined requests is being
+ * handled, try to send it. Returns -1 if the client has been freed.
+ */
+static int client_send(struct client* client, const void* data, size_t len)
+{
+    client_queue(client, data, len);
+    if (client->batching)
+        return 0;
+    return client_flush(client);
+}
+
+static int send_frame(struct client* client, unsigned int opcode, unsigned int status,
+        unsigned long request_id, const unsigned char* payload, size_t len)
+{
+    unsigned char header[PROTO_HEADER_LEN];
+    struct proto_header fields;
+    fields.version = PROTO_VERSION;
+    fields.opcode = opcode;
+    fields.status = status;
+    fields.request_id = request_id;
+    fields.length = len;
+    proto_put_header(header, &fields);
+    client_queue(client, header, sizeof(header));
+    if (len > 0)
+        client_queue(client, payload, len);
+    if (client->batching)
+        return 0;
+    return client_flush(client);
+}
+
+static int peer_allowed(struct client* client)
+{
+    /* Record who is on the other end of a local connection, and
+     * allow only our own user (or root) to hold leases.
+     */
+#if defined(SO_PEERCRED)
+    struct ucred credentials;
+    socklen_t len = sizeof(struct ucred);
+    if (getsockopt(client->fd, SOL_SOCKET, SO_PEERCRED, &credentials, &len) == -1)
+        return 0;
+    client->peer_uid = (long) credentials.uid;
+    client->peer_pid = (long) credentials.pid;
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(client->fd, &uid, &gid) == -1)
+        return 0;
+    client->peer_uid = (long) uid;
+#endif
+    return client->peer_uid == 0 || client->peer_uid == (long) geteuid();
+}
+
+static void on_accept(int fd, short revents, void* data)
+{
+    (void) revents;
+    struct listener* listener = data;
+
+    /* Drain the accept queue; the listening socket is non-blocking */
+    while (1)
+    {
+        int new_fd = accept(fd, NULL, NULL); /* don't care about client address */
+        if (new_fd == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+                write_log_warn("Error while accepting connection. Continuing.");
+            return;
+        }
+
+        struct client* client = calloc(1, sizeof(struct client));
+        if (client == NULL || set_nonblocking(new_fd) == -1 || set_cloexec(new_fd) == -1)
+        {
+            write_log_warn("Unable to set up client connection. Closing it.");
+            free(client);
+            close(new_fd);
+            continue;
+        }
+        client->fd = new_fd;
+        client->upstreams = listener->upstreams;
+        client->peer_uid = client->peer_pid = -1;
+        if (listener->check_peer && ! peer_allowed(client))
+        {
+            write_log_warn("Rejected control connection from uid %ld. Closing it.",
+                    client->peer_uid);
+            free(client);
+            close(new_fd);
+            continue;
+        }
+        client->waiter.ready = on_granted;
+        client->waiter.failed = on_failed;
+
+        if (event_add(new_fd, POLLIN, on_client, client) == -1)
+        {
+            write_log_warn("Unable to register client connection. Closing it.");
+            free(client);
+            close(new_fd);
+            continue;
+        }
+        client_link(client);
+    }
+}
+
+static void on_granted(struct waiter* waiter)
+{
+    struct client* client = (struct client*) ((char*) waiter - offsetof(struct client, waiter));
+    /* tell the client it can proceed, and which proxy port to use */
+    unsigned char message[3];
+    size_t len = 1;
+    message[0] = client->request;
+    if (client->request == 'P' || client->request == 'H' || client->request == 'S')
+    {
+        message[1] = (unsigned char) (client->tunnel->port >> 8);
+        message[2] = (unsigned char) (client->tunnel->port & 0xff);
+        len = 3;
+    }
+    if (client->request == 'S')
+        client->holds_lease = 1; /* keep the connection open */
+    else
+        client->close_after_write = 1;
+    client_send(client, message, len);
+}
+
+static void on_failed(struct waiter* waiter, const char* reason)
+{
+    struct client* client = (struct client*) ((char*) waiter - offsetof(struct client, waiter));
+    /* 'E', then the reason (length-prefixed, not terminated) */
+    unsigned char message[2 + 255];
+    size_t len = strlen(reason);
+    if (len > 255)
+        len = 255;
+    message[0] = 'E';
+    message[1] = (unsigned char) len;
+    memcpy(message + 2, reason, len);
+    client->tunnel = NULL;
+    client->close_after_write = 1;
+    client_send(client, message, 2 + len);
+}
+
+static void on_lease_granted(struct waiter* waiter)
+{
+    struct lease* lease = (struct lease*) ((char*) waiter - offsetof(struct lease, waiter));
+    unsigned char reply[8];
+    size_t len = 6;
+    lease->granted = 1;
+    proto_put32(reply, lease->id);
+    proto_put16(reply + 4, lease->tunnel->port);
+    if (lease->wants_lane)
+    {
+        proto_put16(reply + 6, lease->lane != NULL ? lane_port(lease->lane, lease->tunnel) : 0);
+        len = 8;
+        if (lease->lane != NULL)
+            metrics.lane_grants += 1;
+    }
+    send_frame(lease->client, PROTO_ACQUIRE, PROTO_OK, lease->request_id, reply, len);
+}
+
+static void on_lease_failed(struct waiter* waiter, const char* reason)
+{
+    struct lease* lease = (struct lease*) ((char*) waiter - offsetof(struct lease, waiter));
+    struct client* client = lease->client;
+    struct lease** link = &client->leases;
+    while (*link != lease)
+        link = &(*link)->next;
+    *link = lease->next;
+    client->n_leases -= 1;
+    unsigned long request_id = lease->request_id;
+    wheel_cancel(&lease_wheel, &lease->expiry);
+    free(lease);
+    send_frame(client, PROTO_ACQUIRE, PROTO_E_TUNNEL, request_id,
+            (const unsigned char*) reason, strlen(reason));
+}
+
+static void frame_acquire(struct client* client, const struct proto_header* header,
+        const unsigned char* payload)
+{
+    /* The host, then perhaps a NUL and the port (for a fast lane) */
+    char host[256];
+    const unsigned char* end = memchr(payload, '\0', header->length);
+    size_t host_len = end != NULL ? (size_t) (end - payload) : header->length;
+    if (host_len >= sizeof(host) || (end != NULL && header->length != host_len + 3))
+    {
+        send_frame(client, header->opcode, PROTO_E_MALFORMED, header->request_id, NULL, 0);
+        return;
+    }
+    memcpy(host, payload, host_len);
+    host[host_len] = '\0';
+    struct upstream* upstream = upstreams_route(client->upstreams, host);
+    if (upstream == NULL)
+    {
+        send_frame(client, header->opcode, PROTO_E_NO_ROUTE, header->request_id, NULL, 0);
+        return;
+    }
+    if (client->n_leases >= CLIENT_MAX_LEASES)
+    {
+        send_frame(client, header->opcode, PROTO_E_LIMIT, header->request_id, NULL, 0);
+        return;
+    }
+    struct lease* lease = calloc(1, sizeof(struct lease));
+    if (lease == NULL)
+    {
+        send_frame(client, header->opcode, PROTO_E_RESOURCES, header->request_id, NULL, 0);
+        return;
+    }
+    lease->id = ++client->next_lease_id;
+    lease->request_id = header->request_id;
+    lease->client = client;
+    lease->tunnel = pool_pick(&upstream->pool);
+    if (end != NULL)
+    {
+        /* ControlMaster tunnels have no lanes; see lane_args() */
+        lease->wants_lane = 1;
+        if (lease->tunnel->master_path[0] == '\0')
+            lease->lane = lane_find(upstream, host, proto_get16(end + 1));
+    }
+    lease->waiter.ready = on_lease_granted;
+    lease->waiter.failed = on_lease_failed;
+    lease->next = client->leases;
+    client->leases = lease;
+    client->n_leases += 1;
+    lease_renew(lease);
+    tunnel_acquire(lease->tunnel, &lease->waiter);
+}
+
+static void frame_release(struct client* client, const struct proto_header* header,
+        const unsigned char* payload)
+{
+    if (header->length != 4)
+    {
+        send_frame(client, header->opcode, PROTO_E_MALFORMED, header->request_id, NULL, 0);
+        return;
+    }
+    unsigned long id = proto_get32(payload);
+    struct lease** link = &client->leases;
+    while (*link != NULL && (*link)->id != id)
+        link = &(*link)->next;
+    if (*link == NULL)
+    {
+        send_frame(client, header->opcode, PROTO_E_NO_LEASE, header->request_id, NULL, 0);
+        return;
+    }
+    struct lease* lease = *link;
+    *link = lease->next;
+    client->n_leases -= 1;
+    lease_end(lease);
+    free(lease);
+    send_frame(client, header->opcode, PROTO_OK, header->request_id, NULL, 0);
+}
+
+static void on_lease_expired(struct wheel_entry* entry)
+{
+    /* No heartbeat for a whole time-to-live: the client has crashed,
+     * or can no longer reach us, so release the lease as RELEASE
+     * would. Once it has no leases left, drop the connection too.
+     */
+    struct lease* lease = (struct lease*) ((char*) entry - offsetof(struct lease, expiry));
+    struct client* client = lease->client;
+    struct lease** link = &client->leases;
+    while (*link != lease)
+        link = &(*link)->next;
+    *link = lease->next;
+    client->n_leases -= 1;
+    metrics.lease_expiries += 1;
+    write_log_warn("Lease %lu on port %u had no heartbeat for %d seconds. Releasing it.",
+            lease->id, lease->tunnel->port, lease_ttl_seconds);
+    lease_end(lease);
+    free(lease);
+    if (client->n_leases == 0)
+        client_close(client);
+}
+
+static void frame_heartbeat(struct client* client, const struct proto_header* header,
+        const unsigned char* payload)
+{
+    if (header->length != 0 && header->length != 4)
+    {
+        send_frame(client, header->opcode, PROTO_E_MALFORMED, header->request_id, NULL, 0);
+        return;
+    }
+    client->heartbeats = 1;
+    if (header->length == 4)
+    {
+        unsigned long id = proto_get32(payload);
+        struct lease* lease = client->leases;
+        while (lease != NULL && lease->id != id)
+            lease = lease->next;
+        if (lease == NULL)
+        {
+            send_frame(client, header->opcode, PROTO_E_NO_LEASE, header->request_id, NULL, 0);
+            return;
+        }
+        lease_renew(lease);
+    }
+    else
+    {
+        for (struct lease* lease = client->leases; lease != NULL; lease = lease->next)
+            lease_renew(lease);
+    }
+    unsigned char reply[2];
+    proto_put16(reply, lease_ttl_seconds > 65535 ? 65535 : (unsigned int) lease_ttl_seconds);
+    send_frame(client, header->opcode, PROTO_OK, header->request_id, reply, sizeof(reply));
+}
+
+static void frame_stats(struct client* client, const struct proto_header* header)
+{
+    /* Built in place; the daemon is single-threaded */
+    static unsigned char stats[PROTO_MAX_PAYLOAD];
+    const size_t entry_len = 11;
+    size_t len = 2;
+    unsigned int n_tunnels = 0;
+    struct upstream_table* table = client->upstreams;
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+    {
+        struct pool* pool = &table->upstreams[i]->pool;
+        for (unsigned int j = 0; j < pool->size && len + entry_len <= sizeof(stats); ++j)
+        {
+            const struct tunnel* tunnel = &pool->members[j];
+            proto_put16(stats + len, tunnel->port);
+            stats[len + 2] = (unsigned char) tunnel->state;
+            proto_put32(stats + len + 3, tunnel->n_connected);
+            proto_put32(stats + len + 7, tunnel->n_waiting);
+            len += entry_len;
+            n_tunnels += 1;
+        }
+    }
+    proto_put16(stats, n_tunnels);
+    send_frame(client, header->opcode, PROTO_OK, header->request_id, stats, len);
+}
+
+/* Rendered in place; the daemon is single-threaded */
+static char metrics_text[PROTO_MAX_PAYLOAD];
+
+static void handle_frame(struct client* client, const struct proto_header* header,
+        const unsigned char* payload)
+{
+    metrics.framed_requests[header->opcode] += 1;
+    switch (header->opcode)
+    {
+        case PROTO_ACQUIRE:
+            frame_acquire(client, header, payload);
+            break;
+        case PROTO_RELEASE:
+            frame_release(client, header, payload);
+            break;
+        case PROTO_STATS:
+            frame_stats(client, header);
+            break;
+        case PROTO_HEARTBEAT:
+            frame_heartbeat(client, header, payload);
+            break;
+        case PROTO_PING:
+            send_frame(client, header->opcode, PROTO_OK, header->request_id,
+                    payload, header->length);
+            break;
+        case PROTO_METRICS:
+            send_frame(client, header->opcode, PROTO_OK, header->request_id,
+                    (const unsigned char*) metrics_text,
+                    metrics_render(client->upstreams, metrics_text, sizeof(metrics_text)));
+            break;
+        default:
+            send_frame(client, header->opcode, PROTO_E_OPCODE, header->request_id, NULL, 0);
+            break;
+    }
+}
+
+/* Handle every complete frame in the input buffer, in place, then
+ * send all of their replies together.
+ */
+static void handle_frames(struct client* client)
+{
+    size_t offset = 0;
+    client->batching = 1;
+    while (client->in_len - offset >= PROTO_HEADER_LEN)
+    {
+        const unsigned char* frame = client->in + offset;
+        struct proto_header header;
+        if (proto_get_header(frame, &header) == -1)
+        {
+            write_log_warn("Received malformed frame. Closing connection.");
+            send_frame(client, 0, PROTO_E_MALFORMED, 0, NULL, 0);
+            client->close_after_write = 1;
+            break;
+        }
+        if (header.version != PROTO_VERSION || header.length > PROTO_MAX_REQUEST)
+        {
+            write_log_warn("Received frame with version %u, length %lu. Closing connection.",
+                    header.version, (unsigned long) header.length);
+            send_frame(client, header.opcode,
+                    header.version != PROTO_VERSION ? PROTO_E_VERSION : PROTO_E_MALFORMED,
+                    header.request_id, NULL, 0);
+            client->close_after_write = 1;
+            break;
+        }
+        if (client->in_len - offset < PROTO_HEADER_LEN + header.length)
+            break; /* the rest of this frame has not arrived yet */
+        handle_frame(client, &header, frame + PROTO_HEADER_LEN);
+        offset += PROTO_HEADER_LEN + header.length;
+    }
+    client->batching = 0;
+
+    memmove(client->in, client->in + offset, client->in_len - offset);
+    client->in_len -= offset;
+    client_flush(client);
+}
+
+static size_t message_length(const struct client* client)
+{
+    switch (client->in[0])
+    {
+        case 'R': /* two-byte proxy port being released */
+            return 3;
+        case 'H': /* length-prefixed destination host */
+        case 'S':
+            return client->in_len < 2 ? 2 : 2 + (size_t) client->in[1];
+        default:
+            return 1;
+    }
+}
+
+static void handle_message(struct client* client)
+{
+    unsigned char message = client->in[0];
+    struct upstream* fallback = client->upstreams->fallback;
+    struct upstream* upstream = NULL;
+    struct tunnel* tunnel = NULL;
+
+    client->request = message;
+    metrics.legacy_requests[message] += 1;
+    if (message == 'C') /* client wants to connect through tunnel */
+    {
+        /* Old clients only know the first proxy port */
+        if (fallback != NULL)
+            tunnel = &fallback->pool.members[0];
+    }
+    else if (message == 'P') /* ... and will be told which port to use */
+    {
+        if (fallback != NULL)
+            tunnel = pool_pick(&fallback->pool);
+    }
+    else if (message == 'H' /* ... through the upstream for a destination */
+            || message == 'S') /* ... for as long as this connection is open */
+    {
+        char host[256];
+        memcpy(host, client->in + 2, client->in[1]);
+        host[client->in[1]] = '\0';
+        upstream = upstreams_route(client->upstreams, host);
+        if (upstream != NULL)
+            tunnel = pool_pick(&upstream->pool);
+    }
+    if (message == 'C' || message == 'P' || message == 'H' || message == 'S')
+    {
+        if (tunnel == NULL)
+        {
+            write_log_warn("No upstream for requested destination. Closing connection.");
+            client_close(client);
+            return;
+        }
+        client->tunnel = tunnel;
+        tunnel_acquire(tunnel, &client->waiter);
+    }
+    else if (message == 'D' /* client telling us it is done with tunnel */
+            || message == 'R') /* ... on a particular port */
+    {
+        if (message == 'R')
+            tunnel = upstreams_find_port(client->upstreams,
+                    ((unsigned int) client->in[1] << 8) | client->in[2]);
+        else if (fallback != NULL)
+            tunnel = &fallback->pool.members[0];
+        if (tunnel == NULL)
+        {
+            write_log_warn("Release for unknown proxy port. Closing connection.");
+            client_close(client);
+            return;
+        }
+        tunnel_release(tunnel);
+        /* tell the client we acted on their message */
+        client->close_after_write = 1;
+        client_send(client, &message, sizeof(message));
+    }
+    else if (message == 'M') /* someone wants the metrics */
+    {
+        client->close_after_write = 1;
+        client_send(client, metrics_text,
+                metrics_render(client->upstreams, metrics_text, sizeof(metrics_text)));
+    }
+    else
+    {
+        write_log_warn("Received unexpected data. Closing connection.");
+        client_close(client);
+    }
+}
+
+static void on_client(int fd, short revents, void* data)
+{
+    struct client* client = data;
+
+    if (revents & POLLOUT)
+    {
+        if (client_flush(client) == -1)
+            return;
+    }
+    if (! (revents & (POLLIN | POLLHUP | POLLERR)))
+        return;
+
+    /* Collect whole messages, which may arrive in pieces. The buffer
+     * always has room: it holds the largest frame, and complete
+     * frames are consumed as soon as they arrive.
+     */
+    unsigned char discard[64];
+    unsigned char* dest = client->in + client->in_len;
+    size_t space = sizeof(client->in) - client->in_len;
+    if (client->request != 0 || client->close_after_write)
+    {
+        /* one request per connection; ignore anything else */
+        dest = discard;
+        space = sizeof(discard);
+    }
+    ssize_t n = recv(fd, dest, space, 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0)
+    {
+        /* Client went away, possibly while parked on the tunnel */
+        client_close(client);
+        return;
+    }
+    if (dest == discard)
+        return;
+    client->in_len += (size_t) n;
+
+    if (client->framed || client->in[0] == PROTO_MAGIC)
+    {
+        client->framed = 1;
+        handle_frames(client);
+        return;
+    }
+    if (client->in_len < message_length(client))
+        return;
+
+    handle_message(client);
+}
+
+void clients_save(FILE* out)
+{
+    /* client fd framed request holds_lease port waiting heartbeats
+     *        next_lease_id peer_uid peer_pid close_after_write in out
+     *        n_leases, then id request_id port granted wants_lane
+     *        lane_host lane_port for each lease
+     * port is of the tunnel leased or waited for with a one-byte
+     * request (or 0); in is what has been read of the next request,
+     * out the reply bytes not yet sent. lane_host and lane_port are
+     * the destination of the lease's fast lane ("-" and 0 if none), so
+     * that one still waiting is told of it too.
+     */
+    for (struct client* client = all_clients; client != NULL; client = client->next)
+    {
+        fprintf(out, "client %d %d %u %d %u %d %d %lu %ld %ld %d ",
+                client->fd, client->framed, client->request, client->holds_lease,
+                client->tunnel != NULL ? client->tunnel->port : 0,
+                client->waiter.waiting, client->heartbeats, client->next_lease_id,
+                client->peer_uid, client->peer_pid, client->close_after_write);
+        upgrade_put_hex(out, client->in, client->in_len);
+        fputc(' ', out);
+        upgrade_put_hex(out, client->out + client->out_off, client->out_len - client->out_off);
+        fprintf(out, " %u", client->n_leases);
+        for (struct lease* lease = client->leases; lease != NULL; lease = lease->next)
+        {
+            fprintf(out, " %lu %lu %u %d %d ", lease->id, lease->request_id,
+                    lease->tunnel->port, lease->granted, lease->wants_lane);
+            const struct lane* lane = lease->lane;
+            upgrade_put_hex(out, lane != NULL ? lane->host : NULL,
+                    lane != NULL ? strlen(lane->host) : 0);
+            fprintf(out, " %u", lane != NULL ? lane->port : 0);
+        }
+        fputc('\n', out);
+        upgrade_pass_fd(client->fd);
+    }
+}
+
+/* Fields per lease in a client record, and before fast lanes */
+#define LEASE_FIELDS 7
+#define LEASE_FIELDS_V1 4
+
+/* Parse numbers from fields into values; -1 if any is malformed */
+static int parse_numbers(char** fields, size_t count, long long* values)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (upgrade_number(fields[i], &values[i]) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/* Give back the lease in a record that is not taken over: its
+ * tunnel's record counted it, if it was granted
+ */
+static void release_lease_record(char** fields, struct upstream_table* upstreams)
+{
+    long long values[4];
+    struct tunnel* tunnel;
+    if (parse_numbers(fields, 4, values) == 0 && values[3]
+            && (tunnel = upstreams_find_port(upstreams, (unsigned int) values[2])) != NULL)
+        tunnel_release(tunnel);
+}
+
+/* A client record that is not taken over: give back its leases, and
+ * close the connection, which no one else will
+ */
+static int reject_client(int fd, struct tunnel* held, char** leases, long long n_leases,
+        size_t lease_fields, struct upstream_table* upstreams)
+{
+    if (held != NULL)
+        tunnel_release(held);
+    for (long long i = 0; i < n_leases; ++i)
+        release_lease_record(leases + lease_fields * (size_t) i, upstreams);
+    close(fd);
+    return -1;
+}
+
+/* A lease's fields: id request_id port granted, then (from state
+ * version 2) wants_lane lane_host lane_port. A lease on a tunnel that
+ * has gone with the routes file is dropped; -1 if it is malformed.
+ */
+static int adopt_lease(struct client* client, char** fields, size_t n_fields)
+{
+    long long values[4];
+    long long wants_lane = 0;
+    long long lane_port = 0;
+    unsigned char* lane_host = NULL;
+    size_t lane_host_len = 0;
+    if (parse_numbers(fields, 4, values) == -1
+            || (n_fields == LEASE_FIELDS
+                && (upgrade_number(fields[4], &wants_lane) == -1
+                    || upgrade_get_hex(fields[5], &lane_host, &lane_host_len) == -1
+                    || upgrade_number(fields[6], &lane_port) == -1)))
+    {
+        free(lane_host);
+        release_lease_record(fields, client->upstreams);
+        return -1;
+    }
+    struct tunnel* tunnel = upstreams_find_port(client->upstreams, (unsigned int) values[2]);
+    if (tunnel == NULL)
+    {
+        write_log_warn("No tunnel on port %lld any more. Dropping lease %lld.",
+                values[2], values[0]);
+        free(lane_host);
+        if (! values[3])
+            send_frame(client, PROTO_ACQUIRE, PROTO_E_NO_ROUTE,
+                    (unsigned long) values[1], NULL, 0);
+        return 0;
+    }
+    struct lease* lease = calloc(1, sizeof(struct lease));
+    if (lease == NULL)
+    {
+        free(lane_host);
+        release_lease_record(fields, client->upstreams);
+        return -1;
+    }
+    lease->id = (unsigned long) values[0];
+    lease->request_id = (unsigned long) values[1];
+    lease->client = client;
+    lease->tunnel = tunnel;
+    lease->wants_lane = wants_lane != 0;
+    if (lane_host_len > 0 && tunnel->master_path[0] == '\0')
+    {
+        /* The lanes may have changed with the binary */
+        char host[256];
+        snprintf(host, sizeof(host), "%.*s", (int) lane_host_len, (char*) lane_host);
+        lease->lane = lane_find(tunnel->upstream, host, (unsigned int) lane_port);
+    }
+    free(lane_host);
+    lease->waiter.ready = on_lease_granted;
+    lease->waiter.failed = on_lease_failed;
+    lease->next = client->leases;
+    client->leases = lease;
+    client->n_leases += 1;
+    lease_renew(lease);
+    if (values[3])
+        lease->granted = 1; /* already counted by the tunnel */
+    else
+        tunnel_acquire(tunnel, &lease->waiter);
+    return 0;
+}
+
+int clients_adopt(char** fields, size_t n_fields, struct upstream_table* upstreams)
+{
+    long long values[11];
+    long long n_leases;
+    unsigned char* in = NULL;
+    size_t in_len = 0;
+    unsigned char* out = NULL;
+    size_t out_len = 0;
+    struct tunnel* tunnel = NULL;
+    size_t lease_fields = LEASE_FIELDS;
+
+    /* The descriptor first, so that it is closed if the rest is bad */
+    if (n_fields < 2 || upgrade_number(fields[1], &values[0]) == -1 || values[0] < 0)
+        return -1;
+    int fd = (int) values[0];
+    if (n_fields < 15 || parse_numbers(fields + 2, 10, values + 1) == -1
+            || upgrade_number(fields[14], &n_leases) == -1
+            || n_leases < 0 || n_leases > CLIENT_MAX_LEASES)
+        return reject_client(fd, NULL, NULL, 0, 0, upstreams);
+    if (n_fields == 15 + LEASE_FIELDS_V1 * (size_t) n_leases)
+        lease_fields = LEASE_FIELDS_V1; /* from a binary without lanes */
+    if (n_fields != 15 + lease_fields * (size_t) n_leases)
+        return reject_client(fd, NULL, NULL, 0, 0, upstreams);
+    char** leases = fields + 15;
+    if (values[4] != 0)
+        tunnel = upstreams_find_port(upstreams, (unsigned int) values[4]);
+    if (values[4] != 0 && tunnel == NULL)
+    {
+        /* Gone from the routes file meanwhile, as in adopt_tunnel() */
+        write_log_warn("No tunnel on port %lld any more. Closing its control connection.",
+                values[4]);
+        reject_client(fd, NULL, leases, n_leases, lease_fields, upstreams);
+        return 0;
+    }
+    struct tunnel* held = values[3] ? tunnel : NULL;
+    struct client* client = calloc(1, sizeof(struct client));
+    if (client == NULL
+            || upgrade_get_hex(fields[12], &in, &in_len) == -1
+            || in_len > sizeof(client->in)
+            || upgrade_get_hex(fields[13], &out, &out_len) == -1)
+    {
+        free(in);
+        free(client);
+        return reject_client(fd, held, leases, n_leases, lease_fields, upstreams);
+    }
+    client->fd = fd;
+    client->upstreams = upstreams;
+    client->framed = (int) values[1];
+    client->request = (unsigned char) values[2];
+    client->holds_lease = (int) values[3];
+    client->tunnel = tunnel;
+    client->heartbeats = (int) values[6];
+    client->next_lease_id = (unsigned long) values[7];
+    client->peer_uid = (long) values[8];
+    client->peer_pid = (long) values[9];
+    client->close_after_write = (int) values[10];
+    if (in_len > 0)
+        memcpy(client->in, in, in_len);
+    client->in_len = in_len;
+    free(in);
+    client->out = (char*) out;
+    client->out_len = client->out_cap = out_len;
+    client->waiter.ready = on_granted;
+    client->waiter.failed = on_failed;
+    if (set_cloexec(client->fd) == -1
+            || event_add(client->fd, POLLIN, on_client, client) == -1)
+    {
+        free(client->out);
+        free(client);
+        return reject_client(fd, held, leases, n_leases, lease_fields, upstreams);
+    }
+    client_link(client);
+
+    /* Replies to leases granted meanwhile go out together */
+    client->batching = 1;
+    int result = 0;
+    for (long long i = 0; i < n_leases; ++i)
+    {
+        if (result == -1)
+            release_lease_record(leases + lease_fields * (size_t) i, upstreams);
+        else
+            result = adopt_lease(client, leases + lease_fields * (size_t) i, lease_fields);
+    }
+    if (result == -1)
+    {
+        /* Undo the leases taken over so far, and drop the connection */
+        client_close(client);
+        return -1;
+    }
+    if (values[5] && tunnel != NULL)
+        tunnel_acquire(tunnel, &client->waiter);
+    client->batching = 0;
+    client_flush(client);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_CLIENTS_H
+#define SSH_TUNNELD_CLIENTS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "protocol.h"
+#include "tunnel.h"
+#include "upstream.h"
+#include "wheel.h"
+
+/* Most leases one framed connection may hold or wait for at once */
+#define CLIENT_MAX_LEASES 64
+
+/* Granularity of lease expiry (see PROTO_HEARTBEAT) */
+#define CLIENT_LEASE_TICK_MS 1000
+
+struct client;
+
+/* A lease taken with a framed ACQUIRE, owned by its connection */
+struct lease {
+    unsigned long id;
+    unsigned long request_id; /* of the ACQUIRE, for the reply */
+    struct client* client;
+    struct tunnel* tunnel;
+    struct waiter waiter; /* parked here while the tunnel starts */
+    int granted;
+    int wants_lane; /* the ACQUIRE gave the destination port */
+    const struct lane* lane; /* to the destination, if there is one */
+    struct wheel_entry expiry; /* scheduled once the client heartbeats */
+    struct lease* next;
+};
+
+/*
+ * One control connection from ssh-tunnelc. A connection that starts
+ * with PROTO_MAGIC speaks the framed protocol (see protocol.h), and
+ * may carry any number of pipelined requests. Otherwise, it carries a
+ * single one-byte request:
+ *   'C'          take a lease on the default upstream's first tunnel;
+ *                reply 'C'
+ *   'D'          release a lease taken with 'C'; reply 'D'
+ *   'P'          take a lease on the least-loaded tunnel of the
+ *                default upstream; reply 'P' and its proxy port
+ *                (2 bytes, big-endian)
+ *   'H' len host take a lease on the least-loaded tunnel of the
+ *                upstream routed to for destination host (len bytes,
+ *                not terminated); reply 'H' and its proxy port
+ *   'R' port     release a lease on the tunnel at port; reply 'R'
+ *   'S' len host as 'H', but the lease belongs to the connection: it
+ *                stays open for the whole session, and the lease is
+ *                released when the client closes it (or dies)
+ *   'M'          reply with the metrics in the Prometheus text format,
+ *                then close the connection
+ * If the tunnel for 'C', 'P', 'H' or 'S' cannot be started, the reply
+ * is instead 'E', a length byte and the reason (not terminated), and
+ * the connection is closed.
+ */
+struct client {
+    int fd;
+    struct upstream_table* upstreams;
+    struct tunnel* tunnel; /* the tunnel this client is waiting for */
+    unsigned char in[PROTO_HEADER_LEN + PROTO_MAX_REQUEST];
+    size_t in_len;
+    unsigned char request; /* one-byte opcode being served, or 0 */
+    int holds_lease; /* released when the connection closes */
+    int framed;
+    /* Leases taken with the framed protocol */
+    struct lease* leases;
+    unsigned int n_leases;
+    unsigned long next_lease_id;
+    int heartbeats; /* leases expire unless renewed */
+    int batching; /* queue replies; flush after the batch of requests */
+    /* Credentials of a local peer, or -1 if not known */
+    long peer_uid;
+    long peer_pid;
+    struct waiter waiter; /* parked here while the tunnel starts */
+    /* Pending reply bytes that could not be sent immediately */
+    char* out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+    int close_after_write;
+    /* Every open connection, for clients_save() */
+    struct client* prev;
+    struct client* next;
+};
+
+/* Set the time-to-live of leases held by clients that send
+ * heartbeats (0: they never expire). Call before clients_listen().
+ */
+void clients_init(int lease_ttl_seconds);
+
+/* Start accepting control connections on a listening socket. If
+ * check_peer is set (for local sockets), only connections from our
+ * own user or root are accepted.
+ */
+void clients_listen(int listen_fd, struct upstream_table* upstreams, int check_peer);
+
+/* Number of control connections currently open */
+unsigned int clients_open(void);
+
+/* Live upgrade (see upgrade.h): write a "client" record for each open
+ * connection, leases and pending bytes included, and pass on its
+ * descriptor; and take a connection over from such a record, asking
+ * again for the leases it was waiting for. Leases on tunnels that have
+ * gone are dropped, as are one-byte connections to such a tunnel.
+ * clients_adopt() returns -1 if the record is malformed; the connection
+ * is then closed and its leases given back.
+ */
+void clients_save(FILE* out);
+int clients_adopt(char** fields, size_t n_fields, struct upstream_table* upstreams);
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "event.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Registered descriptors live in a dense pollfd array which is handed
+ * straight to poll(). A second array, indexed by file descriptor, maps
+ * each fd to its slot so that modify and remove are O(1). Removing an
+ * entry while events are being dispatched only marks the slot as dead
+ * (poll() ignores negative descriptors); dead slots are compacted once
+ * dispatch has finished.
+ */
+struct handler {
+    event_callback callback;
+    void* data;
+};
+
+static struct pollfd* poll_fds = NULL;
+static struct handler* handlers = NULL;
+static size_t n_fds = 0;
+static size_t cap_fds = 0;
+static int n_dead = 0;
+
+static int* slot_of_fd = NULL; /* -1 when fd is not registered */
+static size_t cap_slots = 0;
+
+static struct timer* timers = NULL; /* singly linked, unordered */
+
+static void* checked_realloc(void* ptr, size_t size)
+{
+    void* result = realloc(ptr, size);
+    if (result == NULL)
+    {
+        write_log_error("Unable to allocate memory. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+long long event_now(void)
+{
+    return event_now_usec() / 1000;
+}
+
+long long event_now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int event_add(int fd, short events, event_callback callback, void* data)
+{
+    if (fd < 0)
+        return -1;
+
+    if ((size_t) fd >= cap_slots)
+    {
+        size_t new_cap = cap_slots ? cap_slots : 64;
+        while (new_cap <= (size_t) fd)
+            new_cap *= 2;
+        slot_of_fd = checked_realloc(slot_of_fd, new_cap * sizeof(int));
+        for (size_t i = cap_slots; i < new_cap; ++i)
+            slot_of_fd[i] = -1;
+        cap_slots = new_cap;
+    }
+    if (slot_of_fd[fd] != -1)
+        return -1; /* already registered */
+
+    if (n_fds == cap_fds)
+    {
+        cap_fds = cap_fds ? cap_fds * 2 : 64;
+        poll_fds = checked_realloc(poll_fds, cap_fds * sizeof(struct pollfd));
+        handlers = checked_realloc(handlers, cap_fds * sizeof(struct handler));
+    }
+
+    poll_fds[n_fds].fd = fd;
+    poll_fds[n_fds].events = events;
+    poll_fds[n_fds].revents = 0;
+    handlers[n_fds].callback = callback;
+    handlers[n_fds].data = data;
+    slot_of_fd[fd] = (int) n_fds;
+    n_fds += 1;
+    return 0;
+}
+
+int event_modify(int fd, short events)
+{
+    if (fd < 0 || (size_t) fd >= cap_slots || slot_of_fd[fd] == -1)
+        return -1;
+    poll_fds[slot_of_fd[fd]].events = events;
+    return 0;
+}
+
+void event_remove(int fd)
+{
+    if (fd < 0 || (size_t) fd >= cap_slots || slot_of_fd[fd] == -1)
+        return;
+    int slot = slot_of_fd[fd];
+    poll_fds[slot].fd = -1;
+    poll_fds[slot].revents = 0;
+    handlers[slot].callback = NULL;
+    slot_of_fd[fd] = -1;
+    n_dead += 1;
+}
+
+static void compact(void)
+{
+    size_t out = 0;
+    for (size_t in = 0; in < n_fds; ++in)
+    {
+        if (poll_fds[in].fd < 0)
+            continue;
+        if (in != out)
+        {
+            poll_fds[out] = poll_fds[in];
+            handlers[out] = handlers[in];
+            slot_of_fd[poll_fds[out].fd] = (int) out;
+        }
+        out += 1;
+    }
+    n_fds = out;
+    n_dead = 0;
+}
+
+void timer_start(struct timer* timer, long long delay_ms, timer_callback callback, void* data)
+{
+    if (! timer->active)
+    {
+        timer->next = timers;
+        timers = timer;
+        timer->active = 1;
+    }
+    timer->deadline = event_now() + delay_ms;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+void timer_stop(struct timer* timer)
+{
+    if (! timer->active)
+        return;
+    for (struct timer** t = &timers; *t != NULL; t = &((*t)->next))
+    {
+        if (*t == timer)
+        {
+            *t = timer->next;
+            break;
+        }
+    }
+    timer->active = 0;
+    timer->next = NULL;
+}
+
+static int next_timeout(void)
+{
+    if (timers == NULL)
+        return -1; /* block until a descriptor is ready */
+
+    long long now = event_now();
+    long long earliest = timers->deadline;
+    for (struct timer* t = timers->next; t != NULL; t = t->next)
+    {
+        if (t->deadline < earliest)
+            earliest = t->deadline;
+    }
+    if (earliest <= now)
+        return 0;
+    if (earliest - now > 60000)
+        return 60000;
+    return (int) (earliest - now);
+}
+
+static void run_timers(void)
+{
+    /* Expired timers are stopped before their callback runs, so a
+     * callback may safely restart its own timer. Restart the scan
+     * after each callback, as it may have changed the list.
+     */
+    long long now = event_now();
+    int fired = 1;
+    while (fired)
+    {
+        fired = 0;
+        for (struct timer* t = timers; t != NULL; t = t->next)
+        {
+            if (t->deadline <= now)
+            {
+                timer_stop(t);
+                t->callback(t, t->data);
+                fired = 1;
+                break;
+            }
+        }
+    }
+}
+
+void event_run_once(void)
+{
+    int timeout = next_timeout();
+    int n_ready = poll(poll_fds, (nfds_t) n_fds, timeout);
+    if (n_ready == -1 && errno != EINTR)
+    {
+        write_log_error("Error in poll(). Exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Only dispatch slots that existed when poll() was called;
+     * descriptors added by callbacks are picked up next time round.
+     */
+    size_t n_polled = n_fds;
+    for (size_t i = 0; n_ready > 0 && i < n_polled; ++i)
+    {
+        short revents = poll_fds[i].revents;
+        if (revents == 0 || poll_fds[i].fd < 0)
+            continue;
+        poll_fds[i].revents = 0;
+        n_ready -= 1;
+        handlers[i].callback(poll_fds[i].fd, revents, handlers[i].data);
+    }
+    if (n_dead > 0)
+        compact();
+
+    run_timers();
+}
+
+void event_loop(void)
+{
+    while (1)
+        event_run_once();
+}
+
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int set_cloexec(int fd)
+{
+    int flags = fcntl(fd, F_GETFD, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
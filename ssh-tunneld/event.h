@@ -0,0 +1,53 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_EVENT_H
+#define SSH_TUNNELD_EVENT_H
+
+/*
+ * A small poll()-based event loop. File descriptors are registered
+ * with a callback that is invoked when poll() reports activity, and
+ * one-shot timers are driven from the same loop. Nothing in here
+ * ever blocks except the poll() call itself.
+ */
+
+typedef void (*event_callback)(int fd, short revents, void* data);
+
+struct timer;
+typedef void (*timer_callback)(struct timer* timer, void* data);
+
+struct timer {
+    long long deadline; /* monotonic milliseconds */
+    timer_callback callback;
+    void* data;
+    int active;
+    struct timer* next;
+};
+
+/* Monotonic clock, in milliseconds and microseconds */
+long long event_now(void);
+long long event_now_usec(void);
+
+/* File descriptor registration */
+int event_add(int fd, short events, event_callback callback, void* data);
+int event_modify(int fd, short events);
+void event_remove(int fd);
+
+/* Timers; (re)starting an active timer moves its deadline */
+void timer_start(struct timer* timer, long long delay_ms, timer_callback callback, void* data);
+void timer_stop(struct timer* timer);
+
+/* Run one iteration of the loop, or loop forever */
+void event_run_once(void);
+void event_loop(void);
+
+/* Put a descriptor into non-blocking mode; returns -1 on error */
+int set_nonblocking(int fd);
+
+/* Keep a descriptor from being inherited by ssh processes */
+int set_cloexec(int fd);
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "lane.h"
+#include "options.h"
+#include "tunnel.h"
+#include "upstream.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+int lane_add(struct upstream* upstream, const char* host, unsigned int port,
+        unsigned int local_port)
+{
+    if (upstream->n_lanes == LANE_MAX)
+        return -1;
+    struct lane* lane = &upstream->lanes[upstream->n_lanes++];
+    lane->host = checked_strdup(host);
+    lane->port = port;
+    lane->local_port = local_port;
+    return 0;
+}
+
+const struct lane* lane_find(const struct upstream* upstream, const char* host,
+        unsigned int port)
+{
+    for (size_t i = 0; i < upstream->n_lanes; ++i)
+    {
+        const struct lane* lane = &upstream->lanes[i];
+        if (lane->port == port && strcasecmp(lane->host, host) == 0)
+            return lane;
+    }
+    return NULL;
+}
+
+unsigned int lane_port(const struct lane* lane, const struct tunnel* tunnel)
+{
+    return lane->local_port + (unsigned int) (tunnel - tunnel->upstream->pool.members);
+}
+
+void lane_args(const struct tunnel* tunnel, char* args[2 * LANE_MAX + 1],
+        char buffers[LANE_MAX][LANE_ARG_MAX])
+{
+    const struct upstream* upstream = tunnel->upstream;
+    size_t n = 0;
+    /* A ControlMaster's clients use "ssh -W", which needs no lane */
+    for (size_t i = 0; i < upstream->n_lanes && tunnel->master_path[0] == '\0'; ++i)
+    {
+        const struct lane* lane = &upstream->lanes[i];
+        /* An IPv6 address needs brackets, to tell its colons apart */
+        const char* format = strchr(lane->host, ':') != NULL ? "%u:[%s]:%u" : "%u:%s:%u";
+        snprintf(buffers[i], LANE_ARG_MAX, format, lane_port(lane, tunnel),
+                lane->host, lane->port);
+        args[n++] = "-L";
+        args[n++] = buffers[i];
+    }
+    args[n] = NULL;
+}
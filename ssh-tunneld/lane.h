@@ -0,0 +1,55 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_LANE_H
+#define SSH_TUNNELD_LANE_H
+
+#include <stddef.h>
+
+struct tunnel;
+struct upstream;
+
+/*
+ * Fast lanes: "ssh -L" forwards, on the same ssh processes as the
+ * SOCKS5 proxy, to a few destinations that are used all the time. A
+ * client going to a lane's host and port connects straight to its
+ * local port, and skips the SOCKS5 handshake. Like the proxy ports,
+ * lane ports are consecutive across an upstream's pool: member i
+ * forwards local_port + i.
+ *
+ * An ACQUIRE that gives the destination port (see protocol.h) is told
+ * the lane port in its reply, so finding a lane costs no extra round
+ * trip. An ssh that cannot listen on a lane port exits, rather than
+ * leave clients to connect to whatever has the port.
+ */
+#define LANE_MAX 16 /* per upstream */
+#define LANE_ARG_MAX 272 /* "<local port>:<host>:<port>" */
+
+struct lane {
+    char* host;
+    unsigned int port;
+    unsigned int local_port; /* on the first member of the pool */
+};
+
+/* Add a lane to the upstream; returns -1 if it has LANE_MAX already */
+int lane_add(struct upstream* upstream, const char* host, unsigned int port,
+        unsigned int local_port);
+
+/* The upstream's lane to host:port, or NULL */
+const struct lane* lane_find(const struct upstream* upstream, const char* host,
+        unsigned int port);
+
+/* The lane's local port on tunnel, a member of its upstream's pool */
+unsigned int lane_port(const struct lane* lane, const struct tunnel* tunnel);
+
+/* Fill in args with "-L <forward>" for each lane of the tunnel's
+ * upstream (none if it is a ControlMaster), then NULL; the forwards
+ * are written to buffers.
+ */
+void lane_args(const struct tunnel* tunnel, char* args[2 * LANE_MAX + 1],
+        char buffers[LANE_MAX][LANE_ARG_MAX]);
+
+#endif
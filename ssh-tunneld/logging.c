@@ -4,73 +4,474 @@
  * of the source distribution for further details.
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
 
 #include "logging.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
-/* Global variables */
-FILE* logfile;
+#include <sys/uio.h>
 
-char *terminated_strncpy(char *dest, const char *src, size_t n)
+#define LOG_RING_SIZE 1024 /* records; a power of two */
+#define LOG_RECORD_MAX 640 /* level, escaped message, fields and newline */
+#define LOG_MESSAGE_MAX 512
+#define LOG_BATCH 64 /* records per writev() */
+#define LOG_STAMP_LEN 23 /* "ts=YYYY-MM-DDTHH:MM:SSZ" */
+
+struct log_record {
+    time_t seconds;
+    size_t len;
+    char text[LOG_RECORD_MAX];
+};
+
+static int log_fd = -1;
+static char* log_path = NULL; /* absolute, for reopening; NULL for stderr */
+static enum log_level log_min_level = LOG_LEVEL_INFO;
+
+/* Single-producer, single-consumer ring: the event loop fills records
+ * at ring_head, the flusher thread writes them out from ring_tail.
+ */
+static struct log_record ring[LOG_RING_SIZE];
+static atomic_size_t ring_head;
+static atomic_size_t ring_tail;
+static atomic_ulong dropped;
+
+static atomic_int flusher_sleeping;
+static atomic_int reopen_requested;
+static atomic_int stopping;
+static int running = 0;
+static int wake_pipe[2] = { -1, -1 };
+static pthread_t flusher;
+
+static const char* level_names[] = { "debug", "info", "warn", "error" };
+
+static char* put_digits(char* out, unsigned long value, int width)
+{
+    for (int i = width - 1; i >= 0; --i)
+    {
+        out[i] = (char) ('0' + value % 10);
+        value /= 10;
+    }
+    return out + width;
+}
+
+static void format_stamp(time_t seconds, char* out)
+{
+    /* UTC civil date from days since the epoch (after Howard Hinnant's
+     * days_from_civil inverse), so that no locale, time zone or lock is
+     * involved; out has room for LOG_STAMP_LEN bytes.
+     */
+    long long days = (long long) seconds / 86400;
+    long long second_of_day = (long long) seconds % 86400;
+    if (second_of_day < 0)
+    {
+        second_of_day += 86400;
+        days -= 1;
+    }
+    days += 719468;
+    long long era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned long day_of_era = (unsigned long) (days - era * 146097);
+    unsigned long year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524
+            - day_of_era / 146096) / 365;
+    long long year = (long long) year_of_era + era * 400;
+    unsigned long day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4
+            - year_of_era / 100);
+    unsigned long month_index = (5 * day_of_year + 2) / 153;
+    unsigned long day = day_of_year - (153 * month_index + 2) / 5 + 1;
+    unsigned long month = month_index < 10 ? month_index + 3 : month_index - 9;
+    if (month <= 2)
+        year += 1;
+
+    memcpy(out, "ts=", 3);
+    char* p = put_digits(out + 3, (unsigned long) year, 4);
+    *p++ = '-';
+    p = put_digits(p, month, 2);
+    *p++ = '-';
+    p = put_digits(p, day, 2);
+    *p++ = 'T';
+    p = put_digits(p, (unsigned long) (second_of_day / 3600), 2);
+    *p++ = ':';
+    p = put_digits(p, (unsigned long) (second_of_day / 60 % 60), 2);
+    *p++ = ':';
+    p = put_digits(p, (unsigned long) (second_of_day % 60), 2);
+    *p = 'Z';
+}
+
+static size_t append_text(char* out, size_t len, size_t cap, const char* text)
+{
+    size_t n = strlen(text);
+    if (n > cap - len)
+        n = cap - len;
+    memcpy(out + len, text, n);
+    return len + n;
+}
+
+/* Everything after the timestamp: " level=... msg="..." fields\n".
+ * Uses no library calls that are unsafe after fork().
+ */
+static size_t format_record(char* out, enum log_level level, const char* message,
+        const char* fields)
+{
+    const size_t cap = LOG_RECORD_MAX - 2; /* room for the closing quote and newline */
+    size_t len = append_text(out, 0, cap, " level=");
+    len = append_text(out, len, cap, level_names[level]);
+    len = append_text(out, len, cap, " msg=\"");
+    for (const char* c = message; *c != '\0' && len + 2 <= cap; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            out[len++] = '\\';
+            out[len++] = *c;
+        }
+        else if ((unsigned char) *c < 0x20)
+        {
+            out[len++] = '\\';
+            out[len++] = *c == '\n' ? 'n' : '?';
+        }
+        else
+        {
+            out[len++] = *c;
+        }
+    }
+    out[len++] = '"';
+    if (fields != NULL)
+    {
+        len = append_text(out, len, LOG_RECORD_MAX - 1, " ");
+        len = append_text(out, len, LOG_RECORD_MAX - 1, fields);
+    }
+    out[len++] = '\n';
+    return len;
+}
+
+static void write_all(int fd, struct iovec* iov, int n_iov)
+{
+    /* Keep going after a partial write; give up on an error, since
+     * there is nowhere to report it.
+     */
+    while (n_iov > 0)
+    {
+        ssize_t n = writev(fd, iov, n_iov);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (n_iov > 0 && (size_t) n >= iov->iov_len)
+        {
+            n -= (ssize_t) iov->iov_len;
+            ++iov;
+            --n_iov;
+        }
+        if (n_iov > 0)
+        {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= (size_t) n;
+        }
+    }
+}
+
+static void write_now(time_t seconds, const char* text, size_t len)
+{
+    char stamp[LOG_STAMP_LEN];
+    struct iovec iov[2];
+    format_stamp(seconds, stamp);
+    iov[0].iov_base = stamp;
+    iov[0].iov_len = sizeof(stamp);
+    iov[1].iov_base = (char*) text;
+    iov[1].iov_len = len;
+    write_all(log_fd, iov, 2);
+}
+
+static void wake_flusher(void)
+{
+    char byte = 0;
+    ssize_t n = write(wake_pipe[1], &byte, 1);
+    (void) n; /* if the pipe is full, a wake-up is already pending */
+}
+
+static void submit(enum log_level level, const char* message, const char* fields)
+{
+    if (log_fd == -1 || level < log_min_level)
+        return;
+    time_t now = time(NULL);
+    if (! running)
+    {
+        char text[LOG_RECORD_MAX];
+        write_now(now, text, format_record(text, level, message, fields));
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_SIZE)
+    {
+        /* Never wait for the disk; count the record as lost instead */
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    struct log_record* record = &ring[head & (LOG_RING_SIZE - 1)];
+    record->seconds = now;
+    record->len = format_record(record->text, level, message, fields);
+    atomic_store(&ring_head, head + 1);
+    if (atomic_exchange(&flusher_sleeping, 0))
+        wake_flusher();
+}
+
+static void reopen_file(void)
 {
-    /* Wrapper for strncpy() that ensures correct string termination */
-    size_t source_length = strlen(src);
-    strncpy(dest, src, n); /* null termination of dest will be enforced */
-    if (source_length >= n)
+    if (log_path == NULL)
+        return;
+    int fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (fd == -1)
+        return; /* keep writing to the old file */
+    dup2(fd, log_fd);
+    fcntl(log_fd, F_SETFD, FD_CLOEXEC);
+    close(fd);
+}
+
+static void* flusher_main(void* arg)
+{
+    (void) arg;
+    struct iovec iov[2 * LOG_BATCH];
+    char stamp[LOG_STAMP_LEN];
+    time_t stamp_seconds = (time_t) -1;
+
+    while (1)
     {
-        /* Source string was too big, so we terminate at the end
-         * of destination buffer
+        if (atomic_exchange(&reopen_requested, 0))
+            reopen_file();
+        unsigned long n_dropped = atomic_exchange(&dropped, 0);
+        if (n_dropped > 0)
+        {
+            char fields[32];
+            char text[LOG_RECORD_MAX];
+            snprintf(fields, sizeof(fields), "dropped=%lu", n_dropped);
+            write_now(time(NULL), text, format_record(text, LOG_LEVEL_WARN,
+                        "Log buffer full; records dropped.", fields));
+        }
+
+        size_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+        if (head == tail)
+        {
+            if (atomic_load(&stopping))
+                break;
+            /* Sleep until the producer wakes us; it checks the flag
+             * after publishing, and we check the ring after setting it.
+             */
+            atomic_store(&flusher_sleeping, 1);
+            if (atomic_load(&ring_head) == tail && ! atomic_load(&stopping)
+                    && ! atomic_load(&reopen_requested))
+            {
+                struct pollfd wake;
+                char drain[64];
+                wake.fd = wake_pipe[0];
+                wake.events = POLLIN;
+                wake.revents = 0;
+                poll(&wake, 1, -1);
+                while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+                    ;
+            }
+            atomic_store(&flusher_sleeping, 0);
+            continue;
+        }
+
+        /* Write out a batch of records that share a timestamp, which is
+         * formatted only when the second changes.
          */
-        dest[n-1] = '\0';
+        int n_iov = 0;
+        size_t count = 0;
+        while (tail + count != head && count < LOG_BATCH)
+        {
+            struct log_record* record = &ring[(tail + count) & (LOG_RING_SIZE - 1)];
+            if (record->seconds != stamp_seconds)
+            {
+                if (n_iov > 0)
+                    break;
+                format_stamp(record->seconds, stamp);
+                stamp_seconds = record->seconds;
+            }
+            iov[n_iov].iov_base = stamp;
+            iov[n_iov].iov_len = sizeof(stamp);
+            iov[n_iov + 1].iov_base = record->text;
+            iov[n_iov + 1].iov_len = record->len;
+            n_iov += 2;
+            count += 1;
+        }
+        write_all(log_fd, iov, n_iov);
+        atomic_store_explicit(&ring_tail, tail + count, memory_order_release);
+    }
+    return NULL;
+}
+
+void log_stop(void)
+{
+    /* Write out whatever is left, and go back to writing synchronously */
+    if (! running)
+        return;
+    atomic_store(&stopping, 1);
+    wake_flusher();
+    pthread_join(flusher, NULL);
+    running = 0;
+    atomic_store(&stopping, 0);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    wake_pipe[0] = wake_pipe[1] = -1;
+}
+
+int log_open(const char* filename, int to_stderr, enum log_level min_level)
+{
+    log_min_level = min_level;
+    if (to_stderr)
+    {
+        log_fd = STDERR_FILENO;
+        return 0;
+    }
+    if (filename == NULL)
+        return 0;
+
+    /* Keep an absolute path, since a daemon runs in "/" */
+    if (filename[0] == '/')
+    {
+        log_path = strdup(filename);
     }
     else
     {
-        /* Source string fits inside destination buffer, so we
-         * can terminate immediately after it
-         */
-        dest[source_length] = '\0';
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd)) == NULL)
+            return -1;
+        log_path = malloc(strlen(cwd) + strlen(filename) + 2);
+        if (log_path != NULL)
+            sprintf(log_path, "%s/%s", cwd, filename);
     }
-    return dest;
+    if (log_path == NULL)
+        return -1;
+
+    log_fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (log_fd == -1)
+        return -1;
+    fcntl(log_fd, F_SETFD, FD_CLOEXEC);
+    return 0;
 }
 
-/* Function definitions */
-void write_log_connect(int num_connections)
+void log_start(void)
 {
-    /* Duplicate some of the logging code to avoid
-     * using snprintf(), which triggers a warning
-     * on FreeBSD 9 when compiling with
-     * -pedantic -std=c99 -Wall -Wextra
-     */
-    if (logfile != NULL)
+    static int stop_at_exit = 0;
+    if (log_fd == -1 || running)
+        return;
+    if (pipe(wake_pipe) == -1)
+        return; /* carry on writing synchronously */
+    for (int i = 0; i < 2; ++i)
+    {
+        fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    /* Signals are for the event loop; the flusher blocks them all */
+    sigset_t all_signals;
+    sigset_t old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask);
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) == 0)
     {
-        char time_string[64];
-        time_t t = time(NULL);
-        char* str_time = ctime(&t);
-        terminated_strncpy(time_string, str_time, sizeof(time_string));
-        size_t stime = strlen(time_string);
-        time_string[stime-1] = '\0'; /* remove '\n' from time string */
-        fprintf(logfile, "[%s] Connections: %d.\n", time_string, num_connections);
-        fflush(logfile);
+        running = 1;
+        if (! stop_at_exit)
+            atexit(log_stop);
+        stop_at_exit = 1;
     }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
 }
 
-void write_log(const char* message)
+void log_reopen(void)
 {
-    /* write a log message that is prefixed with the current date & time */
-    if (logfile != NULL)
+    if (! running)
     {
-        char time_string[64];
-        time_t t = time(NULL);
-        char* str_time = ctime(&t); /* obtain time as string */
-        terminated_strncpy(time_string, str_time, sizeof(time_string));
-        size_t stime = strlen(time_string);
-        time_string[stime-1] = '\0'; /* remove '\n' from time string */
-        fprintf(logfile, "[%s] %s\n", time_string, message);
-        fflush(logfile);
+        reopen_file();
+        return;
     }
+    atomic_store(&reopen_requested, 1);
+    wake_flusher();
 }
 
+/* Function definitions */
+void write_log_connect(unsigned int num_connections)
+{
+    char message[32];
+    char fields[32];
+    snprintf(message, sizeof(message), "Connections: %u.", num_connections);
+    snprintf(fields, sizeof(fields), "connections=%u", num_connections);
+    submit(LOG_LEVEL_DEBUG, message, fields);
+}
+
+void write_log(const char* message)
+{
+    submit(LOG_LEVEL_INFO, message, NULL);
+}
+
+static void write_log_va(enum log_level level, const char* format, va_list args)
+{
+    if (log_fd == -1 || level < log_min_level)
+        return;
+    char message[LOG_MESSAGE_MAX];
+    vsnprintf(message, sizeof(message), format, args);
+    submit(level, message, NULL);
+}
+
+void write_logf(const char* format, ...)
+{
+    /* write_log() with printf-style formatting of the message */
+    va_list args;
+    va_start(args, format);
+    write_log_va(LOG_LEVEL_INFO, format, args);
+    va_end(args);
+}
+
+void write_log_debug(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    write_log_va(LOG_LEVEL_DEBUG, format, args);
+    va_end(args);
+}
+
+void write_log_warn(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    write_log_va(LOG_LEVEL_WARN, format, args);
+    va_end(args);
+}
+
+void write_log_error(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    write_log_va(LOG_LEVEL_ERROR, format, args);
+    va_end(args);
+}
+
+void write_log_child(const char* message)
+{
+    if (log_fd == -1)
+        return;
+    struct timespec now;
+    char line[LOG_STAMP_LEN + LOG_RECORD_MAX];
+    clock_gettime(CLOCK_REALTIME, &now);
+    format_stamp(now.tv_sec, line);
+    size_t len = LOG_STAMP_LEN + format_record(line + LOG_STAMP_LEN, LOG_LEVEL_ERROR,
+            message, NULL);
+    ssize_t n = write(log_fd, line, len);
+    (void) n;
+}
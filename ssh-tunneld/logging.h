@@ -7,11 +7,55 @@
 #ifndef SSH_TUNNELD_LOGGING_H
 #define SSH_TUNNELD_LOGGING_H
 
-#include <stdio.h>
+/*
+ * Log records are one line each, in key=value form:
+ *
+ *   ts=2026-10-17T09:30:00Z level=info msg="Starting ssh process."
+ *
+ * Once log_start() has been called, the write_log functions only
+ * format the record into a lock-free ring buffer (a single producer,
+ * the event loop, and a single consumer) and return; a flusher thread
+ * writes records out in batches with writev(), so a slow disk never
+ * delays replies to clients. If the ring is full, records are dropped
+ * and the number dropped is logged later. Before log_start(), records
+ * are written directly.
+ */
+enum log_level {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
+
+/* Log to filename (appending), or to stderr if to_stderr is set; with
+ * neither, records are discarded. Records below min_level are ignored.
+ * Returns -1 if the file cannot be opened.
+ */
+int log_open(const char* filename, int to_stderr, enum log_level min_level);
+
+/* Start the flusher thread; call after daemonize(). The remaining
+ * records are written out when the process exits.
+ */
+void log_start(void);
+
+/* Write out the remaining records and stop the flusher thread, as at
+ * exit (or before exec); log_start() may start it again.
+ */
+void log_stop(void);
 
-void write_log_connect(int num_connections);
+/* Reopen the log file (after it has been rotated) */
+void log_reopen(void);
+
+void write_log_connect(unsigned int num_connections);
 void write_log(const char* message);
+void write_logf(const char* format, ...);
+void write_log_debug(const char* format, ...);
+void write_log_warn(const char* format, ...);
+void write_log_error(const char* format, ...);
 
-extern FILE* logfile;
+/* Write a record immediately, using only async-signal-safe calls; for
+ * a child process between fork() and exec().
+ */
+void write_log_child(const char* message);
 
 #endif
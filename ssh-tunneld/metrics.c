@@ -0,0 +1,310 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "metrics.h"
+#include "event.h"
+#include "proc.h"
+#include "protocol.h"
+#include "upstream.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+struct metrics metrics;
+
+void metrics_init(void)
+{
+    memset(&metrics, 0, sizeof(struct metrics));
+    metrics.started_usec = event_now_usec();
+}
+
+void histogram_observe(struct histogram* histogram, long long usec)
+{
+    unsigned int bucket = 0;
+    unsigned long long bound = 1;
+    unsigned long long value = usec > 0 ? (unsigned long long) usec : 0;
+    while (bucket < METRICS_BUCKETS && value > bound)
+    {
+        bound <<= 1;
+        bucket += 1;
+    }
+    histogram->buckets[bucket] += 1;
+    histogram->count += 1;
+    histogram->sum_usec += value;
+}
+
+/* Output buffer that only ever holds whole lines */
+struct output {
+    char* buf;
+    size_t len;
+    size_t cap;
+    int full;
+};
+
+static void append(struct output* out, const char* format, ...)
+{
+    if (out->full)
+        return;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(out->buf + out->len, out->cap - out->len, format, args);
+    va_end(args);
+    if (n < 0 || (size_t) n >= out->cap - out->len)
+    {
+        out->full = 1;
+        out->buf[out->len] = '\0';
+        return;
+    }
+    out->len += (size_t) n;
+}
+
+static void render_histogram(struct output* out, const char* name, const char* help,
+        const struct histogram* histogram)
+{
+    append(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    unsigned long long cumulative = 0;
+    unsigned long long bound = 1;
+    for (unsigned int i = 0; i < METRICS_BUCKETS; ++i)
+    {
+        cumulative += histogram->buckets[i];
+        append(out, "%s_bucket{le=\"%g\"} %llu\n", name, (double) bound / 1e6, cumulative);
+        bound <<= 1;
+    }
+    append(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, histogram->count);
+    append(out, "%s_sum %.6f\n", name, (double) histogram->sum_usec / 1e6);
+    append(out, "%s_count %llu\n", name, histogram->count);
+}
+
+static const char* frame_opcode_name(unsigned int opcode)
+{
+    switch (opcode)
+    {
+        case PROTO_ACQUIRE:
+            return "acquire";
+        case PROTO_RELEASE:
+            return "release";
+        case PROTO_STATS:
+            return "stats";
+        case PROTO_PING:
+            return "ping";
+        case PROTO_METRICS:
+            return "metrics";
+        case PROTO_HEARTBEAT:
+            return "heartbeat";
+        default:
+            return NULL;
+    }
+}
+
+static void render_requests(struct output* out)
+{
+    append(out, "# HELP ssh_tunneld_requests_total Control requests received, by opcode.\n"
+            "# TYPE ssh_tunneld_requests_total counter\n");
+    unsigned long long unknown = 0;
+    for (unsigned int i = 0; i < 256; ++i)
+    {
+        if (metrics.legacy_requests[i] == 0)
+            continue;
+        if (i >= 'A' && i <= 'Z')
+            append(out, "ssh_tunneld_requests_total{protocol=\"legacy\",opcode=\"%c\"} %llu\n",
+                    (char) i, metrics.legacy_requests[i]);
+        else
+            unknown += metrics.legacy_requests[i];
+    }
+    for (unsigned int i = 0; i < 256; ++i)
+    {
+        const char* name = frame_opcode_name(i);
+        if (name != NULL)
+            append(out, "ssh_tunneld_requests_total{protocol=\"framed\",opcode=\"%s\"} %llu\n",
+                    name, metrics.framed_requests[i]);
+        else
+            unknown += metrics.framed_requests[i];
+    }
+    append(out, "ssh_tunneld_requests_total{protocol=\"any\",opcode=\"unknown\"} %llu\n",
+            unknown);
+}
+
+/* One line per tunnel for each per-tunnel metric */
+enum tunnel_metric {
+    TUNNEL_METRIC_STATE,
+    TUNNEL_METRIC_LEASES,
+    TUNNEL_METRIC_WAITING,
+    TUNNEL_METRIC_CPU,
+    TUNNEL_METRIC_RSS
+};
+
+static void render_tunnels(struct output* out, struct upstream_table* table,
+        enum tunnel_metric which, const char* name, const char* type, const char* help)
+{
+    long clock_ticks = sysconf(_SC_CLK_TCK);
+    if (clock_ticks <= 0)
+        clock_ticks = 100;
+    append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+    {
+        struct upstream* upstream = table->upstreams[i];
+        for (unsigned int j = 0; j < upstream->pool.size; ++j)
+        {
+            const struct tunnel* tunnel = &upstream->pool.members[j];
+            int running = tunnel->state != TUNNEL_STOPPED && tunnel->ssh_process > 0;
+            unsigned long value = 0;
+            switch (which)
+            {
+                case TUNNEL_METRIC_STATE:
+                    value = (unsigned long) tunnel->state;
+                    break;
+                case TUNNEL_METRIC_LEASES:
+                    value = tunnel->n_connected;
+                    break;
+                case TUNNEL_METRIC_WAITING:
+                    value = tunnel->n_waiting;
+                    break;
+                case TUNNEL_METRIC_CPU:
+                    if (! running || proc_cpu_ticks(tunnel->ssh_process, &value) != 0)
+                        continue;
+                    append(out, "%s{upstream=\"%s\",port=\"%u\"} %.2f\n", name,
+                            upstream->name, tunnel->port, (double) value / clock_ticks);
+                    continue;
+                case TUNNEL_METRIC_RSS:
+                    if (! running || proc_rss_bytes(tunnel->ssh_process, &value) != 0)
+                        continue;
+                    break;
+            }
+            append(out, "%s{upstream=\"%s\",port=\"%u\"} %lu\n", name,
+                    upstream->name, tunnel->port, value);
+        }
+    }
+}
+
+/* Racing statistics of the upstreams with several candidate hosts */
+static void render_candidates(struct output* out, struct upstream_table* table)
+{
+    append(out, "# HELP ssh_tunneld_candidate_ready_seconds Smoothed time for ssh to each "
+            "candidate host to be ready.\n"
+            "# TYPE ssh_tunneld_candidate_ready_seconds gauge\n");
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+    {
+        struct upstream* upstream = table->upstreams[i];
+        for (size_t j = 0; upstream->n_candidates > 1 && j < upstream->n_candidates; ++j)
+        {
+            const struct candidate* candidate = &upstream->candidates[j];
+            append(out, "ssh_tunneld_candidate_ready_seconds{upstream=\"%s\",host=\"%s\"} "
+                    "%.6f\n", upstream->name, candidate->host,
+                    (double) candidate->ready_usec / 1e6);
+        }
+    }
+    append(out, "# HELP ssh_tunneld_candidate_races_total Races for a tunnel, by candidate "
+            "host and result.\n"
+            "# TYPE ssh_tunneld_candidate_races_total counter\n");
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+    {
+        struct upstream* upstream = table->upstreams[i];
+        for (size_t j = 0; upstream->n_candidates > 1 && j < upstream->n_candidates; ++j)
+        {
+            const struct candidate* candidate = &upstream->candidates[j];
+            append(out, "ssh_tunneld_candidate_races_total{upstream=\"%s\",host=\"%s\","
+                    "result=\"won\"} %lu\n", upstream->name, candidate->host, candidate->wins);
+            append(out, "ssh_tunneld_candidate_races_total{upstream=\"%s\",host=\"%s\","
+                    "result=\"failed\"} %lu\n", upstream->name, candidate->host,
+                    candidate->failures);
+        }
+    }
+}
+
+size_t metrics_render(struct upstream_table* table, char* buf, size_t len)
+{
+    struct output out;
+    out.buf = buf;
+    out.len = 0;
+    out.cap = len;
+    out.full = 0;
+    if (len == 0)
+        return 0;
+    buf[0] = '\0';
+
+    long long uptime_usec = event_now_usec() - metrics.started_usec;
+    append(&out, "# HELP ssh_tunneld_uptime_seconds Time since ssh-tunneld started.\n"
+            "# TYPE ssh_tunneld_uptime_seconds gauge\n"
+            "ssh_tunneld_uptime_seconds %.3f\n", (double) uptime_usec / 1e6);
+    render_requests(&out);
+    append(&out, "# HELP ssh_tunneld_ssh_starts_total ssh processes started.\n"
+            "# TYPE ssh_tunneld_ssh_starts_total counter\n"
+            "ssh_tunneld_ssh_starts_total %llu\n", metrics.ssh_starts);
+    append(&out, "# HELP ssh_tunneld_ssh_stops_total ssh processes stopped.\n"
+            "# TYPE ssh_tunneld_ssh_stops_total counter\n"
+            "ssh_tunneld_ssh_stops_total %llu\n", metrics.ssh_stops);
+    append(&out, "# HELP ssh_tunneld_ssh_exits_total ssh processes that exited unasked.\n"
+            "# TYPE ssh_tunneld_ssh_exits_total counter\n"
+            "ssh_tunneld_ssh_exits_total %llu\n", metrics.ssh_exits);
+    append(&out, "# HELP ssh_tunneld_ssh_respawns_total ssh processes restarted after exiting.\n"
+            "# TYPE ssh_tunneld_ssh_respawns_total counter\n"
+            "ssh_tunneld_ssh_respawns_total %llu\n", metrics.ssh_respawns);
+    append(&out, "# HELP ssh_tunneld_ssh_kills_total ssh processes killed after ignoring SIGTERM.\n"
+            "# TYPE ssh_tunneld_ssh_kills_total counter\n"
+            "ssh_tunneld_ssh_kills_total %llu\n", metrics.ssh_kills);
+    append(&out, "# HELP ssh_tunneld_start_failures_total Starts that failed, by cause.\n"
+            "# TYPE ssh_tunneld_start_failures_total counter\n"
+            "ssh_tunneld_start_failures_total{cause=\"exited\"} %llu\n"
+            "ssh_tunneld_start_failures_total{cause=\"timeout\"} %llu\n",
+            metrics.start_failures, metrics.start_timeouts);
+    append(&out, "# HELP ssh_tunneld_leases Leases currently held.\n"
+            "# TYPE ssh_tunneld_leases gauge\n"
+            "ssh_tunneld_leases %llu\n", metrics.leases);
+    append(&out, "# HELP ssh_tunneld_leases_peak Most leases held at once.\n"
+            "# TYPE ssh_tunneld_leases_peak gauge\n"
+            "ssh_tunneld_leases_peak %llu\n", metrics.peak_leases);
+    append(&out, "# HELP ssh_tunneld_lease_expiries_total Leases released for want of a heartbeat.\n"
+            "# TYPE ssh_tunneld_lease_expiries_total counter\n"
+            "ssh_tunneld_lease_expiries_total %llu\n", metrics.lease_expiries);
+    append(&out, "# HELP ssh_tunneld_lane_grants_total Leases granted with a fast lane to their destination.\n"
+            "# TYPE ssh_tunneld_lane_grants_total counter\n"
+            "ssh_tunneld_lane_grants_total %llu\n", metrics.lane_grants);
+    append(&out, "# HELP ssh_tunneld_prewarm_starts_total Tunnels started ahead of demand.\n"
+            "# TYPE ssh_tunneld_prewarm_starts_total counter\n"
+            "ssh_tunneld_prewarm_starts_total %llu\n", metrics.prewarm_starts);
+    append(&out, "# HELP ssh_tunneld_prewarms_total Pre-warmed tunnels, by whether a client used them.\n"
+            "# TYPE ssh_tunneld_prewarms_total counter\n"
+            "ssh_tunneld_prewarms_total{result=\"used\"} %llu\n"
+            "ssh_tunneld_prewarms_total{result=\"unused\"} %llu\n",
+            metrics.prewarm_hits, metrics.prewarm_misses);
+    append(&out, "# HELP ssh_tunneld_cold_starts_total Tunnels started by a client's request.\n"
+            "# TYPE ssh_tunneld_cold_starts_total counter\n"
+            "ssh_tunneld_cold_starts_total %llu\n", metrics.cold_starts);
+    append(&out, "# HELP ssh_tunneld_linger_hits_total Lingering tunnels reused by a client.\n"
+            "# TYPE ssh_tunneld_linger_hits_total counter\n"
+            "ssh_tunneld_linger_hits_total %llu\n", metrics.linger_hits);
+    append(&out, "# HELP ssh_tunneld_linger_expiries_total Tunnels stopped at the end of their linger time.\n"
+            "# TYPE ssh_tunneld_linger_expiries_total counter\n"
+            "ssh_tunneld_linger_expiries_total %llu\n", metrics.linger_expiries);
+    append(&out, "# HELP ssh_tunneld_socks_connections_total Connections accepted on the SOCKS5 port.\n"
+            "# TYPE ssh_tunneld_socks_connections_total counter\n"
+            "ssh_tunneld_socks_connections_total %llu\n", metrics.socks_connections);
+    append(&out, "# HELP ssh_tunneld_socks_connections Open connections on the SOCKS5 port.\n"
+            "# TYPE ssh_tunneld_socks_connections gauge\n"
+            "ssh_tunneld_socks_connections %llu\n", metrics.socks_active);
+    render_histogram(&out, "ssh_tunneld_time_to_ready_seconds",
+            "Time from starting ssh to its SOCKS5 port accepting connections.",
+            &metrics.time_to_ready);
+    render_histogram(&out, "ssh_tunneld_queue_wait_seconds",
+            "Time clients waited for their tunnel to be ready.",
+            &metrics.queue_wait);
+    render_tunnels(&out, table, TUNNEL_METRIC_STATE, "ssh_tunneld_tunnel_state", "gauge",
+            "Tunnel state: 0 stopped, 1 starting, 2 ready, 3 lingering, 4 stopping.");
+    render_tunnels(&out, table, TUNNEL_METRIC_LEASES, "ssh_tunneld_tunnel_leases", "gauge",
+            "Leases held on the tunnel.");
+    render_tunnels(&out, table, TUNNEL_METRIC_WAITING, "ssh_tunneld_tunnel_waiting", "gauge",
+            "Clients waiting for the tunnel to be ready.");
+    render_tunnels(&out, table, TUNNEL_METRIC_CPU, "ssh_tunneld_tunnel_cpu_seconds_total",
+            "counter", "CPU time used by the tunnel's ssh process.");
+    render_tunnels(&out, table, TUNNEL_METRIC_RSS, "ssh_tunneld_tunnel_rss_bytes", "gauge",
+            "Resident memory of the tunnel's ssh process.");
+    render_candidates(&out, table);
+    return out.len;
+}
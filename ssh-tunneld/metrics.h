@@ -0,0 +1,71 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_METRICS_H
+#define SSH_TUNNELD_METRICS_H
+
+#include <stddef.h>
+
+struct upstream_table;
+
+/*
+ * Counters and latency histograms, kept in one global structure. The
+ * daemon is single-threaded, so recording an event is a plain
+ * increment (plus a short bucket search for histograms): no locks,
+ * no allocation, cheap enough to leave on all the time.
+ *
+ * Histogram buckets have upper bounds of 1us, 2us, 4us, ... doubling
+ * up to 2^(METRICS_BUCKETS-1) us (about 16.8s), plus an overflow bucket.
+ */
+#define METRICS_BUCKETS 25
+
+struct histogram {
+    unsigned long long buckets[METRICS_BUCKETS + 1];
+    unsigned long long count;
+    unsigned long long sum_usec;
+};
+
+struct metrics {
+    long long started_usec;
+    unsigned long long legacy_requests[256]; /* by one-byte opcode */
+    unsigned long long framed_requests[256]; /* by frame opcode */
+    unsigned long long ssh_starts;
+    unsigned long long ssh_stops;
+    unsigned long long ssh_exits; /* not asked to stop */
+    unsigned long long ssh_respawns;
+    unsigned long long ssh_kills; /* SIGTERM ignored */
+    unsigned long long start_failures; /* ssh exited while clients waited */
+    unsigned long long start_timeouts; /* ssh not ready by the deadline */
+    struct histogram time_to_ready; /* ssh start to SOCKS5 port open */
+    struct histogram queue_wait; /* client parked on a starting tunnel */
+    unsigned long long leases;
+    unsigned long long peak_leases;
+    unsigned long long lease_expiries; /* not renewed by a heartbeat */
+    unsigned long long lane_grants; /* leases told of a fast lane */
+    unsigned long long prewarm_starts; /* see prewarm.h */
+    unsigned long long prewarm_hits; /* used by a client */
+    unsigned long long prewarm_misses; /* stopped unused */
+    unsigned long long cold_starts; /* started by a client */
+    unsigned long long linger_hits; /* lingering tunnels reused by a client */
+    unsigned long long linger_expiries; /* stopped unused after lingering */
+    unsigned long long socks_connections; /* accepted by the front-end */
+    unsigned long long socks_active;
+};
+
+extern struct metrics metrics;
+
+void metrics_init(void);
+
+void histogram_observe(struct histogram* histogram, long long usec);
+
+/*
+ * Write the metrics, and the current state and resource use of every
+ * tunnel, in the Prometheus text format. Returns the length written;
+ * if buf is too small, the output stops at the end of a whole line.
+ */
+size_t metrics_render(struct upstream_table* table, char* buf, size_t len);
+
+#endif
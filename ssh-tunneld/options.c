@@ -4,16 +4,21 @@
  * of the source distribution for further details.
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
 #define _POSIX_C_SOURCE 200112L
 
 #include "options.h"
+#include "profile.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/socket.h>
+
 char *checked_strdup(const char *s)
 {
     /* Wrap strdup() and check for NULL return value,
@@ -27,52 +32,174 @@ char *checked_strdup(const char *s)
     return duplicate;
 }
 
+static int parse_int(const char* value, const char* program_name, long minimum)
+{
+    /* Parse a decimal integer option argument no smaller than minimum */
+    char* end = NULL;
+    errno = 0;
+    long result = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || result < minimum || result > INT_MAX)
+    {
+        fprintf(stderr, "Invalid numeric argument: %s\n\n", value);
+        print_usage(program_name);
+        exit(EXIT_FAILURE);
+    }
+    return (int) result;
+}
+
+int parse_positive_int(const char* value, const char* program_name)
+{
+    return parse_int(value, program_name, 1);
+}
+
+int parse_nonnegative_int(const char* value, const char* program_name)
+{
+    return parse_int(value, program_name, 0);
+}
+
 void print_usage(const char* program_name)
 {
     fprintf(stderr,
-            "Usage:\n %s [-d port] [-f] [-l file] [-p port] [-r] [-t port] hostname\n\n",
+            "Usage:\n %s [-a] [-b backlog] [-c file] [-d port] [-e seconds] [-f] [-g file] [-i fds] [-k seconds] [-l file] [-L seconds] [-m dir] [-n count] [-o profile] [-p port] [-q] [-r] [-s path] [-t port] [-u file] [-v] [-w seconds] [-x port] [hostname ...]\n\n",
             program_name);
+    fprintf(stderr,
+            " -a\n    Grow and shrink the pool (see -n) according to ssh CPU use.\n\n");
+    fprintf(stderr,
+            " -b backlog\n    Maximum number of pending control connections.\n    Default: SOMAXCONN.\n\n");
+    fprintf(stderr,
+            " -c file\n    Keep a history of when each upstream is used in file, and start\n"
+            "    its tunnel shortly before it is usually wanted (see also \"warm\"\n"
+            "    in the -u file).\n\n");
     fprintf(stderr,
             " -d port\n    Local port for SSH SOCKS5 proxy.\n    Default: 1080.\n\n");
+    fprintf(stderr,
+            " -e seconds\n    Exit once idle (no clients, no tunnels running) for this long;\n"
+            "    for use with socket activation (see -i).\n\n");
     fprintf(stderr,
             " -f\n    Don't fork. Remain attached to terminal and log to stderr.\n\n");
+    fprintf(stderr,
+            " -g file\n    Offer ssh the ciphers timed by -q, fastest first, for the bulk\n"
+            "    profile.\n\n");
+    fprintf(stderr,
+            " -i fds\n    Use these inherited listening sockets (comma-separated descriptors)\n"
+            "    instead of opening them. Without -i, sockets passed by systemd\n"
+            "    (LISTEN_FDS) are used.\n\n");
+    fprintf(stderr,
+            " -k seconds\n    Keep the tunnel open for this long after the last client leaves.\n    Default: 0.\n\n");
     fprintf(stderr,
             " -l file\n    Append log messages to file.\n\n");
+    fprintf(stderr,
+            " -L seconds\n    Release a lease held by a client that sends heartbeats (as\n"
+            "    ssh-tunnelc does) if none comes for this long; 0 for never.\n"
+            "    Default: 60.\n\n");
+    fprintf(stderr,
+            " -m dir\n    Run each ssh process as a ControlMaster with its socket in dir,\n"
+            "    instead of as a SOCKS5 proxy; use with ssh-tunnelc -m dir.\n\n");
+    fprintf(stderr,
+            " -n count\n    Run up to count ssh processes, on consecutive proxy ports.\n    Default: 1.\n\n");
+    fprintf(stderr,
+            " -o profile\n    Run ssh with the options of a profile: bulk, interactive or\n"
+            "    lossy-link. Upstreams in the -u file may have their own.\n\n");
     fprintf(stderr, 
         " -p port\n    Remote port for SSH connection.\n    Default: 22.\n\n");
+    fprintf(stderr,
+            " -q\n    Time each cipher through ssh to hostname (localhost, if it runs\n"
+            "    sshd, to time this CPU alone), record them in the -g file and exit.\n\n");
     fprintf(stderr,
         " -r\n    Accept remote connections on control port.\n    Default: Accept only local connections.\n\n");
     fprintf(stderr,
-            " -t port\n    Local port to listen on for control connections.\n    Default: 1081.\n\n");
+            " -s path\n    Also listen for control connections on a Unix domain socket.\n\n");
+    fprintf(stderr,
+            " -t port\n    Local port to listen on for control connections, or \"none\".\n    Default: 1081.\n\n");
+    fprintf(stderr,
+            " -u file\n    Read upstream hosts and destination routes from file.\n"
+            "    hostname may then be omitted; if given, it is the upstream for\n"
+            "    destinations that match no route.\n\n");
+    fprintf(stderr,
+            " -v\n    Also log debug messages, such as each change in the number of clients.\n\n");
+    fprintf(stderr,
+            " -w seconds\n    Give up on a tunnel that is not ready this long after ssh starts,\n"
+            "    failing the clients waiting for it.\n    Default: 30.\n\n");
+    fprintf(stderr,
+            " -x port\n    Accept SOCKS5 connections on this local port, starting the tunnel\n"
+            "    on demand and relaying to it; the tunnel is leased while any is open.\n\n");
+    fprintf(stderr,
+            " hostname ...\n    SSH jump host. Given several equivalent ones, ssh-tunneld connects\n"
+            "    to them in turn, a quarter of a second apart and the fastest so far\n"
+            "    first, and uses whichever is ready first.\n\n");
 }
 
 void process_options(int argc, char** argv, struct program_options* options)
 {
     /*
      * Usage:
-     *   progname [-f] [-d port] [-l logfile] [-p port] [-r] [-t port] hostname
+     *   progname [-a] [-b backlog] [-c file] [-f] [-d port] [-e seconds] [-g file]
+     *            [-i fds] [-k seconds] [-l logfile] [-L seconds] [-m dir] [-n count]
+     *            [-o profile] [-p port] [-q] [-r]
+     *            [-s path] [-t port] [-u file] [-v] [-w seconds] [-x port] [hostname ...]
      * 
      * Options:
+     * -a
+     *  Autoscale the pool of ssh processes by their CPU use
+     * -b backlog
+     *  Listen backlog for the control port
+     * -c file
+     *  Usage history, for pre-warming tunnels (see prewarm.h)
      * -d port
      *  Local port to use for SOCKS5 proxy (ssh -D port)
+     * -e seconds
+     *  Exit after being idle this long (default: never)
      * -f
      *  Don't fork; stays attached to terminal and logs to stderr
+     * -g file
+     *  Cipher calibration, for the bulk profile (see calibrate.h)
+     * -i fds
+     *  Inherited listening sockets (see activation.h); else LISTEN_FDS
+     * -k seconds
+     *  Linger time; keep the tunnel up after the last client leaves
      * -l logfile
      *  Append log messages to the filename specified.
      *  Ignored if -f was given.
+     * -L seconds
+     *  Lease time-to-live for clients that send heartbeats (0: none)
+     * -m dir
+     *  ControlMaster mode: ssh -M -S dir/ssh-tunneld-<port> instead of -D
+     * -n count
+     *  Size of the pool of ssh processes; member i uses proxy port + i
+     * -o profile
+     *  ssh options for the kind of traffic (see profile.h)
      * -p port
      *  Remote port for ssh -D
+     * -q
+     *  Calibrate: time ssh's ciphers to hostname, write the -g file, exit
      * -r
      *  Accept remote connections on the control port
      *  Default: Accept only local connections
+     * -s path
+     *  Unix domain socket to use for control connections
      * -t port
-     *  Local port to use for control connections
+     *  Local port to use for control connections ("none": no TCP)
+     * -u file
+     *  Upstream hosts and routes (see upstream.h for the syntax)
+     * -v
+     *  Verbose; log debug messages too
+     * -w seconds
+     *  Startup deadline; waiting clients get an error reply after it
+     * -x port
+     *  SOCKS5 front-end: relay to the tunnels, holding a lease per connection
      *
-     * hostname must be specified. Default options as follows:
+     * hostname must be specified unless -u is given; several are raced
+     * (see race.h). Default options as follows:
      *  proxy port : 1080
      *  logfile : none
      *  tunneld port : 1081
      *  remote port : 22
+     *  listen backlog : SOMAXCONN
+     *  linger time : 0 (stop the tunnel immediately)
+     *  pool size : 1
+     *  idle exit : never
+     *  startup deadline : 30 seconds
+     *  lease time-to-live : 60 seconds
      *
      * The default behaviour is to fork and detach from the
      * controlling terminal. Only the first occurrence of an
@@ -81,6 +208,14 @@ void process_options(int argc, char** argv, struct program_options* options)
     int opt;
     
     /* Set defaults */
+    options->listen_backlog = 0;
+    options->inherited_fds = NULL;
+    options->idle_exit_seconds = -1;
+    options->startup_timeout_seconds = 0;
+    options->lease_ttl_seconds = -1;
+    options->linger_seconds = -1;
+    options->pool_size = 0;
+    options->pool_autoscale = 0;
     options->nofork = 0; 
     options->accept_remote = 0; 
     options->proxy_port = NULL;
@@ -88,46 +223,162 @@ void process_options(int argc, char** argv, struct program_options* options)
     options->remote_port = NULL;
     options->tunnel_port = NULL;
     options->remote_host = NULL;
+    options->remote_hosts = NULL;
+    options->n_remote_hosts = 0;
+    options->routes_filename = NULL;
+    options->history_filename = NULL;
+    options->profile = NULL;
+    options->calibration_filename = NULL;
+    options->calibrate = 0;
+    options->control_socket = NULL;
+    options->master_dir = NULL;
+    options->socks_port = NULL;
+    options->verbose = 0;
 
-    while ((opt = getopt(argc, argv, "d:fl:p:rt:")) != -1)
+    while ((opt = getopt(argc, argv, "ab:c:d:e:fg:i:k:l:L:m:n:o:p:qrs:t:u:vw:x:")) != -1)
     {
         switch(opt)
         {
+            case 'a': /* autoscale pool */
+                options->pool_autoscale = 1;
+                break;
+            case 'b': /* listen backlog */
+                if (options->listen_backlog == 0)
+                    options->listen_backlog = parse_positive_int(optarg, argv[0]);
+                break;
+            case 'c': /* usage history */
+                if (options->history_filename == NULL)
+                    options->history_filename = optarg;
+                break;
             case 'd': /* local proxy port */
                 if (options->proxy_port == NULL)
                     options->proxy_port = optarg;
                 break;
+            case 'e': /* idle exit time */
+                if (options->idle_exit_seconds == -1)
+                    options->idle_exit_seconds = parse_positive_int(optarg, argv[0]);
+                break;
             case 'f': /* nofork */
                 options->nofork = 1;
                 break;
+            case 'g': /* cipher calibration */
+                if (options->calibration_filename == NULL)
+                    options->calibration_filename = optarg;
+                break;
+            case 'i': /* inherited listening sockets */
+                if (options->inherited_fds == NULL)
+                    options->inherited_fds = optarg;
+                break;
+            case 'k': /* linger time */
+                if (options->linger_seconds == -1)
+                    options->linger_seconds = parse_nonnegative_int(optarg, argv[0]);
+                break;
             case 'l': /* log filename */
                 if (options->log_filename == NULL)
                     options->log_filename = optarg;
                 break;
+            case 'L': /* lease time-to-live */
+                if (options->lease_ttl_seconds == -1)
+                    options->lease_ttl_seconds = parse_nonnegative_int(optarg, argv[0]);
+                break;
+            case 'm': /* ControlMaster socket directory */
+                if (options->master_dir == NULL)
+                    options->master_dir = optarg;
+                break;
+            case 'n': /* pool size */
+                if (options->pool_size == 0)
+                    options->pool_size = parse_positive_int(optarg, argv[0]);
+                break;
+            case 'o': /* ssh options profile */
+                if (options->profile == NULL)
+                {
+                    options->profile = profile_find(optarg);
+                    if (options->profile == NULL)
+                    {
+                        fprintf(stderr, "Unknown profile: %s\n\n", optarg);
+                        print_usage(argv[0]);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                break;
             case 'p': /* remote port */
                 if (options->remote_port == NULL)
                     options->remote_port = optarg;
                 break;
+            case 'q': /* calibrate ciphers */
+                options->calibrate = 1;
+                break;
             case 'r':
                 options->accept_remote = 1;
                 break;
+            case 's': /* control socket path */
+                if (options->control_socket == NULL)
+                    options->control_socket = optarg;
+                break;
             case 't': /* tunneld port */
                 if (options->tunnel_port == NULL)
                     options->tunnel_port = optarg;
                 break;
+            case 'u': /* upstreams and routes */
+                if (options->routes_filename == NULL)
+                    options->routes_filename = optarg;
+                break;
+            case 'v': /* log debug messages */
+                options->verbose = 1;
+                break;
+            case 'w': /* startup deadline */
+                if (options->startup_timeout_seconds == 0)
+                    options->startup_timeout_seconds = parse_positive_int(optarg, argv[0]);
+                break;
+            case 'x': /* SOCKS5 front-end port */
+                if (options->socks_port == NULL)
+                    options->socks_port = optarg;
+                break;
             default:
                 print_usage(argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
-    if (optind + 1 > argc)
+    if (optind + 1 > argc && options->routes_filename == NULL)
     {
         print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    options->remote_host = argv[optind];
+    if (optind < argc)
+    {
+        options->remote_host = argv[optind];
+        options->remote_hosts = argv + optind;
+        options->n_remote_hosts = argc - optind;
+    }
+
+    /* We chdir("/") on becoming a daemon */
+    if (options->control_socket != NULL && options->control_socket[0] != '/')
+    {
+        fprintf(stderr, "Control socket path must be absolute.\n\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (options->master_dir != NULL && options->master_dir[0] != '/')
+    {
+        fprintf(stderr, "ControlMaster socket directory must be absolute.\n\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (options->calibrate && (options->calibration_filename == NULL
+                || options->remote_host == NULL))
+    {
+        fprintf(stderr, "Calibration (-q) needs a -g file and a hostname.\n\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (options->master_dir != NULL && options->socks_port != NULL)
+    {
+        fprintf(stderr, "A SOCKS5 port needs SOCKS5 tunnels; -x cannot be used with -m.\n\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
 
     /* Set default values */
     if (options->proxy_port == NULL)
@@ -145,5 +396,29 @@ void process_options(int argc, char** argv, struct program_options* options)
         char* default_tun_port = "1081";
         options->tunnel_port = checked_strdup(default_tun_port);
     }
+    if (options->listen_backlog == 0)
+    {
+        options->listen_backlog = SOMAXCONN;
+    }
+    if (options->linger_seconds == -1)
+    {
+        options->linger_seconds = 0;
+    }
+    if (options->idle_exit_seconds == -1)
+    {
+        options->idle_exit_seconds = 0;
+    }
+    if (options->startup_timeout_seconds == 0)
+    {
+        options->startup_timeout_seconds = 30;
+    }
+    if (options->lease_ttl_seconds == -1)
+    {
+        options->lease_ttl_seconds = 60;
+    }
+    if (options->pool_size == 0)
+    {
+        options->pool_size = 1;
+    }
 }
 
@@ -7,17 +7,47 @@
 #ifndef SSH_TUNNELD_OPTIONS_H
 #define SSH_TUNNELD_OPTIONS_H
 
+char *checked_strdup(const char *s);
 void print_usage(const char* program_name);
+int parse_positive_int(const char* value, const char* program_name);
+int parse_nonnegative_int(const char* value, const char* program_name);
+
+struct profile;
 
 struct program_options {
     /* Remote details */
     char* remote_host;
+    char** remote_hosts; /* remote_host and any others to race it */
+    int n_remote_hosts;
     char* remote_port;
     /* Local details */
     char* proxy_port;
-    char* tunnel_port;
+    char* tunnel_port; /* "none" to disable */
+    char* control_socket;
+    char* master_dir; /* ControlMaster sockets instead of SOCKS5; or NULL */
+    char* socks_port; /* SOCKS5 front-end, or NULL */
+    /* Tunnel lifetime */
+    int linger_seconds;
+    int startup_timeout_seconds; /* fail waiting clients after this */
+    int lease_ttl_seconds; /* for clients that heartbeat; 0: never expire */
+    int pool_size;
+    int pool_autoscale;
+    /* Control socket */
+    int listen_backlog;
+    /* Socket activation */
+    char* inherited_fds; /* comma-separated listening descriptors, or NULL */
+    int idle_exit_seconds; /* 0: never exit when idle */
+    /* Upstreams and routes file */
+    char* routes_filename;
+    /* Usage history for pre-warming, or NULL */
+    char* history_filename;
+    /* ssh options (see profile.h), or NULL; and cipher calibration */
+    const struct profile* profile;
+    char* calibration_filename;
+    int calibrate; /* time the ciphers and exit */
     /* Logging */
     char* log_filename;
+    int verbose;
     /* Option switches */
     int nofork;
     int accept_remote;
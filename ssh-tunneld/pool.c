@@ -0,0 +1,137 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "pool.h"
+#include "logging.h"
+#include "proc.h"
+#include "upstream.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void on_sample(struct timer* timer, void* data);
+
+void pool_init(struct pool* pool, struct program_options* options,
+        struct upstream* upstream)
+{
+    memset(pool, 0, sizeof(struct pool));
+    pool->size = (unsigned int) upstream->pool_size;
+    pool->autoscale = options->pool_autoscale;
+    pool->active = pool->autoscale ? 1 : pool->size;
+
+    /* The port range has been validated by upstreams_start() */
+    long base_port = strtol(upstream->proxy_port, NULL, 10);
+
+    pool->members = calloc(pool->size, sizeof(struct tunnel));
+    if (pool->members == NULL)
+    {
+        write_log_error("Unable to allocate memory. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = 0; i < pool->size; ++i)
+        tunnel_init(&pool->members[i], options, upstream, (unsigned int) base_port + i);
+
+    if (pool->autoscale && pool->size > 1)
+    {
+        pool->clock_ticks = sysconf(_SC_CLK_TCK);
+        if (pool->clock_ticks <= 0)
+            pool->clock_ticks = 100;
+        timer_start(&pool->sample_timer, POOL_SAMPLE_INTERVAL_MS, on_sample, pool);
+    }
+}
+
+static unsigned int load_of(const struct tunnel* tunnel)
+{
+    return tunnel->n_connected + tunnel->n_waiting;
+}
+
+static int is_running(const struct tunnel* tunnel)
+{
+    return tunnel->state != TUNNEL_STOPPED;
+}
+
+struct tunnel* pool_pick(struct pool* pool)
+{
+    /* Least loaded active member; on a tie, prefer one that is
+     * already running to avoid a needless cold start.
+     */
+    struct tunnel* best = &pool->members[0];
+    for (unsigned int i = 1; i < pool->active; ++i)
+    {
+        struct tunnel* candidate = &pool->members[i];
+        if (load_of(candidate) < load_of(best)
+                || (load_of(candidate) == load_of(best)
+                    && is_running(candidate) && ! is_running(best)))
+        {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+struct tunnel* pool_find(struct pool* pool, unsigned int port)
+{
+    unsigned int base = pool->members[0].port;
+    if (port < base || port - base >= pool->size)
+        return NULL;
+    return &pool->members[port - base];
+}
+
+static void on_sample(struct timer* timer, void* data)
+{
+    struct pool* pool = data;
+    double total_load = 0.0;
+    unsigned int n_busy = 0;
+    double interval_ticks = (double) pool->clock_ticks * POOL_SAMPLE_INTERVAL_MS / 1000.0;
+
+    for (unsigned int i = 0; i < pool->size; ++i)
+    {
+        struct tunnel* member = &pool->members[i];
+        unsigned long ticks = 0;
+        if (member->state == TUNNEL_STOPPED || member->ssh_process <= 0
+                || proc_cpu_ticks(member->ssh_process, &ticks) != 0)
+        {
+            member->cpu_load = 0.0;
+            continue;
+        }
+        /* The first sample after a start only sets the baseline */
+        if (member->cpu_ticks != 0 && ticks >= member->cpu_ticks)
+            member->cpu_load = (double) (ticks - member->cpu_ticks) / interval_ticks;
+        member->cpu_ticks = ticks;
+        if (member->n_connected > 0)
+        {
+            total_load += member->cpu_load;
+            n_busy += 1;
+        }
+    }
+
+    if (n_busy > 0)
+    {
+        double mean_load = total_load / n_busy;
+        if (mean_load > POOL_GROW_LOAD && pool->active < pool->size)
+        {
+            pool->active += 1;
+            write_logf("ssh CPU use %.0f%%; growing pool to %u.",
+                    mean_load * 100.0, pool->active);
+        }
+        else if (mean_load < POOL_SHRINK_LOAD && pool->active > 1)
+        {
+            pool->active -= 1;
+            write_logf("ssh CPU use %.0f%%; shrinking pool to %u.",
+                    mean_load * 100.0, pool->active);
+        }
+    }
+    else if (pool->active > 1)
+    {
+        pool->active -= 1;
+        write_logf("Pool idle; shrinking pool to %u.", pool->active);
+    }
+
+    timer_start(timer, POOL_SAMPLE_INTERVAL_MS, on_sample, pool);
+}
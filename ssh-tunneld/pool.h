@@ -0,0 +1,50 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_POOL_H
+#define SSH_TUNNELD_POOL_H
+
+#include "event.h"
+#include "options.h"
+#include "tunnel.h"
+
+struct upstream;
+
+/*
+ * A pool of "ssh -D" tunnels to the same upstream host, on consecutive
+ * proxy ports starting at the upstream's configured one. Each member starts, lingers
+ * and stops independently; new clients are given the least-loaded
+ * member, so bulk transfers are spread over several ssh processes
+ * (and CPU cores) instead of sharing one.
+ *
+ * With autoscaling, only the first "active" members take new clients.
+ * The pool grows while the busy ssh processes are CPU bound and
+ * shrinks again when they are mostly idle; members outside the active
+ * set keep their existing clients until those leave.
+ */
+#define POOL_SAMPLE_INTERVAL_MS 2000
+#define POOL_GROW_LOAD 0.6   /* mean CPU use of busy members */
+#define POOL_SHRINK_LOAD 0.2
+
+struct pool {
+    struct tunnel* members;
+    unsigned int size;
+    unsigned int active;
+    int autoscale;
+    long clock_ticks; /* sysconf(_SC_CLK_TCK) */
+    struct timer sample_timer;
+};
+
+void pool_init(struct pool* pool, struct program_options* options,
+        struct upstream* upstream);
+
+/* The member that should serve the next client */
+struct tunnel* pool_pick(struct pool* pool);
+
+/* The member whose proxy port is port, or NULL */
+struct tunnel* pool_find(struct pool* pool, unsigned int port);
+
+#endif
@@ -0,0 +1,320 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "prewarm.h"
+#include "event.h"
+#include "logging.h"
+#include "upstream.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PREWARM_HISTORY_VERSION 1
+
+static struct upstream_table* upstreams = NULL;
+static char* history_path = NULL; /* absolute; NULL without -c */
+static struct timer clock_timer;
+static int current_slot = -1; /* the slot now being recorded */
+static int ahead_slot = -1; /* the slot PREWARM_LEAD_MINUTES from now */
+
+static void on_clock(struct timer* timer, void* data);
+
+/* Parse one crontab(5) field into a bit per value it matches */
+static int parse_field(const char* text, long minimum, long maximum, unsigned long long* bits)
+{
+    *bits = 0;
+    const char* p = text;
+    for (;;)
+    {
+        long first = minimum;
+        long last = maximum;
+        long step = 1;
+        char* end = (char*) p;
+        if (*p == '*')
+        {
+            end += 1;
+        }
+        else
+        {
+            first = strtol(p, &end, 10);
+            if (end == p)
+                return -1;
+            last = *end == '/' ? maximum : first; /* "n/step" is "n-max/step" */
+            if (*end == '-')
+            {
+                p = end + 1;
+                last = strtol(p, &end, 10);
+                if (end == p)
+                    return -1;
+            }
+        }
+        if (*end == '/')
+        {
+            p = end + 1;
+            step = strtol(p, &end, 10);
+            if (end == p || step <= 0)
+                return -1;
+        }
+        if (first < minimum || last > maximum || first > last)
+            return -1;
+        for (long value = first; value <= last; value += step)
+            *bits |= 1ULL << value;
+        if (*end == '\0')
+            return 0;
+        if (*end != ',')
+            return -1;
+        p = end + 1;
+    }
+}
+
+int prewarm_add_schedule(struct prewarm* prewarm, const char* minute,
+        const char* hour, const char* weekday)
+{
+    unsigned long long minutes, hours, weekdays;
+    if (minute == NULL || hour == NULL || weekday == NULL
+            || parse_field(minute, 0, 59, &minutes) != 0
+            || parse_field(hour, 0, 23, &hours) != 0
+            || parse_field(weekday, 0, 7, &weekdays) != 0)
+        return -1;
+    if (weekdays & (1ULL << 7))
+        weekdays |= 1; /* 7 is Sunday too */
+
+    struct prewarm_schedule* schedule = calloc(1, sizeof(struct prewarm_schedule));
+    if (schedule == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+    schedule->minutes = minutes;
+    schedule->hours = (unsigned long) hours;
+    schedule->weekdays = (unsigned int) weekdays;
+    schedule->next = prewarm->schedules;
+    prewarm->schedules = schedule;
+    return 0;
+}
+
+static int slot_of(const struct tm* tm)
+{
+    int slot = (tm->tm_hour * 60 + tm->tm_min) / PREWARM_SLOT_MINUTES;
+    if (tm->tm_wday == 0 || tm->tm_wday == 6)
+        slot += PREWARM_SLOTS_PER_DAY;
+    return slot;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Returns -1 if the file is damaged */
+static int read_history(struct upstream_table* table, FILE* file)
+{
+    char line[2 * PREWARM_SLOTS + 256];
+    const char* separators = " \t\r\n";
+    int version = 0;
+    if (fgets(line, sizeof(line), file) == NULL
+            || sscanf(line, "ssh-tunneld-history %d", &version) != 1
+            || version != PREWARM_HISTORY_VERSION)
+        return -1;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char* name = strtok(line, separators);
+        char* scores = strtok(NULL, separators);
+        if (name == NULL)
+            continue;
+        if (scores == NULL || strlen(scores) != 2 * PREWARM_SLOTS)
+            return -1;
+        struct upstream* upstream = upstreams_find_name(table, name);
+        for (int i = 0; i < PREWARM_SLOTS; ++i)
+        {
+            int high = hex_digit(scores[2 * i]);
+            int low = hex_digit(scores[2 * i + 1]);
+            if (high < 0 || low < 0)
+                return -1;
+            /* upstreams no longer configured are forgotten */
+            if (upstream != NULL)
+                upstream->prewarm.scores[i] = (unsigned char) (high * 16 + low);
+        }
+    }
+    return 0;
+}
+
+void prewarm_load(struct upstream_table* table, const char* filename)
+{
+    /* Keep an absolute path, since a daemon runs in "/" */
+    if (filename[0] == '/')
+    {
+        history_path = checked_strdup(filename);
+    }
+    else
+    {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd)) == NULL)
+        {
+            perror(filename);
+            exit(EXIT_FAILURE);
+        }
+        history_path = malloc(strlen(cwd) + strlen(filename) + 2);
+        if (history_path == NULL)
+        {
+            fprintf(stderr, "Unable to allocate memory. Exiting.\n");
+            exit(EXIT_FAILURE);
+        }
+        sprintf(history_path, "%s/%s", cwd, filename);
+    }
+
+    FILE* file = fopen(history_path, "r");
+    if (file == NULL)
+    {
+        if (errno != ENOENT)
+            perror(filename);
+        return;
+    }
+    if (read_history(table, file) != 0)
+    {
+        fprintf(stderr, "%s: Damaged usage history; starting afresh.\n", filename);
+        for (size_t i = 0; i < table->n_upstreams; ++i)
+            memset(table->upstreams[i]->prewarm.scores, 0, PREWARM_SLOTS);
+    }
+    fclose(file);
+}
+
+static void save_history(void)
+{
+    size_t len = strlen(history_path);
+    char* temporary = malloc(len + 5);
+    if (temporary == NULL)
+        return;
+    sprintf(temporary, "%s.tmp", history_path);
+
+    FILE* file = fopen(temporary, "w");
+    int failed = file == NULL;
+    if (file != NULL)
+    {
+        fprintf(file, "ssh-tunneld-history %d\n", PREWARM_HISTORY_VERSION);
+        for (size_t i = 0; i < upstreams->n_upstreams; ++i)
+        {
+            struct upstream* upstream = upstreams->upstreams[i];
+            fprintf(file, "%s ", upstream->name);
+            for (int j = 0; j < PREWARM_SLOTS; ++j)
+                fprintf(file, "%02x", upstream->prewarm.scores[j]);
+            fputc('\n', file);
+        }
+        failed = ferror(file);
+        failed |= fclose(file) != 0;
+    }
+    /* Replace the old history only with a complete new one */
+    if (failed || rename(temporary, history_path) != 0)
+    {
+        write_log_warn("Could not write usage history to %s.", history_path);
+        unlink(temporary);
+    }
+    free(temporary);
+}
+
+/* Score the slot that has just ended */
+static void close_slot(int slot)
+{
+    for (size_t i = 0; i < upstreams->n_upstreams; ++i)
+    {
+        struct upstream* upstream = upstreams->upstreams[i];
+        struct pool* pool = &upstream->pool;
+        int used = upstream->prewarm.wanted;
+        for (unsigned int j = 0; j < pool->size && ! used; ++j)
+            used = pool->members[j].n_connected > 0;
+        unsigned int score = upstream->prewarm.scores[slot];
+        score -= score / 4;
+        if (used)
+            score += PREWARM_USED_SCORE;
+        upstream->prewarm.scores[slot] = (unsigned char) (score > 255 ? 255 : score);
+        upstream->prewarm.wanted = 0;
+    }
+}
+
+static void warm(struct upstream* upstream, const char* reason)
+{
+    struct pool* pool = &upstream->pool;
+    struct tunnel* tunnel = &pool->members[0];
+    if (! tunnel->prewarmed)
+    {
+        /* running already, for clients */
+        for (unsigned int i = 0; i < pool->size; ++i)
+        {
+            if (pool->members[i].state != TUNNEL_STOPPED)
+                return;
+        }
+    }
+    if (tunnel_prewarm(tunnel, PREWARM_HOLD_MINUTES * 60 * 1000LL))
+        write_logf("Pre-warming tunnel to %s on port %s (%s).",
+                upstream->name, tunnel->proxy_port, reason);
+}
+
+static int schedule_matches(const struct prewarm_schedule* schedule, const struct tm* tm)
+{
+    return (schedule->minutes & (1ULL << tm->tm_min))
+        && (schedule->hours & (1UL << tm->tm_hour))
+        && (schedule->weekdays & (1U << tm->tm_wday));
+}
+
+static void on_clock(struct timer* timer, void* data)
+{
+    (void) data;
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int slot = slot_of(&tm);
+    if (history_path != NULL && current_slot != -1 && slot != current_slot)
+    {
+        close_slot(current_slot);
+        save_history();
+    }
+    current_slot = slot;
+
+    /* Look ahead, so that the tunnel is ready when wanted */
+    time_t ahead = now + PREWARM_LEAD_MINUTES * 60;
+    localtime_r(&ahead, &tm);
+    slot = slot_of(&tm);
+    for (size_t i = 0; i < upstreams->n_upstreams; ++i)
+    {
+        struct upstream* upstream = upstreams->upstreams[i];
+        if (history_path != NULL && slot != ahead_slot
+                && upstream->prewarm.scores[slot] >= PREWARM_THRESHOLD)
+            warm(upstream, "usage history");
+        for (struct prewarm_schedule* schedule = upstream->prewarm.schedules;
+                schedule != NULL; schedule = schedule->next)
+        {
+            if (schedule_matches(schedule, &tm))
+                warm(upstream, "schedule");
+        }
+    }
+    ahead_slot = slot;
+
+    /* Next at the start of the next minute */
+    timer_start(timer, (60 - now % 60) * 1000LL, on_clock, NULL);
+}
+
+void prewarm_start(struct upstream_table* table)
+{
+    int scheduled = 0;
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+        scheduled |= table->upstreams[i]->prewarm.schedules != NULL;
+    if (history_path == NULL && ! scheduled)
+        return;
+    upstreams = table;
+    on_clock(&clock_timer, NULL);
+}
@@ -0,0 +1,76 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_PREWARM_H
+#define SSH_TUNNELD_PREWARM_H
+
+struct upstream_table;
+
+/*
+ * Pre-warming: starting an upstream's tunnel shortly before clients
+ * are expected, so that the first of them does not wait for ssh.
+ *
+ * With -c, ssh-tunneld keeps a history of when each upstream is used,
+ * as a score per PREWARM_SLOT_MINUTES of the day, kept separately for
+ * weekdays and weekends. At the end of each slot the score decays by
+ * a quarter, and gains PREWARM_USED_SCORE if a lease was requested or
+ * held during it; so a slot used on two days running reaches
+ * PREWARM_THRESHOLD, and one no longer used falls below it again
+ * within a few days. PREWARM_LEAD_MINUTES before a slot whose score is
+ * over the threshold begins, its upstream is started. The history is
+ * rewritten at the end of each slot:
+ *
+ *   ssh-tunneld-history 1
+ *   <upstream> <PREWARM_SLOTS scores, two hex digits each>
+ *
+ * "warm" lines in the -u file add fixed times, as the first three
+ * fields of a crontab(5) entry: the upstream is started
+ * PREWARM_LEAD_MINUTES before each minute they match.
+ *
+ * Either way, a tunnel nobody uses is stopped again
+ * PREWARM_HOLD_MINUTES after it was (last) asked for.
+ */
+#define PREWARM_SLOT_MINUTES 15
+#define PREWARM_SLOTS_PER_DAY (24 * 60 / PREWARM_SLOT_MINUTES)
+#define PREWARM_SLOTS (2 * PREWARM_SLOTS_PER_DAY) /* weekdays, then weekends */
+#define PREWARM_LEAD_MINUTES 2
+#define PREWARM_HOLD_MINUTES (PREWARM_SLOT_MINUTES + PREWARM_LEAD_MINUTES)
+#define PREWARM_USED_SCORE 64
+#define PREWARM_THRESHOLD 100
+
+struct prewarm_schedule {
+    unsigned long long minutes; /* bit n: minute n matches */
+    unsigned long hours;
+    unsigned int weekdays; /* bit 0: Sunday */
+    struct prewarm_schedule* next;
+};
+
+/* Each upstream's history and schedules */
+struct prewarm {
+    unsigned char scores[PREWARM_SLOTS];
+    int wanted; /* a lease was requested in the current slot */
+    struct prewarm_schedule* schedules;
+};
+
+/* Add a schedule from its crontab(5) minute, hour and day-of-week
+ * fields (numbers, ranges, lists, steps and "*"). Returns -1 if they
+ * are invalid.
+ */
+int prewarm_add_schedule(struct prewarm* prewarm, const char* minute,
+        const char* hour, const char* weekday);
+
+/* Read the usage history from filename, which is written to from then
+ * on. A missing file is not an error; an unreadable or damaged one is
+ * reported on stderr, and the history starts afresh.
+ */
+void prewarm_load(struct upstream_table* table, const char* filename);
+
+/* Start watching the clock, once the upstreams have been started; does
+ * nothing if there is neither a history file nor a schedule.
+ */
+void prewarm_start(struct upstream_table* table);
+
+#endif
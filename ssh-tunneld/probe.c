@@ -0,0 +1,154 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "probe.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netdb.h>
+#include <sys/un.h>
+
+static void on_timer(struct timer* timer, void* data);
+
+int probe_init(struct probe* probe, const char* host, const char* port)
+{
+    struct addrinfo hints;
+    struct addrinfo* result = NULL;
+
+    memset(probe, 0, sizeof(struct probe));
+    probe->fd = -1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &result) != 0 || result == NULL)
+        return -1;
+    if (result->ai_addrlen > sizeof(probe->addr))
+    {
+        freeaddrinfo(result);
+        return -1;
+    }
+    memcpy(&probe->addr, result->ai_addr, result->ai_addrlen);
+    probe->addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+int probe_init_local(struct probe* probe, const char* path)
+{
+    struct sockaddr_un address;
+
+    memset(probe, 0, sizeof(struct probe));
+    probe->fd = -1;
+
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+        return -1;
+    strcpy(address.sun_path, path);
+    memcpy(&probe->addr, &address, sizeof(struct sockaddr_un));
+    probe->addrlen = sizeof(struct sockaddr_un);
+    return 0;
+}
+
+static void close_attempt(struct probe* probe)
+{
+    if (probe->fd != -1)
+    {
+        event_remove(probe->fd);
+        close(probe->fd);
+        probe->fd = -1;
+    }
+}
+
+static void succeed(struct probe* probe)
+{
+    close_attempt(probe);
+    timer_stop(&probe->timer);
+    probe->elapsed_usec = event_now_usec() - probe->started_usec;
+    probe->ready(probe, probe->data);
+}
+
+static void back_off(struct probe* probe)
+{
+    close_attempt(probe);
+    timer_start(&probe->timer, probe->interval_ms, on_timer, probe);
+    probe->interval_ms += probe->interval_ms / 2;
+    if (probe->interval_ms > PROBE_MAX_INTERVAL_MS)
+        probe->interval_ms = PROBE_MAX_INTERVAL_MS;
+}
+
+static void on_connect(int fd, short revents, void* data)
+{
+    struct probe* probe = data;
+    int error = 0;
+    socklen_t len = sizeof(error);
+    (void) revents;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0)
+        succeed(probe);
+    else
+        back_off(probe);
+}
+
+static void attempt(struct probe* probe)
+{
+    probe->attempts += 1;
+    probe->fd = socket(probe->addr.ss_family, SOCK_STREAM, 0);
+    if (probe->fd == -1 || set_nonblocking(probe->fd) == -1 || set_cloexec(probe->fd) == -1)
+    {
+        write_log_warn("Could not create probe socket. Retrying.");
+        back_off(probe);
+        return;
+    }
+
+    if (connect(probe->fd, (struct sockaddr*) &probe->addr, probe->addrlen) == 0)
+    {
+        succeed(probe);
+    }
+    else if (errno == EINPROGRESS)
+    {
+        /* Completion (or refusal) is reported as writability */
+        if (event_add(probe->fd, POLLOUT, on_connect, probe) == -1)
+            back_off(probe);
+    }
+    else
+    {
+        back_off(probe); /* typically ECONNREFUSED or ENOENT: ssh not listening yet */
+    }
+}
+
+static void on_timer(struct timer* timer, void* data)
+{
+    (void) timer;
+    attempt(data);
+}
+
+void probe_start(struct probe* probe, probe_callback ready, void* data)
+{
+    probe_stop(probe);
+    probe->ready = ready;
+    probe->data = data;
+    probe->attempts = 0;
+    probe->interval_ms = PROBE_MIN_INTERVAL_MS;
+    probe->started_usec = event_now_usec();
+    /* ssh cannot be listening the instant it is forked, so wait
+     * one interval before the first attempt.
+     */
+    back_off(probe);
+}
+
+void probe_stop(struct probe* probe)
+{
+    close_attempt(probe);
+    timer_stop(&probe->timer);
+}
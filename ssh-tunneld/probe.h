@@ -0,0 +1,52 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_PROBE_H
+#define SSH_TUNNELD_PROBE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "event.h"
+
+/*
+ * Readiness probe for the SOCKS5 port (or ControlMaster socket) of a
+ * starting ssh process.
+ * The address is resolved once, then non-blocking connects are
+ * attempted with exponential backoff (10ms, 15ms, 22ms, ... capped
+ * at PROBE_MAX_INTERVAL_MS) until one succeeds, so a tunnel is seen
+ * to be ready at most PROBE_MAX_INTERVAL_MS after ssh starts listening.
+ */
+#define PROBE_MIN_INTERVAL_MS 10
+#define PROBE_MAX_INTERVAL_MS 100
+
+struct probe;
+typedef void (*probe_callback)(struct probe* probe, void* data);
+
+struct probe {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int fd; /* in-flight connect, or -1 */
+    long long interval_ms;
+    long long started_usec;
+    long long elapsed_usec; /* time-to-ready of the last successful probe */
+    unsigned int attempts;
+    struct timer timer;
+    probe_callback ready;
+    void* data;
+};
+
+/* Resolve host:port once; returns -1 if the address is unusable */
+int probe_init(struct probe* probe, const char* host, const char* port);
+
+/* Probe the Unix domain socket at path instead; -1 if path is too long */
+int probe_init_local(struct probe* probe, const char* path);
+
+/* Begin probing; ready is called once the port accepts a connection */
+void probe_start(struct probe* probe, probe_callback ready, void* data);
+void probe_stop(struct probe* probe);
+
+#endif
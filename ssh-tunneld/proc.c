@@ -0,0 +1,64 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "proc.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static int read_proc_file(pid_t pid, const char* name, char* buf, size_t len)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%ld/%s", (long) pid, name);
+    FILE* proc_file = fopen(path, "r");
+    if (proc_file == NULL)
+        return -1;
+    size_t n = fread(buf, 1, len - 1, proc_file);
+    fclose(proc_file);
+    buf[n] = '\0';
+    return 0;
+}
+
+int proc_cpu_ticks(pid_t pid, unsigned long* ticks)
+{
+    /* utime and stime are fields 14 and 15 of /proc/<pid>/stat;
+     * the command name (field 2) may contain spaces, so start
+     * counting after its closing parenthesis.
+     */
+    char line[1024];
+    if (read_proc_file(pid, "stat", line, sizeof(line)) != 0)
+        return -1;
+
+    char* fields = strrchr(line, ')');
+    unsigned long utime = 0;
+    unsigned long stime = 0;
+    if (fields == NULL
+            || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &utime, &stime) != 2)
+    {
+        return -1;
+    }
+    *ticks = utime + stime;
+    return 0;
+}
+
+int proc_rss_bytes(pid_t pid, unsigned long* bytes)
+{
+    /* The second field of /proc/<pid>/statm is the RSS in pages */
+    char line[256];
+    unsigned long pages = 0;
+    if (read_proc_file(pid, "statm", line, sizeof(line)) != 0
+            || sscanf(line, "%*u %lu", &pages) != 1)
+    {
+        return -1;
+    }
+    long page_size = sysconf(_SC_PAGESIZE);
+    *bytes = pages * (unsigned long) (page_size > 0 ? page_size : 4096);
+    return 0;
+}
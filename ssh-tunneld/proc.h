@@ -0,0 +1,23 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_PROC_H
+#define SSH_TUNNELD_PROC_H
+
+#include <sys/types.h>
+
+/*
+ * Resource use of a child process, read from /proc. Both return -1
+ * where there is no /proc (or the process has gone).
+ */
+
+/* User plus system CPU time, in clock ticks */
+int proc_cpu_ticks(pid_t pid, unsigned long* ticks);
+
+/* Resident set size, in bytes */
+int proc_rss_bytes(pid_t pid, unsigned long* bytes);
+
+#endif
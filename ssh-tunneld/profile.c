@@ -0,0 +1,104 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "profile.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* AES-GCM first, as most CPUs have instructions for it, then the rest
+ * of what OpenSSH offers by default, so that any server will do
+ */
+static const char* default_ciphers[] = {
+    "aes128-gcm@openssh.com",
+    "aes256-gcm@openssh.com",
+    "chacha20-poly1305@openssh.com",
+    "aes128-ctr",
+    "aes192-ctr",
+    "aes256-ctr",
+    NULL
+};
+
+static char bulk_ciphers[512] = "Ciphers=aes128-gcm@openssh.com,aes256-gcm@openssh.com,"
+    "chacha20-poly1305@openssh.com,aes128-ctr,aes192-ctr,aes256-ctr";
+
+static const struct profile profiles[] = {
+    { "bulk", {
+        bulk_ciphers,
+        "Compression=no",
+        "IPQoS=throughput",
+        "ServerAliveInterval=60",
+        NULL
+    } },
+    { "interactive", {
+        "Compression=no",
+        "IPQoS=lowdelay",
+        "ServerAliveInterval=15",
+        "ServerAliveCountMax=3",
+        NULL
+    } },
+    { "lossy-link", {
+        "Compression=yes",
+        "ServerAliveInterval=30",
+        "ServerAliveCountMax=8",
+        "TCPKeepAlive=no",
+        NULL
+    } },
+    { NULL, { NULL } }
+};
+
+const struct profile* profile_find(const char* name)
+{
+    for (const struct profile* profile = profiles; profile->name != NULL; ++profile)
+    {
+        if (strcmp(profile->name, name) == 0)
+            return profile;
+    }
+    return NULL;
+}
+
+/* Is cipher one of the comma-separated list? */
+static int listed(const char* list, const char* cipher)
+{
+    size_t len = strlen(cipher);
+    const char* p = list;
+    while (p != NULL)
+    {
+        if (strncmp(p, cipher, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+            return 1;
+        p = strchr(p, ',');
+        if (p != NULL)
+            p += 1;
+    }
+    return 0;
+}
+
+void profile_rank_ciphers(const char* ciphers)
+{
+    int n = snprintf(bulk_ciphers, sizeof(bulk_ciphers), "Ciphers=%s", ciphers);
+    size_t len = n > 0 ? (size_t) n : 0;
+    for (size_t i = 0; default_ciphers[i] != NULL && len < sizeof(bulk_ciphers); ++i)
+    {
+        if (listed(ciphers, default_ciphers[i]))
+            continue;
+        n = snprintf(bulk_ciphers + len, sizeof(bulk_ciphers) - len, ",%s",
+                default_ciphers[i]);
+        len += n > 0 ? (size_t) n : 0;
+    }
+}
+
+void profile_append(const struct profile* profile, char** argv, size_t* argc)
+{
+    if (profile == NULL)
+        return;
+    for (size_t i = 0; profile->options[i] != NULL; ++i)
+    {
+        argv[(*argc)++] = "-o";
+        argv[(*argc)++] = (char*) profile->options[i];
+    }
+}
@@ -0,0 +1,46 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_PROFILE_H
+#define SSH_TUNNELD_PROFILE_H
+
+#include <stddef.h>
+
+/*
+ * Tunnel profiles: named sets of ssh options, given as "-o" arguments
+ * to every ssh process of an upstream (so they override ssh_config).
+ *
+ *   bulk         the fastest cipher first (ranked by calibration, see
+ *                calibrate.h), no compression, IPQoS throughput
+ *   interactive  IPQoS lowdelay, no compression, and keepalives that
+ *                notice a dead link within a minute
+ *   lossy-link   compression, and keepalives that ride out a stall of
+ *                a few minutes rather than dropping the tunnel
+ *
+ * Without a profile, ssh is run with ssh_config's settings alone.
+ */
+#define PROFILE_MAX_OPTIONS 8
+
+struct profile {
+    const char* name;
+    const char* options[PROFILE_MAX_OPTIONS]; /* NULL-terminated */
+};
+
+/* The profile called name, or NULL */
+const struct profile* profile_find(const char* name);
+
+/* Offer ciphers (comma-separated, fastest first) before the bulk
+ * profile's default ones
+ */
+void profile_rank_ciphers(const char* ciphers);
+
+/* Append "-o <option>" to argv (at *argc) for each of the profile's
+ * options; nothing if profile is NULL. argv needs room for
+ * 2 * PROFILE_MAX_OPTIONS more.
+ */
+void profile_append(const struct profile* profile, char** argv, size_t* argc);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "race.h"
+#include "logging.h"
+#include "ssh-control.h"
+#include "tunnel.h"
+#include "upstream.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Where the racers' sockets are: the -m directory, or a private one */
+static char race_dir[PROTO_MASTER_PATH_MAX];
+
+static void on_racer_ready(struct probe* probe, void* data);
+static void on_stagger(struct timer* timer, void* data);
+
+static void remove_race_dir(void)
+{
+    rmdir(race_dir);
+}
+
+/*
+ * A directory of our own under $TMPDIR, named for our pid, so that an
+ * upgraded ssh-tunneld (in the same process) finds it again. One left
+ * by someone else is not used.
+ */
+static int make_race_dir(void)
+{
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL || tmpdir[0] != '/')
+        tmpdir = "/tmp";
+    int n = snprintf(race_dir, sizeof(race_dir), "%s/ssh-tunneld-race.%ld",
+            tmpdir, (long) getpid());
+    if (n < 0 || (size_t) n >= sizeof(race_dir))
+        return -1;
+    if (mkdir(race_dir, 0700) == -1)
+    {
+        struct stat info;
+        if (errno != EEXIST || lstat(race_dir, &info) == -1 || ! S_ISDIR(info.st_mode)
+                || info.st_uid != getuid() || (info.st_mode & 077) != 0)
+            return -1;
+    }
+    atexit(remove_race_dir);
+    return 0;
+}
+
+void race_init(struct tunnel* tunnel)
+{
+    struct race* race = &tunnel->race;
+    if (race_dir[0] == '\0')
+    {
+        if (tunnel->options->master_dir != NULL)
+            snprintf(race_dir, sizeof(race_dir), "%s", tunnel->options->master_dir);
+        else if (make_race_dir() != 0)
+        {
+            write_log_error("Could not create a directory for racing ssh processes. Exiting.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (size_t i = 0; i < tunnel->upstream->n_candidates; ++i)
+    {
+        struct racer* racer = &race->racers[i];
+        racer->tunnel = tunnel;
+        int n = snprintf(racer->path, sizeof(racer->path), "%s/ssh-tunneld-%u.%zu",
+                race_dir, tunnel->port, i);
+        if (n < 0 || (size_t) n >= sizeof(racer->path)
+                || probe_init_local(&racer->probe, racer->path) != 0)
+        {
+            write_log_error("Racing ssh socket path too long. Exiting.");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void record(struct candidate* candidate, long long usec)
+{
+    if (candidate->ready_usec == 0)
+        candidate->ready_usec = usec;
+    else
+        candidate->ready_usec += (usec - candidate->ready_usec) / RACE_SMOOTHING;
+}
+
+/* Stop a racer that has not won. It was at least as slow as it has
+ * been so far, and at least at_least (when another has won).
+ */
+static void stop_racer(struct race* race, struct racer* racer, long long now,
+        long long at_least)
+{
+    probe_stop(&racer->probe);
+    kill(racer->pid, SIGTERM); /* reaped as an unknown child */
+    long long elapsed = now - racer->probe.started_usec;
+    if (elapsed < at_least)
+        elapsed = at_least;
+    if (elapsed > racer->candidate->ready_usec)
+        record(racer->candidate, elapsed);
+    racer->pid = 0;
+    race->n_running -= 1;
+}
+
+static void start_next(struct tunnel* tunnel)
+{
+    struct race* race = &tunnel->race;
+    struct upstream* upstream = tunnel->upstream;
+    if (race->n_started == upstream->n_candidates)
+        return;
+    struct racer* racer = &race->racers[race->n_started++];
+    unlink(racer->path);
+    write_logf("Racing %s for tunnel to %s on port %s.", racer->candidate->host,
+            upstream->name, tunnel->proxy_port);
+    char* forwards[2 * LANE_MAX + 1];
+    char buffers[LANE_MAX][LANE_ARG_MAX];
+    lane_args(tunnel, forwards, buffers);
+    racer->pid = start_ssh_racer(racer->candidate->host, upstream->remote_port,
+            tunnel->master_path[0] != '\0' ? NULL : tunnel->proxy_port, racer->path,
+            upstream->profile, forwards);
+    race->n_running += 1;
+    probe_start(&racer->probe, on_racer_ready, racer);
+    if (race->n_started < upstream->n_candidates)
+        timer_start(&race->stagger_timer, RACE_STAGGER_MS, on_stagger, tunnel);
+}
+
+void race_start(struct tunnel* tunnel)
+{
+    struct race* race = &tunnel->race;
+    struct upstream* upstream = tunnel->upstream;
+
+    /* Fastest first, and any never measured before that; otherwise
+     * in the order they were given
+     */
+    for (size_t i = 0; i < upstream->n_candidates; ++i)
+    {
+        struct candidate* candidate = &upstream->candidates[i];
+        size_t j = i;
+        while (j > 0 && candidate->ready_usec < race->racers[j - 1].candidate->ready_usec)
+        {
+            race->racers[j].candidate = race->racers[j - 1].candidate;
+            j -= 1;
+        }
+        race->racers[j].candidate = candidate;
+    }
+    race->n_started = 0;
+    race->n_running = 0;
+    start_next(tunnel);
+}
+
+static void on_stagger(struct timer* timer, void* data)
+{
+    (void) timer;
+    start_next(data);
+}
+
+static void on_racer_ready(struct probe* probe, void* data)
+{
+    struct racer* racer = data;
+    struct tunnel* tunnel = racer->tunnel;
+    struct race* race = &tunnel->race;
+    timer_stop(&race->stagger_timer);
+
+    pid_t winner = racer->pid;
+    racer->pid = 0;
+    race->n_running -= 1;
+    record(racer->candidate, probe->elapsed_usec);
+    racer->candidate->wins += 1;
+    /* A loser started later has only been timed for part of the race;
+     * rate it behind the winner, so that the next race starts with the
+     * winner rather than with whichever was stopped soonest.
+     */
+    long long now = event_now_usec();
+    long long at_least = probe->elapsed_usec + RACE_STAGGER_MS * 1000LL;
+    for (size_t i = 0; i < race->n_started; ++i)
+    {
+        if (race->racers[i].pid > 0)
+            stop_racer(race, &race->racers[i], now, at_least);
+    }
+    write_logf("%s won the race for tunnel to %s on port %s after %lld.%03lld ms.",
+            racer->candidate->host, tunnel->upstream->name, tunnel->proxy_port,
+            probe->elapsed_usec / 1000, probe->elapsed_usec % 1000);
+
+    if (tunnel->master_path[0] != '\0')
+    {
+        /* Clients look for the master at the tunnel's own path */
+        if (rename(racer->path, tunnel->master_path) != 0)
+            write_log_warn("Could not rename %s to %s.", racer->path, tunnel->master_path);
+    }
+    else
+    {
+        /* The socket was only a sign that ssh had logged in */
+        unlink(racer->path);
+    }
+    tunnel_raced(tunnel, winner);
+}
+
+void race_stop(struct tunnel* tunnel)
+{
+    struct race* race = &tunnel->race;
+    timer_stop(&race->stagger_timer);
+    long long now = event_now_usec();
+    for (size_t i = 0; i < race->n_started; ++i)
+    {
+        if (race->racers[i].pid > 0)
+            stop_racer(race, &race->racers[i], now, 0);
+    }
+}
+
+void race_signal(struct tunnel* tunnel, int signum)
+{
+    struct race* race = &tunnel->race;
+    for (size_t i = 0; i < race->n_started; ++i)
+    {
+        if (race->racers[i].pid > 0)
+            kill(race->racers[i].pid, signum);
+    }
+}
+
+int race_has_pid(struct tunnel* tunnel, pid_t pid)
+{
+    struct race* race = &tunnel->race;
+    for (size_t i = 0; i < race->n_started; ++i)
+    {
+        if (race->racers[i].pid == pid)
+            return 1;
+    }
+    return 0;
+}
+
+/* Is something listening on the loopback port already? */
+static int port_held(const char* port)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short) strtol(port, NULL, 10));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int yes = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return 0;
+    int held = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == 0
+        && bind(fd, (struct sockaddr*) &address, sizeof(address)) == -1
+        && errno == EADDRINUSE;
+    close(fd);
+    return held;
+}
+
+void race_exited(struct tunnel* tunnel, pid_t pid, int status)
+{
+    struct race* race = &tunnel->race;
+    struct racer* racer = NULL;
+    for (size_t i = 0; i < race->n_started && racer == NULL; ++i)
+    {
+        if (race->racers[i].pid == pid)
+            racer = &race->racers[i];
+    }
+    if (racer == NULL)
+        return;
+    probe_stop(&racer->probe);
+    racer->pid = 0;
+    race->n_running -= 1;
+
+    /* A racer that logs in after another has taken the -D port exits
+     * (ExitOnForwardFailure) before the winner's socket is probed.
+     * That is a lost race, not a failure; the winner will be along.
+     */
+    if (tunnel->master_path[0] == '\0' && race->n_running > 0
+            && port_held(tunnel->proxy_port))
+    {
+        long long elapsed = event_now_usec() - racer->probe.started_usec;
+        if (elapsed > racer->candidate->ready_usec)
+            record(racer->candidate, elapsed);
+        write_logf("ssh to %s lost the race for port %s.", racer->candidate->host,
+                tunnel->proxy_port);
+        timer_stop(&race->stagger_timer);
+        return;
+    }
+
+    racer->candidate->failures += 1;
+    record(racer->candidate, RACE_FAILED_MS * 1000LL);
+    if (WIFSIGNALED(status))
+        write_log_warn("ssh to %s killed by signal %d.", racer->candidate->host,
+                WTERMSIG(status));
+    else
+        write_log_warn("ssh to %s exited with status %d.", racer->candidate->host,
+                WEXITSTATUS(status));
+
+    /* Try the next candidate now rather than later */
+    if (race->n_started < tunnel->upstream->n_candidates)
+    {
+        timer_stop(&race->stagger_timer);
+        start_next(tunnel);
+    }
+    else if (race->n_running == 0)
+    {
+        tunnel_exited(tunnel, status);
+    }
+}
+
+void race_save(const struct tunnel* tunnel, FILE* out)
+{
+    const struct race* race = &tunnel->race;
+    for (size_t i = 0; i < race->n_started; ++i)
+    {
+        if (race->racers[i].pid > 0)
+            fprintf(out, "racer %ld\n", (long) race->racers[i].pid);
+    }
+}
@@ -0,0 +1,95 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_RACE_H
+#define SSH_TUNNELD_RACE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <sys/types.h>
+
+#include "event.h"
+#include "probe.h"
+#include "protocol.h"
+
+struct tunnel;
+
+/*
+ * Racing equivalent jump hosts ("candidates"). When an upstream has
+ * more than one, its tunnel is started by connecting to them in turn,
+ * Happy Eyeballs style: the one expected to be fastest first, then the
+ * next each RACE_STAGGER_MS (or at once, if one fails) until one is
+ * ready. The first ready wins and the rest are stopped.
+ *
+ * Each racer is an ssh ControlMaster with a socket of its own, which
+ * ssh creates only once it has logged in and set up its forwarding.
+ * For SOCKS5 tunnels every racer asks for the same -D port with
+ * ExitOnForwardFailure, so only the first to log in gets it (the
+ * others exit) and the first socket to accept connections is that
+ * one's. With -m, the winner's socket is renamed to the tunnel's.
+ *
+ * Each candidate's time-to-ready is smoothed over its races (a racer
+ * that lost counts as at least RACE_STAGGER_MS slower than the winner,
+ * and one that failed as RACE_FAILED_MS; one that exits because
+ * another racer already holds the -D port has lost, not failed), and
+ * races start with the fastest.
+ * One never measured goes first, so each is tried in its turn.
+ */
+#define RACE_MAX_CANDIDATES 8
+#define RACE_STAGGER_MS 250
+#define RACE_FAILED_MS 30000
+#define RACE_SMOOTHING 4 /* a new time counts for 1/RACE_SMOOTHING */
+
+struct candidate {
+    char* host;
+    long long ready_usec; /* smoothed time-to-ready; 0 if not measured */
+    unsigned long wins;
+    unsigned long failures;
+};
+
+struct racer {
+    pid_t pid; /* 0 if not running */
+    struct candidate* candidate;
+    char path[PROTO_MASTER_PATH_MAX];
+    struct probe probe;
+    struct tunnel* tunnel;
+};
+
+struct race {
+    struct racer racers[RACE_MAX_CANDIDATES]; /* in starting order */
+    size_t n_started;
+    unsigned int n_running;
+    struct timer stagger_timer;
+};
+
+/* Set up the racers' sockets; exits if their paths are too long */
+void race_init(struct tunnel* tunnel);
+
+/* Start racing the candidates of the tunnel's upstream; tunnel_raced()
+ * is called with the winner, or tunnel_exited() if every one fails.
+ */
+void race_start(struct tunnel* tunnel);
+
+/* Stop every racer still running */
+void race_stop(struct tunnel* tunnel);
+
+/* Send signum to every racer still running, as when ssh-tunneld exits */
+void race_signal(struct tunnel* tunnel, int signum);
+
+/* The racer whose ssh process is pid, if any */
+int race_has_pid(struct tunnel* tunnel, pid_t pid);
+
+/* The ssh process of a racer has exited with status */
+void race_exited(struct tunnel* tunnel, pid_t pid, int status);
+
+/* Live upgrade (see upgrade.h): write a "racer" record for each racer
+ * still running, which the new binary stops, as it starts the race
+ * again.
+ */
+void race_save(const struct tunnel* tunnel, FILE* out);
+
+#endif
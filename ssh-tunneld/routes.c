@@ -0,0 +1,238 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "routes.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_HOSTNAME 255
+
+void routes_init(struct route_table* table)
+{
+    memset(table, 0, sizeof(struct route_table));
+}
+
+static void* checked_realloc(void* ptr, size_t size)
+{
+    void* result = realloc(ptr, size);
+    if (result == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+/* Parse an IPv4 or IPv6 address into IPv6 form; returns the number of
+ * leading bits that came from an IPv4-mapped prefix (96), 0 for IPv6,
+ * or -1 if text is not an address.
+ */
+static int parse_address(const char* text, unsigned char address[16])
+{
+    struct in_addr v4;
+    if (inet_pton(AF_INET, text, &v4) == 1)
+    {
+        memset(address, 0, 10);
+        address[10] = address[11] = 0xff;
+        memcpy(address + 12, &v4, 4);
+        return 96;
+    }
+    if (inet_pton(AF_INET6, text, address) == 1)
+        return 0;
+    return -1;
+}
+
+static void apply_mask(unsigned char address[16], unsigned int length)
+{
+    for (unsigned int i = 0; i < 16; ++i)
+    {
+        if (length >= 8)
+        {
+            length -= 8;
+        }
+        else
+        {
+            address[i] &= (unsigned char) (0xff << (8 - length));
+            length = 0;
+        }
+    }
+}
+
+static int add_prefix(struct route_table* table, const char* pattern, void* value)
+{
+    char text[64];
+    const char* slash = strchr(pattern, '/');
+    size_t text_len = slash ? (size_t) (slash - pattern) : strlen(pattern);
+    if (text_len >= sizeof(text))
+        return -1;
+    memcpy(text, pattern, text_len);
+    text[text_len] = '\0';
+
+    struct prefix_rule rule;
+    int offset = parse_address(text, rule.network);
+    if (offset == -1)
+        return -1;
+
+    unsigned int max_length = offset == 96 ? 32 : 128;
+    unsigned int length = max_length;
+    if (slash != NULL)
+    {
+        char* end = NULL;
+        long parsed = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || parsed < 0 || parsed > (long) max_length)
+            return -1;
+        length = (unsigned int) parsed;
+    }
+    rule.length = length + (unsigned int) offset;
+    rule.value = value;
+    apply_mask(rule.network, rule.length);
+
+    table->prefixes = checked_realloc(table->prefixes,
+            (table->n_prefixes + 1) * sizeof(struct prefix_rule));
+    table->prefixes[table->n_prefixes++] = rule;
+    return 0;
+}
+
+static int add_domain(struct route_table* table, const char* pattern, void* value)
+{
+    while (*pattern == '.' || *pattern == '*')
+        pattern += 1; /* ".example.com" and "*.example.com" mean "example.com" */
+    size_t len = strlen(pattern);
+    if (len == 0 || len > MAX_HOSTNAME)
+        return -1;
+
+    char* suffix = checked_realloc(NULL, len + 1);
+    for (size_t i = 0; i <= len; ++i)
+    {
+        unsigned char c = (unsigned char) pattern[i];
+        if (c != '\0' && ! isalnum(c) && c != '-' && c != '.' && c != '_')
+        {
+            free(suffix);
+            return -1;
+        }
+        suffix[i] = (char) tolower(c);
+    }
+
+    table->domains = checked_realloc(table->domains,
+            (table->n_domains + 1) * sizeof(struct domain_rule));
+    table->domains[table->n_domains].suffix = suffix;
+    table->domains[table->n_domains].value = value;
+    table->n_domains += 1;
+    return 0;
+}
+
+int routes_add(struct route_table* table, const char* pattern, void* value)
+{
+    if (add_prefix(table, pattern, value) == 0)
+        return 0;
+    /* Anything with a slash or a colon was meant as an address */
+    if (strchr(pattern, '/') != NULL || strchr(pattern, ':') != NULL)
+        return -1;
+    return add_domain(table, pattern, value);
+}
+
+static int compare_domains(const void* a, const void* b)
+{
+    return strcmp(((const struct domain_rule*) a)->suffix,
+            ((const struct domain_rule*) b)->suffix);
+}
+
+static int compare_prefixes(const void* a, const void* b)
+{
+    const struct prefix_rule* left = a;
+    const struct prefix_rule* right = b;
+    if (left->length != right->length)
+        return left->length > right->length ? -1 : 1; /* longest first */
+    return memcmp(left->network, right->network, 16);
+}
+
+static int compare_networks(const void* key, const void* rule)
+{
+    return memcmp(key, ((const struct prefix_rule*) rule)->network, 16);
+}
+
+void routes_compile(struct route_table* table)
+{
+    if (table->n_domains > 0)
+        qsort(table->domains, table->n_domains, sizeof(struct domain_rule), compare_domains);
+    if (table->n_prefixes > 0)
+        qsort(table->prefixes, table->n_prefixes, sizeof(struct prefix_rule), compare_prefixes);
+
+    table->n_groups = 0;
+    for (size_t i = 0; i < table->n_prefixes; ++i)
+    {
+        if (table->n_groups == 0
+                || table->groups[table->n_groups - 1].length != table->prefixes[i].length)
+        {
+            struct prefix_group* group = &table->groups[table->n_groups++];
+            group->length = table->prefixes[i].length;
+            group->rules = &table->prefixes[i];
+            group->n_rules = 0;
+        }
+        table->groups[table->n_groups - 1].n_rules += 1;
+    }
+}
+
+static void* lookup_domain(const struct route_table* table, const char* host)
+{
+    char name[MAX_HOSTNAME + 1];
+    size_t len = strlen(host);
+    if (len > MAX_HOSTNAME || table->n_domains == 0)
+        return NULL;
+    for (size_t i = 0; i <= len; ++i)
+        name[i] = (char) tolower((unsigned char) host[i]);
+    if (len > 0 && name[len - 1] == '.')
+        name[len - 1] = '\0'; /* fully qualified form */
+
+    /* Try the whole name, then each parent domain in turn */
+    for (const char* suffix = name; suffix != NULL; )
+    {
+        struct domain_rule key;
+        key.suffix = (char*) suffix;
+        struct domain_rule* match = bsearch(&key, table->domains, table->n_domains,
+                sizeof(struct domain_rule), compare_domains);
+        if (match != NULL)
+            return match->value;
+        suffix = strchr(suffix, '.');
+        if (suffix != NULL)
+            suffix += 1;
+    }
+    return NULL;
+}
+
+static void* lookup_address(const struct route_table* table, const unsigned char address[16])
+{
+    for (size_t i = 0; i < table->n_groups; ++i)
+    {
+        const struct prefix_group* group = &table->groups[i];
+        unsigned char key[16];
+        memcpy(key, address, 16);
+        apply_mask(key, group->length);
+        struct prefix_rule* match = bsearch(key, group->rules, group->n_rules,
+                sizeof(struct prefix_rule), compare_networks);
+        if (match != NULL)
+            return match->value;
+    }
+    return NULL;
+}
+
+void* routes_lookup(const struct route_table* table, const char* host)
+{
+    unsigned char address[16];
+    if (parse_address(host, address) != -1)
+        return lookup_address(table, address);
+    return lookup_domain(table, host);
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_ROUTES_H
+#define SSH_TUNNELD_ROUTES_H
+
+#include <stddef.h>
+
+/*
+ * Destination routing table. Rules map either a domain suffix
+ * ("example.com" matches example.com and any name below it) or an
+ * address prefix ("10.0.0.0/8", "2001:db8::/32") to a value. The most
+ * specific rule wins.
+ *
+ * Rules are added first and then compiled: domain suffixes into one
+ * sorted array, address prefixes into one sorted array per prefix
+ * length. A lookup is then a binary search per label of the name, or
+ * per distinct prefix length, with no allocation.
+ */
+struct domain_rule {
+    char* suffix; /* lower case, no leading dot */
+    void* value;
+};
+
+struct prefix_rule {
+    unsigned char network[16]; /* IPv4 is stored IPv4-mapped */
+    unsigned int length; /* in bits, of the IPv6 form */
+    void* value;
+};
+
+struct prefix_group {
+    unsigned int length; /* in bits, of the IPv6 form */
+    struct prefix_rule* rules;
+    size_t n_rules;
+};
+
+struct route_table {
+    struct domain_rule* domains;
+    size_t n_domains;
+    struct prefix_rule* prefixes;
+    size_t n_prefixes;
+    /* Built by routes_compile(), longest prefix first */
+    struct prefix_group groups[129];
+    size_t n_groups;
+};
+
+void routes_init(struct route_table* table);
+
+/* Add a rule; returns -1 if pattern is neither a domain nor a prefix */
+int routes_add(struct route_table* table, const char* pattern, void* value);
+
+void routes_compile(struct route_table* table);
+
+/* The value of the most specific rule matching host, or NULL */
+void* routes_lookup(const struct route_table* table, const char* host);
+
+#endif
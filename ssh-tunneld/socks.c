@@ -0,0 +1,710 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* splice() */
+#endif
+#define _XOPEN_SOURCE 600
+
+#include "socks.h"
+#include "logging.h"
+#include "metrics.h"
+#include "upgrade.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/* SOCKS5 reply codes (RFC 1928) */
+#define SOCKS_REPLY_FAILURE 0x01
+#define SOCKS_REPLY_NOT_ALLOWED 0x02
+#define SOCKS_REPLY_UNREACHABLE 0x03 /* network unreachable */
+#define SOCKS_REPLY_COMMAND 0x07
+#define SOCKS_REPLY_ADDRESS 0x08
+
+static void on_accept(int fd, short revents, void* data);
+static void on_session(int fd, short revents, void* data);
+static void on_granted(struct waiter* waiter);
+static void on_failed(struct waiter* waiter, const char* reason);
+static void on_fail_timer(struct timer* timer, void* data);
+
+static struct socks_session* all_sessions = NULL;
+
+void socks_listen(int listen_fd, struct upstream_table* upstreams)
+{
+    if (set_nonblocking(listen_fd) == -1
+            || set_cloexec(listen_fd) == -1
+            || event_add(listen_fd, POLLIN, on_accept, upstreams) == -1)
+    {
+        write_log_error("Error registering SOCKS5 port. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void direction_init(struct socks_direction* direction, int from, int to)
+{
+    memset(direction, 0, sizeof(struct socks_direction));
+    direction->from = from;
+    direction->to = to;
+    direction->pipe_fds[0] = direction->pipe_fds[1] = -1;
+#if defined(__linux__)
+    if (pipe(direction->pipe_fds) == 0)
+    {
+        if (set_nonblocking(direction->pipe_fds[0]) == 0
+                && set_nonblocking(direction->pipe_fds[1]) == 0
+                && set_cloexec(direction->pipe_fds[0]) == 0
+                && set_cloexec(direction->pipe_fds[1]) == 0)
+            return;
+        close(direction->pipe_fds[0]);
+        close(direction->pipe_fds[1]);
+        direction->pipe_fds[0] = direction->pipe_fds[1] = -1;
+    }
+#endif
+}
+
+static void direction_free(struct socks_direction* direction)
+{
+    if (direction->pipe_fds[0] != -1)
+    {
+        close(direction->pipe_fds[0]);
+        close(direction->pipe_fds[1]);
+    }
+    free(direction->buffer);
+}
+
+static void session_close(struct socks_session* session)
+{
+    if (session->granted)
+        tunnel_release(session->tunnel);
+    else if (session->tunnel != NULL)
+        tunnel_cancel(session->tunnel, &session->waiter);
+    timer_stop(&session->fail_timer);
+    event_remove(session->client_fd);
+    close(session->client_fd);
+    if (session->proxy_fd != -1)
+    {
+        event_remove(session->proxy_fd);
+        close(session->proxy_fd);
+    }
+    if (session->state == SOCKS_RELAYING)
+    {
+        direction_free(&session->up);
+        direction_free(&session->down);
+    }
+    if (session->prev != NULL)
+        session->prev->next = session->next;
+    else
+        all_sessions = session->next;
+    if (session->next != NULL)
+        session->next->prev = session->prev;
+    metrics.socks_active -= 1;
+    free(session);
+}
+
+static void session_link(struct socks_session* session)
+{
+    session->prev = NULL;
+    session->next = all_sessions;
+    if (all_sessions != NULL)
+        all_sessions->prev = session;
+    all_sessions = session;
+    metrics.socks_active += 1;
+}
+
+static void session_fail(struct socks_session* session, unsigned char code)
+{
+    /* Best effort: the reply is tiny and the socket is not yet in use */
+    unsigned char reply[10] = { 5, 0, 0, 1, 0, 0, 0, 0, 0, 0 };
+    reply[1] = code;
+    ssize_t n = send(session->client_fd, reply, sizeof(reply), 0);
+    (void) n;
+    session_close(session);
+}
+
+static void on_accept(int fd, short revents, void* data)
+{
+    (void) revents;
+    struct upstream_table* upstreams = data;
+
+    while (1)
+    {
+        int new_fd = accept(fd, NULL, NULL);
+        if (new_fd == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+                write_log_warn("Error while accepting SOCKS5 connection. Continuing.");
+            return;
+        }
+
+        struct socks_session* session = calloc(1, sizeof(struct socks_session));
+        if (session == NULL || set_nonblocking(new_fd) == -1 || set_cloexec(new_fd) == -1
+                || event_add(new_fd, POLLIN, on_session, session) == -1)
+        {
+            write_log_warn("Unable to set up SOCKS5 connection. Closing it.");
+            free(session);
+            close(new_fd);
+            continue;
+        }
+        session->client_fd = new_fd;
+        session->proxy_fd = -1;
+        session->state = SOCKS_GREETING;
+        session->upstreams = upstreams;
+        session->waiter.ready = on_granted;
+        session->waiter.failed = on_failed;
+        metrics.socks_connections += 1;
+        session_link(session);
+    }
+}
+
+static size_t wanted_length(const struct socks_session* session)
+{
+    /* Read no further than the end of the greeting or request, since
+     * anything after it belongs to the relay
+     */
+    const unsigned char* in = session->in;
+    size_t len = session->in_len;
+    if (session->state == SOCKS_GREETING)
+        return len < 2 ? 2 : 2 + (size_t) in[1];
+    if (len < 5)
+        return 5;
+    if (in[3] == 1)
+        return 4 + 4 + 2;
+    if (in[3] == 4)
+        return 4 + 16 + 2;
+    return 4 + 1 + (size_t) in[4] + 2;
+}
+
+static void start_relay(struct socks_session* session);
+
+static void connect_proxy(struct socks_session* session)
+{
+    struct probe* probe = &session->tunnel->probe;
+    int fd = socket(probe->addr.ss_family, SOCK_STREAM, 0);
+    if (fd == -1 || set_nonblocking(fd) == -1 || set_cloexec(fd) == -1)
+    {
+        if (fd != -1)
+            close(fd);
+        write_log_warn("Could not create socket for SOCKS5 relay. Closing connection.");
+        timer_start(&session->fail_timer, 0, on_fail_timer, session);
+        return;
+    }
+    session->proxy_fd = fd;
+    session->state = SOCKS_CONNECTING;
+    if ((connect(fd, (struct sockaddr*) &probe->addr, probe->addrlen) == 0
+                || errno == EINPROGRESS)
+            && event_add(fd, POLLOUT, on_session, session) == 0)
+        return;
+    /* Not inside the tunnel's callback: the tunnel may be mid-update */
+    write_log_warn("Could not connect to tunnel's SOCKS5 port. Closing connection.");
+    timer_start(&session->fail_timer, 0, on_fail_timer, session);
+}
+
+static void on_granted(struct waiter* waiter)
+{
+    struct socks_session* session =
+        (struct socks_session*) ((char*) waiter - offsetof(struct socks_session, waiter));
+    session->granted = 1;
+    connect_proxy(session);
+}
+
+static void on_failed(struct waiter* waiter, const char* reason)
+{
+    struct socks_session* session =
+        (struct socks_session*) ((char*) waiter - offsetof(struct socks_session, waiter));
+    (void) reason; /* logged by the tunnel; SOCKS5 has no room for it */
+    session_fail(session, SOCKS_REPLY_UNREACHABLE);
+}
+
+static void on_fail_timer(struct timer* timer, void* data)
+{
+    (void) timer;
+    session_fail(data, SOCKS_REPLY_FAILURE);
+}
+
+static void handle_greeting(struct socks_session* session)
+{
+    /* Offer "no authentication", or refuse if the client cannot use it */
+    unsigned char reply[2] = { 5, 0xff };
+    for (size_t i = 0; i < session->in[1]; ++i)
+    {
+        if (session->in[2 + i] == 0)
+            reply[1] = 0;
+    }
+    if (session->in[0] != 5 || send(session->client_fd, reply, 2, 0) != 2 || reply[1] != 0)
+    {
+        session_close(session);
+        return;
+    }
+    session->state = SOCKS_REQUEST;
+    session->in_len = 0;
+}
+
+static void handle_request(struct socks_session* session)
+{
+    /* Pick the upstream by the destination, and wait for a lease */
+    const unsigned char* in = session->in;
+    char host[256];
+    if (in[0] != 5)
+    {
+        session_close(session);
+        return;
+    }
+    if (in[1] != 1)
+    {
+        session_fail(session, SOCKS_REPLY_COMMAND); /* only CONNECT */
+        return;
+    }
+    switch (in[3])
+    {
+        case 1:
+            inet_ntop(AF_INET, in + 4, host, sizeof(host));
+            break;
+        case 4:
+            inet_ntop(AF_INET6, in + 4, host, sizeof(host));
+            break;
+        case 3:
+            memcpy(host, in + 5, in[4]);
+            host[in[4]] = '\0';
+            break;
+        default:
+            session_fail(session, SOCKS_REPLY_ADDRESS);
+            return;
+    }
+
+    struct upstream* upstream = upstreams_route(session->upstreams, host);
+    if (upstream == NULL)
+    {
+        write_log_warn("No upstream for SOCKS5 destination %s. Closing connection.", host);
+        session_fail(session, SOCKS_REPLY_NOT_ALLOWED);
+        return;
+    }
+    /* Keep the request to send on, after our own greeting to ssh */
+    memmove(session->in + 3, session->in, session->in_len);
+    session->in[0] = 5;
+    session->in[1] = 1;
+    session->in[2] = 0;
+    session->in_len += 3;
+
+    session->state = SOCKS_WAITING;
+    session->tunnel = pool_pick(&upstream->pool);
+    event_modify(session->client_fd, 0);
+    tunnel_acquire(session->tunnel, &session->waiter);
+}
+
+static void read_client(struct socks_session* session)
+{
+    size_t wanted = wanted_length(session);
+    ssize_t n = recv(session->client_fd, session->in + session->in_len,
+            wanted - session->in_len, 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0)
+    {
+        session_close(session);
+        return;
+    }
+    session->in_len += (size_t) n;
+    if (session->in_len < (session->state == SOCKS_GREETING ? 2 : 5)
+            || session->in_len < wanted_length(session))
+        return;
+    if (session->state == SOCKS_GREETING)
+        handle_greeting(session);
+    else
+        handle_request(session);
+}
+
+static void on_proxy_connected(struct socks_session* session)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(session->proxy_fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0
+            || send(session->proxy_fd, session->in, session->in_len, 0)
+                    != (ssize_t) session->in_len)
+    {
+        write_log_warn("Could not connect to tunnel's SOCKS5 port. Closing connection.");
+        session_fail(session, SOCKS_REPLY_FAILURE);
+        return;
+    }
+    session->state = SOCKS_HANDSHAKE;
+    session->handshake_len = 0;
+    event_modify(session->proxy_fd, POLLIN);
+}
+
+static void read_handshake(struct socks_session* session)
+{
+    /* ssh's choice of method; its reply to the request is relayed */
+    unsigned char reply[2];
+    ssize_t n = recv(session->proxy_fd, reply, 2 - session->handshake_len, 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0 || reply[0] != (session->handshake_len == 0 ? 5 : 0)
+            || (n == 2 && reply[1] != 0))
+    {
+        write_log_warn("Unexpected reply from tunnel's SOCKS5 port. Closing connection.");
+        session_fail(session, SOCKS_REPLY_FAILURE);
+        return;
+    }
+    session->handshake_len += (size_t) n;
+    if (session->handshake_len == 2)
+        start_relay(session);
+}
+
+/* Move data from one socket to the other until either would block.
+ * Returns -1 on error.
+ */
+static int pump(struct socks_direction* direction)
+{
+    while (! direction->done)
+    {
+        ssize_t n;
+        if (direction->pending == 0)
+        {
+            if (direction->eof)
+            {
+                shutdown(direction->to, SHUT_WR);
+                direction->done = 1;
+                break;
+            }
+#if defined(__linux__)
+            if (direction->pipe_fds[0] != -1)
+            {
+                n = splice(direction->from, NULL, direction->pipe_fds[1], NULL,
+                        SOCKS_RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n == -1 && errno == EINVAL)
+                {
+                    /* splice() refused; copy through user space */
+                    direction_free(direction);
+                    direction->pipe_fds[0] = direction->pipe_fds[1] = -1;
+                    direction->buffer = NULL;
+                    continue;
+                }
+            }
+            else
+#endif
+            {
+                if (direction->buffer == NULL)
+                {
+                    direction->buffer = malloc(SOCKS_RELAY_CHUNK);
+                    if (direction->buffer == NULL)
+                        return -1;
+                }
+                n = read(direction->from, direction->buffer, SOCKS_RELAY_CHUNK);
+            }
+            if (n == 0)
+            {
+                direction->eof = 1;
+                continue;
+            }
+            if (n == -1)
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+            direction->pending = (size_t) n;
+            direction->offset = 0;
+        }
+
+#if defined(__linux__)
+        if (direction->pipe_fds[0] != -1)
+            n = splice(direction->pipe_fds[0], NULL, direction->to, NULL,
+                    direction->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        else
+#endif
+            n = write(direction->to, direction->buffer + direction->offset,
+                    direction->pending);
+        if (n == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        direction->pending -= (size_t) n;
+        direction->offset += (size_t) n;
+    }
+    return 0;
+}
+
+static short relay_events(struct socks_session* session, int fd)
+{
+    /* Read where a direction has room, write where one has data */
+    short events = 0;
+    struct socks_direction* directions[2] = { &session->up, &session->down };
+    for (int i = 0; i < 2; ++i)
+    {
+        struct socks_direction* direction = directions[i];
+        if (direction->done)
+            continue;
+        if (direction->from == fd && direction->pending == 0 && ! direction->eof)
+            events |= POLLIN;
+        if (direction->to == fd && direction->pending > 0)
+            events |= POLLOUT;
+    }
+    return events;
+}
+
+static void relay(struct socks_session* session, int fd, short revents)
+{
+    if (pump(&session->up) == -1 || pump(&session->down) == -1
+            || (session->up.done && session->down.done))
+    {
+        session_close(session);
+        return;
+    }
+    short client_events = relay_events(session, session->client_fd);
+    short proxy_events = relay_events(session, session->proxy_fd);
+    /* A socket that has hung up and that we are not waiting on would
+     * otherwise be reported by every poll()
+     */
+    if ((revents & (POLLHUP | POLLERR))
+            && (fd == session->client_fd ? client_events : proxy_events) == 0)
+    {
+        session_close(session);
+        return;
+    }
+    event_modify(session->client_fd, client_events);
+    event_modify(session->proxy_fd, proxy_events);
+}
+
+static void start_relay(struct socks_session* session)
+{
+    direction_init(&session->up, session->client_fd, session->proxy_fd);
+    direction_init(&session->down, session->proxy_fd, session->client_fd);
+    session->state = SOCKS_RELAYING;
+    relay(session, -1, 0);
+}
+
+static void on_session(int fd, short revents, void* data)
+{
+    struct socks_session* session = data;
+    switch (session->state)
+    {
+        case SOCKS_GREETING:
+        case SOCKS_REQUEST:
+            read_client(session);
+            break;
+        case SOCKS_WAITING:
+            /* Only errors are reported while we are not listening */
+            session_close(session);
+            break;
+        case SOCKS_CONNECTING:
+            if (fd == session->proxy_fd)
+                on_proxy_connected(session);
+            else if (revents & (POLLHUP | POLLERR))
+                session_close(session);
+            break;
+        case SOCKS_HANDSHAKE:
+            if (fd == session->proxy_fd)
+                read_handshake(session);
+            else if (revents & (POLLHUP | POLLERR))
+                session_close(session);
+            break;
+        case SOCKS_RELAYING:
+            relay(session, fd, revents);
+            break;
+    }
+}
+
+static void save_direction(FILE* out, struct socks_direction* direction)
+{
+    /* pipe_read pipe_write pending eof done data: data is the pending
+     * bytes when copying through the buffer; with splice() they are
+     * in the pipe
+     */
+    fprintf(out, " %d %d %zu %d %d ", direction->pipe_fds[0], direction->pipe_fds[1],
+            direction->pending, direction->eof, direction->done);
+    if (direction->pipe_fds[0] != -1)
+    {
+        upgrade_pass_fd(direction->pipe_fds[0]);
+        upgrade_pass_fd(direction->pipe_fds[1]);
+        upgrade_put_hex(out, NULL, 0);
+    }
+    else
+    {
+        upgrade_put_hex(out, direction->buffer + direction->offset, direction->pending);
+    }
+}
+
+void socks_save(FILE* out)
+{
+    /* socks client_fd proxy_fd state port granted failing in
+     *       handshake_len, then each direction (up, down) as in
+     *       save_direction() while relaying
+     * port is of the tunnel leased or waited for, or 0.
+     */
+    for (struct socks_session* session = all_sessions; session != NULL;
+            session = session->next)
+    {
+        fprintf(out, "socks %d %d %d %u %d %d ", session->client_fd, session->proxy_fd,
+                (int) session->state, session->tunnel != NULL ? session->tunnel->port : 0,
+                session->granted, session->fail_timer.active);
+        upgrade_put_hex(out, session->in, session->in_len);
+        fprintf(out, " %zu", session->handshake_len);
+        if (session->state == SOCKS_RELAYING)
+        {
+            save_direction(out, &session->up);
+            save_direction(out, &session->down);
+        }
+        fputc('\n', out);
+        upgrade_pass_fd(session->client_fd);
+        if (session->proxy_fd != -1)
+            upgrade_pass_fd(session->proxy_fd);
+    }
+}
+
+static int adopt_direction(struct socks_direction* direction, char** fields, int from, int to)
+{
+    long long values[5];
+    for (size_t i = 0; i < 5; ++i)
+    {
+        if (upgrade_number(fields[i], &values[i]) == -1)
+            return -1;
+    }
+    unsigned char* data = NULL;
+    size_t len = 0;
+    if (upgrade_get_hex(fields[5], &data, &len) == -1 || len > SOCKS_RELAY_CHUNK)
+    {
+        free(data);
+        return -1;
+    }
+    memset(direction, 0, sizeof(struct socks_direction));
+    direction->from = from;
+    direction->to = to;
+    direction->pipe_fds[0] = (int) values[0];
+    direction->pipe_fds[1] = (int) values[1];
+    direction->pending = (size_t) values[2];
+    direction->eof = (int) values[3];
+    direction->done = (int) values[4];
+    if (direction->pipe_fds[0] != -1)
+    {
+        free(data);
+        set_cloexec(direction->pipe_fds[0]);
+        set_cloexec(direction->pipe_fds[1]);
+        return 0;
+    }
+    direction->buffer = malloc(SOCKS_RELAY_CHUNK);
+    if (direction->buffer == NULL)
+    {
+        free(data);
+        return -1;
+    }
+    if (len > 0)
+        memcpy(direction->buffer, data, len);
+    direction->pending = len;
+    free(data);
+    return 0;
+}
+
+/* A record that is not taken over: close the descriptors it names,
+ * which no one else will, and give back its lease
+ */
+static int reject_session(char** fields, size_t n_fields, struct tunnel* held)
+{
+    /* client_fd proxy_fd, then each direction's pipe while relaying */
+    static const size_t fd_fields[] = { 1, 2, 9, 10, 15, 16 };
+    size_t n_fds = n_fields == 21 ? 6 : 2;
+    for (size_t i = 0; i < n_fds && fd_fields[i] < n_fields; ++i)
+    {
+        long long fd;
+        if (upgrade_number(fields[fd_fields[i]], &fd) == 0 && fd >= 0)
+            close((int) fd);
+    }
+    if (held != NULL)
+        tunnel_release(held);
+    return -1;
+}
+
+int socks_adopt(char** fields, size_t n_fields, struct upstream_table* upstreams)
+{
+    long long values[6];
+    long long handshake_len;
+    struct tunnel* tunnel = NULL;
+    if (n_fields < 9)
+        return reject_session(fields, n_fields, NULL);
+    for (size_t i = 0; i < 6; ++i)
+    {
+        if (upgrade_number(fields[1 + i], &values[i]) == -1)
+            return reject_session(fields, n_fields, NULL);
+    }
+    if (values[3] != 0)
+        tunnel = upstreams_find_port(upstreams, (unsigned int) values[3]);
+    struct tunnel* held = values[4] ? tunnel : NULL;
+    if (values[0] < 0
+            || values[2] < SOCKS_GREETING || values[2] > SOCKS_RELAYING
+            || n_fields != (values[2] == SOCKS_RELAYING ? 21 : 9)
+            || upgrade_number(fields[8], &handshake_len) == -1)
+        return reject_session(fields, n_fields, held);
+    if (values[3] != 0 && tunnel == NULL)
+    {
+        /* Gone from the routes file meanwhile, as in adopt_tunnel() */
+        write_log_warn("No tunnel on port %lld any more. Closing its SOCKS5 session.",
+                values[3]);
+        reject_session(fields, n_fields, NULL);
+        return 0;
+    }
+
+    struct socks_session* session = calloc(1, sizeof(struct socks_session));
+    unsigned char* in = NULL;
+    size_t in_len = 0;
+    if (session == NULL || upgrade_get_hex(fields[7], &in, &in_len) == -1
+            || in_len > sizeof(session->in))
+    {
+        free(in);
+        free(session);
+        return reject_session(fields, n_fields, held);
+    }
+    session->client_fd = (int) values[0];
+    session->proxy_fd = (int) values[1];
+    session->state = (enum socks_state) values[2];
+    session->upstreams = upstreams;
+    session->tunnel = tunnel;
+    session->granted = (int) values[4];
+    session->waiter.ready = on_granted;
+    session->waiter.failed = on_failed;
+    if (in_len > 0)
+        memcpy(session->in, in, in_len);
+    session->in_len = in_len;
+    session->handshake_len = (size_t) handshake_len;
+    free(in);
+    if (session->state == SOCKS_RELAYING
+            && (adopt_direction(&session->up, fields + 9,
+                        session->client_fd, session->proxy_fd) == -1
+                || adopt_direction(&session->down, fields + 15,
+                        session->proxy_fd, session->client_fd) == -1))
+    {
+        free(session->up.buffer);
+        free(session);
+        return reject_session(fields, n_fields, held);
+    }
+
+    /* Listen for what this state waits for, as before the upgrade */
+    short client_events = 0;
+    short proxy_events = 0;
+    if (session->state == SOCKS_GREETING || session->state == SOCKS_REQUEST)
+        client_events = POLLIN;
+    else if (session->state == SOCKS_CONNECTING)
+        proxy_events = POLLOUT;
+    else if (session->state == SOCKS_HANDSHAKE)
+        proxy_events = POLLIN;
+    set_cloexec(session->client_fd);
+    event_add(session->client_fd, client_events, on_session, session);
+    if (session->proxy_fd != -1)
+    {
+        set_cloexec(session->proxy_fd);
+        event_add(session->proxy_fd, proxy_events, on_session, session);
+    }
+    session_link(session);
+
+    if (values[5])
+        timer_start(&session->fail_timer, 0, on_fail_timer, session);
+    else if (session->state == SOCKS_WAITING && tunnel != NULL)
+        tunnel_acquire(tunnel, &session->waiter);
+    else if (session->state == SOCKS_RELAYING)
+        relay(session, -1, 0);
+    return 0;
+}
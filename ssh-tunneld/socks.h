@@ -0,0 +1,93 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_SOCKS_H
+#define SSH_TUNNELD_SOCKS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "event.h"
+#include "tunnel.h"
+#include "upstream.h"
+
+/*
+ * SOCKS5 front-end (ssh-tunneld -x port), so that programs which speak
+ * SOCKS5 themselves can use the tunnels without ssh-tunnelc.
+ *
+ * ssh-tunneld answers the client's greeting itself (no authentication)
+ * and reads its CONNECT request, which names the destination. That
+ * chooses the upstream, and the connection takes a lease on the
+ * least-loaded tunnel to it, starting the ssh process if need be. Once
+ * the lease is granted, ssh-tunneld connects to the tunnel's "ssh -D"
+ * port, repeats the greeting and request there, and from then on
+ * relays both ways; ssh's reply to the request passes straight through.
+ * The lease is released when the connection closes, so the tunnel
+ * stops (or lingers) once the last relayed connection has gone.
+ *
+ * On Linux the data is moved with splice() through a pipe per
+ * direction, so it never passes through user space; elsewhere (or if
+ * splice() is refused) read() and write() are used instead.
+ */
+#define SOCKS_RELAY_CHUNK 65536
+
+enum socks_state {
+    SOCKS_GREETING, /* reading the client's list of methods */
+    SOCKS_REQUEST, /* reading its CONNECT request */
+    SOCKS_WAITING, /* parked on a starting tunnel */
+    SOCKS_CONNECTING, /* connecting to the tunnel's SOCKS5 port */
+    SOCKS_HANDSHAKE, /* reading ssh's choice of method */
+    SOCKS_RELAYING
+};
+
+/* One direction of the relay, from one socket to the other */
+struct socks_direction {
+    int from;
+    int to;
+    int pipe_fds[2]; /* splice() through here; -1 when using buffer */
+    char* buffer;
+    size_t offset;
+    size_t pending; /* bytes read but not yet written */
+    int eof;
+    int done; /* eof passed on as a half-close */
+};
+
+struct socks_session {
+    int client_fd;
+    int proxy_fd; /* to the tunnel's "ssh -D" port, or -1 */
+    enum socks_state state;
+    struct upstream_table* upstreams;
+    struct tunnel* tunnel; /* leased, or waited for */
+    struct waiter waiter;
+    int granted;
+    struct timer fail_timer; /* to close outside tunnel callbacks */
+    /* Greeting, then request, as read from the client; the request
+     * follows a 3-byte greeting when it is sent on to ssh
+     */
+    unsigned char in[3 + 262];
+    size_t in_len;
+    size_t handshake_len;
+    struct socks_direction up; /* client to ssh */
+    struct socks_direction down; /* ssh to client */
+    /* Every open session, for socks_save() */
+    struct socks_session* prev;
+    struct socks_session* next;
+};
+
+/* Start accepting SOCKS5 clients on a listening socket */
+void socks_listen(int listen_fd, struct upstream_table* upstreams);
+
+/* Live upgrade (see upgrade.h): write a "socks" record for each open
+ * session, and pass on its sockets and relay pipes; and take a session
+ * over from such a record, carrying on where it was; a session on a
+ * tunnel that has gone is closed. socks_adopt() returns -1 if the
+ * record is malformed; the session's sockets and pipes are then closed
+ * and its lease given back.
+ */
+void socks_save(FILE* out);
+int socks_adopt(char** fields, size_t n_fields, struct upstream_table* upstreams);
+
+#endif
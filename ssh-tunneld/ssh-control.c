@@ -4,59 +4,132 @@
  * of the source distribution for further details.
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
 
 #include "ssh-control.h"
 #include "logging.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/wait.h>
 #include <signal.h>
 
-pid_t start_ssh_tunnel(char* hostname, char* port, char* proxy_port)
+/* Longest command line (a racer's): 16 arguments, the profile's, the
+ * forwards and NULL
+ */
+#define SSH_MAX_ARGS (17 + 2 * PROFILE_MAX_OPTIONS + 2 * LANE_MAX)
+
+static void append_forwards(char** forwards, char** argv, size_t* argc)
+{
+    for (size_t i = 0; forwards[i] != NULL; ++i)
+        argv[(*argc)++] = forwards[i];
+}
+
+static pid_t spawn_ssh(char** argv)
 {
-    write_log("Starting ssh process.");
-    char* argv[] = {
-        "ssh",
-        "-T",
-        "-n",
-        "-N",
-        "-D",
-        proxy_port,
-        "-p",
-        port,
-        hostname,
-        NULL
-    };
-    
     int process_id = fork();
     if (process_id < 0)
     {
-        write_log("Error while trying to fork ssh process. Exiting.");
+        write_log_error("Error while trying to fork ssh process. Exiting.");
         exit(EXIT_FAILURE);
     }
     if (process_id == 0)
     {
-        /* In child process, execute ssh */
+        /* In child process, execute ssh. If that fails, only
+         * async-signal-safe calls may be made before exiting.
+         */
         if(execvp("ssh", argv) == -1)
         {
-            write_log("Error while trying to exec ssh process. Exiting.");
-            exit(EXIT_FAILURE);
+            write_log_child("Error while trying to exec ssh process. Exiting.");
+            _exit(EXIT_FAILURE);
         }
     }
     /* Only get here if we're in the parent process */
     return process_id;
 }
 
+pid_t start_ssh_tunnel(char* hostname, char* port, char* proxy_port, char* master_path,
+        const struct profile* profile, char** forwards)
+{
+    write_log("Starting ssh process.");
+    char* argv[SSH_MAX_ARGS];
+    size_t argc = 0;
+    argv[argc++] = "ssh";
+    argv[argc++] = "-T";
+    argv[argc++] = "-n";
+    argv[argc++] = "-N";
+    if (master_path != NULL)
+    {
+        /* Clients open channels with "ssh -S master_path -W host:port".
+         * The master must not outlive us, whatever ssh_config says.
+         */
+        argv[argc++] = "-M";
+        argv[argc++] = "-S";
+        argv[argc++] = master_path;
+        argv[argc++] = "-o";
+        argv[argc++] = "ControlPersist=no";
+    }
+    else
+    {
+        argv[argc++] = "-D";
+        argv[argc++] = proxy_port;
+    }
+    if (forwards[0] != NULL)
+    {
+        /* Clients connect to the lanes without asking; they must be ours */
+        argv[argc++] = "-o";
+        argv[argc++] = "ExitOnForwardFailure=yes";
+        append_forwards(forwards, argv, &argc);
+    }
+    profile_append(profile, argv, &argc);
+    argv[argc++] = "-p";
+    argv[argc++] = port;
+    argv[argc++] = hostname;
+    argv[argc] = NULL;
+    return spawn_ssh(argv);
+}
+
+pid_t start_ssh_racer(char* hostname, char* port, char* proxy_port, char* racer_path,
+        const struct profile* profile, char** forwards)
+{
+    write_log("Starting ssh process.");
+    char* argv[SSH_MAX_ARGS];
+    size_t argc = 0;
+    argv[argc++] = "ssh";
+    argv[argc++] = "-T";
+    argv[argc++] = "-n";
+    argv[argc++] = "-N";
+    /* The socket appears once ssh has logged in and set up its
+     * forwarding; a racer that cannot have the ports gives up.
+     */
+    if (proxy_port != NULL)
+    {
+        argv[argc++] = "-D";
+        argv[argc++] = proxy_port;
+    }
+    if (proxy_port != NULL || forwards[0] != NULL)
+    {
+        argv[argc++] = "-o";
+        argv[argc++] = "ExitOnForwardFailure=yes";
+        append_forwards(forwards, argv, &argc);
+    }
+    argv[argc++] = "-M";
+    argv[argc++] = "-S";
+    argv[argc++] = racer_path;
+    argv[argc++] = "-o";
+    argv[argc++] = "ControlPersist=no";
+    profile_append(profile, argv, &argc);
+    argv[argc++] = "-p";
+    argv[argc++] = port;
+    argv[argc++] = hostname;
+    argv[argc] = NULL;
+    return spawn_ssh(argv);
+}
+
 void stop_ssh_tunnel(pid_t process_id)
 {
     write_log("Stopping ssh process.");
     if(kill(process_id, SIGTERM) != 0)
-    {
-        perror("kill");
-        exit(EXIT_FAILURE);
-    }
-    wait(NULL);
+        write_log_warn("Could not signal ssh process %ld. Continuing.", (long) process_id);
 }
 
@@ -9,7 +9,22 @@
 
 #include <sys/types.h>
 
-pid_t start_ssh_tunnel(char* hostname, char* port, char* proxy_port);
+#include "lane.h"
+#include "profile.h"
+
+/* Start "ssh -D proxy_port", or if master_path is not NULL, a
+ * ControlMaster listening on master_path instead; with the options of
+ * profile, if it is not NULL, and the NULL-terminated forwards (as
+ * from lane_args()).
+ */
+pid_t start_ssh_tunnel(char* hostname, char* port, char* proxy_port, char* master_path,
+        const struct profile* profile, char** forwards);
+/* Start a racer for a tunnel (see race.h): a ControlMaster listening
+ * on racer_path once logged in, forwarding proxy_port unless it is NULL
+ */
+pid_t start_ssh_racer(char* hostname, char* port, char* proxy_port, char* racer_path,
+        const struct profile* profile, char** forwards);
+/* Send the ssh process SIGTERM; its exit is noticed through SIGCHLD */
 void stop_ssh_tunnel(pid_t process_id);
 
 #endif
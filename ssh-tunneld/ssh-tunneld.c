@@ -4,8 +4,11 @@
  * of the source distribution for further details.
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,93 +18,370 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
+#include <sys/un.h>
 #include <netdb.h>
 
+#include "activation.h"
+#include "calibrate.h"
+#include "clients.h"
+#include "event.h"
 #include "logging.h"
+#include "metrics.h"
 #include "options.h"
-#include "ssh-control.h"
+#include "prewarm.h"
+#include "socks.h"
+#include "tunnel.h"
+#include "upgrade.h"
+#include "upstream.h"
 
-int tunneld_main(struct program_options* options);
+int tunneld_main(struct program_options* options, struct upstream_table* upstreams,
+        struct activation_socket* inherited, size_t n_inherited);
 
 void sig_handler(int signum);
+void on_signal(int fd, short revents, void* data);
+void reap_children(void);
 
-int test_connection(char* proxy_port);
+/* Signals are written here by sig_handler() and acted on by the event loop */
+static int signal_pipe[2] = { -1, -1 };
+
+int open_tcp_listener(const char* port, int accept_remote, int backlog);
+int open_unix_listener(const char* path, int backlog);
+
+void raise_fd_limit(void);
+
+/* Removed on exit, if we created one */
+static const char* control_socket_path = NULL;
+
+/* Whose ssh processes to stop on exit */
+static struct upstream_table* running_upstreams = NULL;
+
+/* Our listening sockets, to pass on with SIGUSR2 (see upgrade.h) */
+static struct activation_socket listeners[UPGRADE_MAX_LISTENERS];
+static size_t n_listeners = 0;
+static int upgrading = 0; /* taking over from the binary we replace */
+static int owns_control_socket = 0; /* per its state */
+void add_listener(int fd, enum activation_kind kind);
 
 void daemonize(int nofork);
 
+void stop_daemon(void);
+
+/* With -e: exit once idle for that long (checked once a second) */
+#define IDLE_CHECK_INTERVAL_MS 1000
+static struct timer idle_timer;
+static long long idle_since = -1; /* monotonic milliseconds, or -1 if busy */
+void on_idle_check(struct timer* timer, void* data);
+
 int main(int argc, char** argv)
 {
     /* Keep the program options together */
     struct program_options options;
     memset(&options, 0, sizeof(struct program_options));
 
+    upgrade_init(argv);
     process_options(argc, argv, &options);
+    if (options.calibrate)
+        calibrate(options.calibration_filename, options.remote_host, options.remote_port);
+    if (options.calibration_filename != NULL)
+        calibrate_load(options.calibration_filename);
+
+    /* Read the upstream table while errors can still reach the terminal */
+    struct upstream_table upstreams;
+    upstreams_init(&upstreams);
+    if (options.remote_host != NULL)
+        upstreams_add_default(&upstreams, &options);
+    if (options.routes_filename != NULL)
+        upstreams_load(&upstreams, options.routes_filename);
+    if (options.history_filename != NULL)
+        prewarm_load(&upstreams, options.history_filename);
+
+    /* Take over listening sockets from systemd or our launcher; this
+     * must happen before daemonize() changes our pid. After SIGUSR2,
+     * they come instead from the binary we replace, in the same pid.
+     */
+    struct activation_socket inherited[UPGRADE_MAX_LISTENERS];
+    size_t n_inherited = 0;
+    upgrading = upgrade_load();
+    if (upgrading)
+        n_inherited = upgrade_listeners(inherited, &owns_control_socket);
+    else
+        n_inherited = activation_collect(options.inherited_fds, options.socks_port,
+                inherited);
 
-    /* open a logfile */
-    if (options.nofork)
+    /* open a logfile (or log to stderr if not forking) */
+    if (log_open(options.log_filename, options.nofork,
+                options.verbose ? LOG_LEVEL_DEBUG : LOG_LEVEL_INFO) == -1)
     {
-        logfile = stderr;
-    }
-    else if (options.log_filename != NULL)
-    {
-        logfile = fopen(options.log_filename, "a");
-        if (logfile == NULL)
-        {
-            perror("fopen");
-            exit(EXIT_FAILURE);
-        }
+        perror(options.log_filename);
+        exit(EXIT_FAILURE);
     }
-    else
+
+    /* Become a daemon (unless we already are one, being upgraded),
+     * then hand logging to its own thread
+     */
+    if (! upgrading)
+        daemonize(options.nofork);
+    else if (chdir("/") < 0)
     {
-        // No log file
-        logfile = NULL;
+        write_log_error("Could not change directory to /. Exiting.");
+        exit(EXIT_FAILURE);
     }
-
-    /* Become a daemon */
-    daemonize(options.nofork);
+    log_start();
 
     /* Set up signal handlers */
+    if (pipe(signal_pipe) == -1
+            || set_nonblocking(signal_pipe[0]) == -1
+            || set_nonblocking(signal_pipe[1]) == -1
+            || set_cloexec(signal_pipe[0]) == -1
+            || set_cloexec(signal_pipe[1]) == -1
+            || event_add(signal_pipe[0], POLLIN, on_signal, NULL) == -1)
+    {
+        write_log_error("Could not create signal pipe. Exiting.");
+        exit(EXIT_FAILURE);
+    }
     struct sigaction sa;
     memset(&sa, 0, sizeof(struct sigaction));
     sa.sa_handler = sig_handler;
     sigaddset(&(sa.sa_mask), SIGTERM);
-    if (sigaction(SIGTERM, &sa, NULL) != 0)
+    sigaddset(&(sa.sa_mask), SIGHUP);
+    sigaddset(&(sa.sa_mask), SIGCHLD);
+    sigaddset(&(sa.sa_mask), SIGUSR2);
+    if (sigaction(SIGTERM, &sa, NULL) != 0 || sigaction(SIGHUP, &sa, NULL) != 0
+            || sigaction(SIGUSR2, &sa, NULL) != 0)
+    {
+        write_log_error("Could not set signal handlers. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    /* ssh processes that exit are reaped by the event loop too */
+    sa.sa_flags = SA_NOCLDSTOP | SA_RESTART;
+    if (sigaction(SIGCHLD, &sa, NULL) != 0)
+    {
+        write_log_error("Could not set SIGCHLD handler. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    sa.sa_flags = 0;
+
+    /* A client that hangs up before reading its reply must not kill us */
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) != 0)
     {
-        write_log("Could not set signal handler for SIGTERM. Exiting.");
+        write_log_error("Could not ignore SIGPIPE. Exiting.");
         exit(EXIT_FAILURE);
     }
 
+    /* Blocked across an upgrade; now they have somewhere to go */
+    sigprocmask(SIG_UNBLOCK, &(sa.sa_mask), NULL);
+
     /* Run tunneld_main() */
-    tunneld_main(&options);
+    tunneld_main(&options, &upstreams, inherited, n_inherited);
 
     return 0;
 }
 
 void sig_handler(int signum)
 {
-    switch(signum)
+    /* Only note the signal; logging and exit() are not safe here */
+    int saved_errno = errno;
+    unsigned char byte = (unsigned char) signum;
+    ssize_t n = write(signal_pipe[1], &byte, 1);
+    (void) n;
+    errno = saved_errno;
+}
+
+void on_signal(int fd, short revents, void* data)
+{
+    (void) revents;
+    (void) data;
+    unsigned char signals[16];
+    int upgrade = 0;
+    ssize_t n = read(fd, signals, sizeof(signals));
+    for (ssize_t i = 0; i < n; ++i)
+    {
+        switch(signals[i])
+        {
+            case SIGHUP:
+                log_reopen();
+                write_log("Received SIGHUP. Reopened log file.");
+                break;
+            case SIGTERM:
+                write_log("Received SIGTERM. Stopping.");
+                stop_daemon();
+                break;
+            case SIGCHLD:
+                reap_children();
+                break;
+            case SIGUSR2:
+                upgrade = 1;
+                break;
+            default:
+                break;
+        }
+    }
+    /* After the rest, which the new binary would not see */
+    if (upgrade)
+    {
+        write_log("Received SIGUSR2. Upgrading.");
+        upgrade_exec(running_upstreams, listeners, n_listeners, control_socket_path != NULL);
+    }
+}
+
+void add_listener(int fd, enum activation_kind kind)
+{
+    listeners[n_listeners].fd = fd;
+    listeners[n_listeners].kind = kind;
+    n_listeners += 1;
+}
+
+void reap_children(void)
+{
+    /* One byte in the pipe may stand for several exits */
+    int status = 0;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        struct tunnel* tunnel = NULL;
+        if (running_upstreams != NULL)
+            tunnel = upstreams_find_pid(running_upstreams, pid);
+        if (tunnel != NULL && tunnel->ssh_process != pid)
+            race_exited(tunnel, pid, status);
+        else if (tunnel != NULL)
+            tunnel_exited(tunnel, status);
+    }
+}
+
+void stop_daemon(void)
+{
+    if (control_socket_path != NULL)
+        unlink(control_socket_path);
+    /* Send the ssh processes SIGTERM too; not the whole process
+     * group, which with -f is the caller's too.
+     */
+    if (running_upstreams != NULL)
+        upstreams_signal(running_upstreams, SIGTERM);
+    exit(EXIT_SUCCESS); /* the log is flushed at exit */
+}
+
+void on_idle_check(struct timer* timer, void* data)
+{
+    struct program_options* options = data;
+    long long now = event_now();
+    if (clients_open() > 0 || metrics.socks_active > 0
+            || ! upstreams_idle(running_upstreams))
+    {
+        idle_since = -1;
+    }
+    else if (idle_since == -1)
+    {
+        idle_since = now;
+    }
+    else if (now - idle_since >= options->idle_exit_seconds * 1000LL)
+    {
+        /* Connections that arrive from now on wait in the listen
+         * queue, for the next ssh-tunneld to accept.
+         */
+        write_logf("Idle for %d seconds. Exiting.", options->idle_exit_seconds);
+        stop_daemon();
+    }
+    timer_start(timer, IDLE_CHECK_INTERVAL_MS, on_idle_check, options);
+}
+
+int tunneld_main(struct program_options* options, struct upstream_table* upstreams,
+        struct activation_socket* inherited, size_t n_inherited)
+{
+    metrics_init();
+
+    /* the "ssh -D ..." process(es) for each upstream, and their clients */
+    upstreams_start(upstreams, options);
+    running_upstreams = upstreams;
+
+    /* Inherited sockets replace the ones we would open ourselves */
+    int inherited_kinds[3] = { 0, 0, 0 };
+    for (size_t i = 0; i < n_inherited; ++i)
+        inherited_kinds[inherited[i].kind] = 1;
+
+    int tcp_fd = -1;
+    int unix_fd = -1;
+    int socks_fd = -1;
+    if (strcmp(options->tunnel_port, "none") != 0
+            && ! inherited_kinds[ACTIVATION_CONTROL_TCP])
+        tcp_fd = open_tcp_listener(options->tunnel_port, options->accept_remote,
+                options->listen_backlog);
+    if (options->control_socket != NULL && ! inherited_kinds[ACTIVATION_CONTROL_UNIX])
+        unix_fd = open_unix_listener(options->control_socket, options->listen_backlog);
+
+    if (tcp_fd == -1 && unix_fd == -1 && ! inherited_kinds[ACTIVATION_CONTROL_TCP]
+            && ! inherited_kinds[ACTIVATION_CONTROL_UNIX])
+    {
+        write_log_error("No control port or socket to listen on. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    /* Like "ssh -D", the SOCKS5 port is for local programs only */
+    if (options->socks_port != NULL && ! inherited_kinds[ACTIVATION_SOCKS])
+        socks_fd = open_tcp_listener(options->socks_port, 0, options->listen_backlog);
+
+    raise_fd_limit();
+
+    /*
+     * Everything from here on is driven by the event loop. Clients that
+     * ask for the tunnel while it is starting are parked on it and all
+     * answered once it is ready; everything else is answered at once.
+     */
+    clients_init(options->lease_ttl_seconds);
+    if (tcp_fd != -1)
+    {
+        clients_listen(tcp_fd, upstreams, 0);
+        add_listener(tcp_fd, ACTIVATION_CONTROL_TCP);
+    }
+    if (unix_fd != -1)
+    {
+        clients_listen(unix_fd, upstreams, 1);
+        add_listener(unix_fd, ACTIVATION_CONTROL_UNIX);
+    }
+    if (socks_fd != -1)
+    {
+        socks_listen(socks_fd, upstreams);
+        add_listener(socks_fd, ACTIVATION_SOCKS);
+    }
+    for (size_t i = 0; i < n_inherited; ++i)
+    {
+        if (inherited[i].kind == ACTIVATION_SOCKS)
+            socks_listen(inherited[i].fd, upstreams);
+        else
+            clients_listen(inherited[i].fd, upstreams,
+                    inherited[i].kind == ACTIVATION_CONTROL_UNIX);
+        add_listener(inherited[i].fd, inherited[i].kind);
+    }
+    if (upgrading)
+    {
+        /* Carry on with the ssh processes, connections and sessions of
+         * the binary we replace, and reap what exited in between
+         */
+        if (owns_control_socket)
+            control_socket_path = options->control_socket;
+        upgrade_adopt(upstreams);
+        reap_children();
+    }
+    else if (n_inherited > 0)
     {
-        case SIGTERM:
-            write_log("Received SIGTERM. Stopping.");
-            kill(0, SIGTERM); /* Send child processes the same signal */
-            exit(EXIT_SUCCESS);
-        default:
-            break;
+        write_logf("tunneld: Using %zu inherited listening socket(s).", n_inherited);
     }
+    prewarm_start(upstreams);
+    if (options->idle_exit_seconds > 0)
+        timer_start(&idle_timer, IDLE_CHECK_INTERVAL_MS, on_idle_check, options);
+    write_log("tunneld: Started.");
+    event_loop();
+
+    return 0;
 }
 
-int tunneld_main(struct program_options* options)
+int open_tcp_listener(const char* port, int accept_remote, int backlog)
 {
     int socket_fd = 0; /* listen on socket_fd... */
-    int new_fd = 0; /*  ... accept new connections -> new_fd */
     struct addrinfo *result = 0; /* Structure to hold addresses from getaddrinfo() */
     struct addrinfo *rp = 0; /* Pointer for our convenience */
     struct addrinfo hints; /* hints to getaddrinfo() */
-    
-    char buf[1]; /* future-proof; if we have bigger messages we can expand this here */
-    unsigned int n_connected = 0; /* number of clients using the SSH tunnel */
-    pid_t ssh_tunnel_process = 0; /* process ID for "ssh -D ..." */
 
     /* Hint that we want to bind to any interface...
      * Would be better to bind to local interface only (by default)
@@ -109,7 +389,7 @@ int tunneld_main(struct program_options* options)
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
-    if (options->accept_remote)
+    if (accept_remote)
     {
         hints.ai_flags = AI_PASSIVE;
     }
@@ -121,17 +401,17 @@ int tunneld_main(struct program_options* options)
 
     /* Use the hints to find address(es) to bind to */
     int gai_result = 0;
-    if (options->accept_remote)
+    if (accept_remote)
     {
-        gai_result = getaddrinfo(NULL, options->tunnel_port, &hints, &result);
+        gai_result = getaddrinfo(NULL, port, &hints, &result);
     }
     else
     {
-        gai_result = getaddrinfo("127.0.0.1", options->tunnel_port, &hints, &result);
+        gai_result = getaddrinfo("127.0.0.1", port, &hints, &result);
     }
     if(gai_result != 0)
     {
-        write_log("Error looking up address. Exiting.");
+        write_log_error("Error looking up address. Exiting.");
         exit(EXIT_FAILURE);
     }
 
@@ -144,7 +424,7 @@ int tunneld_main(struct program_options* options)
 
         if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
         {
-            write_log("Error in setsockopt. Exiting.");
+            write_log_error("Error in setsockopt. Exiting.");
             exit(EXIT_FAILURE);
         }
 
@@ -156,133 +436,73 @@ int tunneld_main(struct program_options* options)
     if (rp == NULL)
     {
         /* no address was successfully bound */
-        write_log("Error binding to port. Exiting.");
+        write_log_error("Error binding to port. Exiting.");
         exit(EXIT_FAILURE);
     }
 
     freeaddrinfo(result); /* don't need this any more */
 
-    /* listen on the port we just bound
-     * Keep a maximum of 10 pending connections in the "backlog"
+    /* listen on the port we just bound, with a backlog large
+     * enough to absorb a burst of clients between event loop passes
      */
-    if (listen(socket_fd, 10) == -1)
+    if (listen(socket_fd, backlog) == -1)
     {
-        write_log("Error listening on port. Exiting.");
+        write_log_error("Error listening on port. Exiting.");
         exit(EXIT_FAILURE);
     }
 
-    write_log("tunneld: Started.");
-    /* now accept connections and deal with them one by one */
-    while(1)
-    {
-        /*
-         * No need to use select()... accept() blocks until a client connects, and
-         * the processing time is typically short. In any case, if another client
-         * connects while we're in the sleep() period waiting for an ssh tunnel,
-         * we want to wait anyway, rather than creating a second tunnel!
-         */
-        new_fd = accept(socket_fd, NULL, NULL); /* don't care about client address */
-        if (new_fd == -1)
-        {
-            write_log("Error while accepting connection. Continuing.");
-            continue;
-        }
-
-        /* Read a message from the client to see what it wants us to do */
-        if(recv(new_fd, buf, 1, 0) != 1)
-        {
-            write_log("Received unexpected data. Closing connection.");
-            close(new_fd);
-            continue;
-        }
-
-        if (buf[0] == 'C') /* client wants to connect through tunnel */
-        {
-            if (n_connected == 0)
-            {
-                /* no tunnel exists; start it */
-                ssh_tunnel_process = start_ssh_tunnel(options->remote_host, options->remote_port, options->proxy_port);
-                /* Test the connection every second until we
-                 * successfully connect to it
-                 */
-                do {
-                    sleep(1);
-                } while ( test_connection(options->proxy_port) );
-            }
-            n_connected += 1;
-            write_log_connect(n_connected);
-
-            /* tell the client it can proceed */
-            char message = 'C';
-            send(new_fd, &message, sizeof(message), 0);
-        }
-        else if (buf[0] == 'D') /* client telling us it is done with tunnel */
-        {
-            n_connected -= 1;
-            write_log_connect(n_connected);
-            if (n_connected <= 0)
-            {
-                /* nothing using the tunnel any more; stop it. */
-                n_connected = 0;
-                stop_ssh_tunnel(ssh_tunnel_process);
-                ssh_tunnel_process = 0;
-            }
-            /* tell the client we acted on their message */
-            char message = 'D';
-            send(new_fd, &message, sizeof(message), 0);
-        }
-        close(new_fd); /* close client socket */
-    }
-
-    return 0;
+    return socket_fd;
 }
 
-int test_connection(char* proxy_port)
+int open_unix_listener(const char* path, int backlog)
 {
-    const char* hostname = "127.0.0.1";
-
-    struct addrinfo hints;
-    struct addrinfo *result = 0;
-    struct addrinfo *rp = 0;
-    int socket_fd = 0;
-    int gai_return_value = 0;
-
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0;
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        write_log_error("Control socket path is too long. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
 
-    if ((gai_return_value = getaddrinfo(hostname, proxy_port, &hints, &result)) != 0)
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd == -1)
     {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(gai_return_value));
+        write_log_error("Error creating control socket. Exiting.");
         exit(EXIT_FAILURE);
     }
 
-    /*
-     * Try each address returned by getaddrinfo
-     * in turn
+    /* Remove a socket left behind by an earlier run. The umask set
+     * by daemonize() makes the new one accessible to our user only.
      */
-    for(rp = result; rp != NULL; rp = rp->ai_next)
+    unlink(path);
+    if (bind(socket_fd, (struct sockaddr*) &address, sizeof(struct sockaddr_un)) == -1)
     {
-        socket_fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (socket_fd == -1)
-            continue;
-
-        if (connect(socket_fd, rp->ai_addr, rp->ai_addrlen) != -1)
-        {
-            /* Successfully connected */
-            freeaddrinfo(result);
-            close(socket_fd);
-            return 0;
-        }
-
-        close(socket_fd);
+        write_log_error("Error binding control socket. Exiting.");
+        exit(EXIT_FAILURE);
     }
+    if (listen(socket_fd, backlog) == -1)
+    {
+        write_log_error("Error listening on control socket. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    control_socket_path = path;
+    return socket_fd;
+}
 
-    /* If we got here, we didn't manage to connect successfully */
-    freeaddrinfo(result); /* no longer need the address structures */
-    return 1;
+void raise_fd_limit(void)
+{
+    /* Each control connection holds a descriptor while it waits for
+     * the tunnel, so allow as many as the hard limit permits.
+     */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+            write_log_warn("Could not raise open file limit. Continuing.");
+    }
 }
 
 void daemonize(int nofork)
@@ -314,7 +534,7 @@ void daemonize(int nofork)
         pid_t session_id = setsid();
         if (session_id < 0)
         {
-            write_log("Could not create session. Exiting.");
+            write_log_error("Could not create session. Exiting.");
             exit(EXIT_FAILURE);
         }
     }
@@ -324,13 +544,25 @@ void daemonize(int nofork)
     /* Change the working directory */
     if (chdir("/") < 0)
     {
-        write_log("Could not change directory to /. Exiting.");
+        write_log_error("Could not change directory to /. Exiting.");
         exit(EXIT_FAILURE);
     }
 
-    /* Close standard file descriptors */
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
+    /* Point the standard file descriptors at /dev/null rather than
+     * closing them, so that no socket is given their numbers: what is
+     * written to stderr (by the binary we exec on SIGUSR2, say) must
+     * not end up in a client's connection.
+     */
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd == -1)
+    {
+        write_log_error("Could not open /dev/null. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
     if (! nofork)
-        close(STDERR_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+    if (null_fd > STDERR_FILENO)
+        close(null_fd);
 }
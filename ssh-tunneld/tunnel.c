@@ -0,0 +1,483 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "tunnel.h"
+#include "event.h"
+#include "logging.h"
+#include "metrics.h"
+#include "race.h"
+#include "ssh-control.h"
+#include "upstream.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+static void tunnel_start(struct tunnel* tunnel);
+static void tunnel_stop(struct tunnel* tunnel);
+static void tunnel_ready(struct tunnel* tunnel);
+static void on_probe_ready(struct probe* probe, void* data);
+static void on_linger_expired(struct timer* timer, void* data);
+static void respawn_later(struct tunnel* tunnel);
+static void on_respawn(struct timer* timer, void* data);
+static void on_start_timeout(struct timer* timer, void* data);
+static void on_kill_timeout(struct timer* timer, void* data);
+
+void tunnel_init(struct tunnel* tunnel, struct program_options* options,
+        struct upstream* upstream, unsigned int port)
+{
+    memset(tunnel, 0, sizeof(struct tunnel));
+    tunnel->state = TUNNEL_STOPPED;
+    tunnel->options = options;
+    tunnel->upstream = upstream;
+    tunnel->port = port;
+    snprintf(tunnel->proxy_port, sizeof(tunnel->proxy_port), "%u", port);
+    if (options->master_dir != NULL)
+    {
+        if (proto_master_path(tunnel->master_path, sizeof(tunnel->master_path),
+                    options->master_dir, port) != 0
+                || probe_init_local(&tunnel->probe, tunnel->master_path) != 0)
+        {
+            write_log_error("ControlMaster socket path too long. Exiting.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* Resolve the SOCKS5 address once, rather than on every probe */
+    else if (probe_init(&tunnel->probe, "127.0.0.1", tunnel->proxy_port) != 0)
+    {
+        write_log_error("Error looking up proxy address. Exiting.");
+        exit(EXIT_FAILURE);
+    }
+    if (upstream->n_candidates > 1)
+        race_init(tunnel);
+}
+
+static void grant(struct tunnel* tunnel, struct waiter* waiter)
+{
+    metrics.leases += 1;
+    if (metrics.leases > metrics.peak_leases)
+        metrics.peak_leases = metrics.leases;
+    tunnel->n_connected += 1;
+    write_log_connect(tunnel->n_connected);
+    waiter->ready(waiter);
+}
+
+/* A pre-warmed tunnel is being stopped without having been used */
+static void prewarm_missed(struct tunnel* tunnel)
+{
+    if (! tunnel->prewarmed)
+        return;
+    tunnel->prewarmed = 0;
+    metrics.prewarm_misses += 1;
+}
+
+int tunnel_prewarm(struct tunnel* tunnel, long long hold_ms)
+{
+    if (tunnel->prewarmed)
+    {
+        tunnel->prewarm_hold_ms = hold_ms;
+        if (tunnel->state == TUNNEL_LINGERING)
+            timer_start(&tunnel->linger_timer, hold_ms, on_linger_expired, tunnel);
+        return 0;
+    }
+    if (tunnel->state != TUNNEL_STOPPED)
+        return 0;
+    tunnel->prewarmed = 1;
+    tunnel->prewarm_hold_ms = hold_ms;
+    metrics.prewarm_starts += 1;
+    tunnel_start(tunnel);
+    return 1;
+}
+
+void tunnel_acquire(struct tunnel* tunnel, struct waiter* waiter)
+{
+    /* for the usage history */
+    tunnel->upstream->prewarm.wanted = 1;
+    if (tunnel->prewarmed)
+    {
+        tunnel->prewarmed = 0;
+        metrics.prewarm_hits += 1;
+        if (tunnel->state == TUNNEL_LINGERING)
+        {
+            timer_stop(&tunnel->linger_timer);
+            tunnel->state = TUNNEL_READY;
+        }
+        write_logf("Using pre-warmed tunnel to %s on port %s.",
+                tunnel->upstream->name, tunnel->proxy_port);
+    }
+    else if (tunnel->state == TUNNEL_STOPPED)
+    {
+        metrics.cold_starts += 1;
+    }
+    if (tunnel->state == TUNNEL_LINGERING)
+    {
+        /* reuse the idle tunnel before it is torn down */
+        timer_stop(&tunnel->linger_timer);
+        tunnel->state = TUNNEL_READY;
+        metrics.linger_hits += 1;
+        write_logf("Reusing lingering tunnel (%llu reuses, %llu expiries).",
+                metrics.linger_hits, metrics.linger_expiries);
+    }
+    if (tunnel->state == TUNNEL_READY)
+    {
+        histogram_observe(&metrics.queue_wait, 0);
+        grant(tunnel, waiter);
+        return;
+    }
+
+    /* Park the waiter until the tunnel is up */
+    waiter->next = NULL;
+    waiter->prev = tunnel->waiters_tail;
+    if (tunnel->waiters_tail != NULL)
+        tunnel->waiters_tail->next = waiter;
+    else
+        tunnel->waiters_head = waiter;
+    tunnel->waiters_tail = waiter;
+    waiter->waiting = 1;
+    waiter->parked_usec = event_now_usec();
+    tunnel->n_waiting += 1;
+
+    /* no tunnel exists; start it. One that is still stopping is
+     * started again once its ssh process has exited.
+     */
+    if (tunnel->state == TUNNEL_STOPPED)
+        tunnel_start(tunnel);
+}
+
+static void tunnel_start(struct tunnel* tunnel)
+{
+    struct upstream* upstream = tunnel->upstream;
+    char* master_path = NULL;
+    if (tunnel->master_path[0] != '\0')
+    {
+        /* ssh will not listen on a socket left by a previous master */
+        master_path = tunnel->master_path;
+        unlink(master_path);
+    }
+    tunnel->started_usec = event_now_usec();
+    tunnel->cpu_ticks = 0;
+    tunnel->cpu_load = 0.0;
+    tunnel->state = TUNNEL_STARTING;
+    metrics.ssh_starts += 1;
+    if (upstream->n_candidates > 1)
+    {
+        /* the winner is probed once it is known */
+        race_start(tunnel);
+    }
+    else
+    {
+        char* forwards[2 * LANE_MAX + 1];
+        char buffers[LANE_MAX][LANE_ARG_MAX];
+        lane_args(tunnel, forwards, buffers);
+        tunnel->ssh_process = start_ssh_tunnel(upstream->remote_host, upstream->remote_port,
+                tunnel->proxy_port, master_path, upstream->profile, forwards);
+        probe_start(&tunnel->probe, on_probe_ready, tunnel);
+    }
+    timer_start(&tunnel->start_timer,
+            (long long) tunnel->options->startup_timeout_seconds * 1000,
+            on_start_timeout, tunnel);
+}
+
+/* Tell every parked client that the tunnel could not be started */
+static void fail_waiters(struct tunnel* tunnel, const char* reason)
+{
+    write_log_warn("Tunnel to %s on port %s failed: %s. Failing %u waiting client(s).",
+            tunnel->upstream->name, tunnel->proxy_port, reason, tunnel->n_waiting);
+    while (tunnel->waiters_head != NULL)
+    {
+        struct waiter* waiter = tunnel->waiters_head;
+        tunnel_cancel(tunnel, waiter);
+        waiter->failed(waiter, reason);
+    }
+}
+
+static void on_start_timeout(struct timer* timer, void* data)
+{
+    struct tunnel* tunnel = data;
+    (void) timer;
+    char reason[64];
+    snprintf(reason, sizeof(reason), "ssh not ready after %d seconds",
+            tunnel->options->startup_timeout_seconds);
+    metrics.start_timeouts += 1;
+    fail_waiters(tunnel, reason);
+    /* unless a failed client's leaving has stopped it already */
+    if (tunnel->state != TUNNEL_STARTING)
+        return;
+    tunnel_stop(tunnel);
+    /* Sessions still holding leases keep it wanted: give up on this
+     * ssh and back off before the next (once it has gone, if it was
+     * running; see tunnel_exited())
+     */
+    if (tunnel->state == TUNNEL_STOPPED && tunnel->n_connected > 0)
+        respawn_later(tunnel);
+}
+
+void tunnel_cancel(struct tunnel* tunnel, struct waiter* waiter)
+{
+    if (! waiter->waiting)
+        return;
+    if (waiter->prev != NULL)
+        waiter->prev->next = waiter->next;
+    else
+        tunnel->waiters_head = waiter->next;
+    if (waiter->next != NULL)
+        waiter->next->prev = waiter->prev;
+    else
+        tunnel->waiters_tail = waiter->prev;
+    waiter->prev = waiter->next = NULL;
+    waiter->waiting = 0;
+    tunnel->n_waiting -= 1;
+}
+
+void tunnel_release(struct tunnel* tunnel)
+{
+    if (tunnel->n_connected == 0)
+    {
+        write_log_warn("Release requested with no active connections. Ignoring.");
+        return;
+    }
+    tunnel->n_connected -= 1;
+    metrics.leases -= 1;
+    write_log_connect(tunnel->n_connected);
+    if (tunnel->n_connected > 0 || tunnel->n_waiting > 0)
+        return;
+
+    if (tunnel->state == TUNNEL_READY && tunnel->options->linger_seconds > 0)
+    {
+        /* nothing using the tunnel any more; keep it for a while in
+         * case another client turns up, then stop it.
+         */
+        tunnel->state = TUNNEL_LINGERING;
+        timer_start(&tunnel->linger_timer,
+                (long long) tunnel->options->linger_seconds * 1000,
+                on_linger_expired, tunnel);
+        write_logf("No clients; keeping tunnel for %d seconds.",
+                tunnel->options->linger_seconds);
+        return;
+    }
+    tunnel_stop(tunnel);
+}
+
+static void tunnel_stop(struct tunnel* tunnel)
+{
+    prewarm_missed(tunnel);
+    race_stop(tunnel);
+    probe_stop(&tunnel->probe);
+    timer_stop(&tunnel->start_timer);
+    timer_stop(&tunnel->linger_timer);
+    timer_stop(&tunnel->respawn_timer);
+    if (tunnel->ssh_process <= 0)
+    {
+        /* died already, and was waiting to be started again */
+        tunnel->state = TUNNEL_STOPPED;
+        return;
+    }
+    /* Don't wait for it here; tunnel_exited() finishes the job */
+    metrics.ssh_stops += 1;
+    stop_ssh_tunnel(tunnel->ssh_process);
+    tunnel->state = TUNNEL_STOPPING;
+    timer_start(&tunnel->kill_timer, TUNNEL_KILL_TIMEOUT_MS, on_kill_timeout, tunnel);
+}
+
+static void on_kill_timeout(struct timer* timer, void* data)
+{
+    struct tunnel* tunnel = data;
+    (void) timer;
+    if (tunnel->state != TUNNEL_STOPPING || tunnel->ssh_process <= 0)
+        return;
+    write_log_warn("ssh process %ld ignored SIGTERM. Killing it.", (long) tunnel->ssh_process);
+    metrics.ssh_kills += 1;
+    kill(tunnel->ssh_process, SIGKILL);
+}
+
+void tunnel_raced(struct tunnel* tunnel, pid_t ssh_process)
+{
+    /* Its socket appeared only once its forwarding was set up (or it
+     * is the master socket itself), so there is nothing to probe
+     */
+    long long elapsed = event_now_usec() - tunnel->started_usec;
+    tunnel->ssh_process = ssh_process;
+    tunnel->last_ready_usec = elapsed;
+    histogram_observe(&metrics.time_to_ready, elapsed);
+    tunnel_ready(tunnel);
+}
+
+void tunnel_exited(struct tunnel* tunnel, int status)
+{
+    prewarm_missed(tunnel);
+    tunnel->ssh_process = 0;
+    timer_stop(&tunnel->kill_timer);
+    timer_stop(&tunnel->start_timer);
+    probe_stop(&tunnel->probe);
+    if (tunnel->master_path[0] != '\0')
+        unlink(tunnel->master_path);
+
+    if (tunnel->state == TUNNEL_STOPPING)
+    {
+        /* as asked; but clients may have turned up meanwhile, or (if
+         * it timed out starting) still hold leases
+         */
+        tunnel->state = TUNNEL_STOPPED;
+        if (tunnel->n_connected > 0)
+            respawn_later(tunnel);
+        else if (tunnel->n_waiting > 0)
+            tunnel_start(tunnel);
+        return;
+    }
+
+    metrics.ssh_exits += 1;
+    char reason[64];
+    if (WIFSIGNALED(status))
+        snprintf(reason, sizeof(reason), "ssh killed by signal %d", WTERMSIG(status));
+    else
+        snprintf(reason, sizeof(reason), "ssh exited with status %d", WEXITSTATUS(status));
+    timer_stop(&tunnel->linger_timer);
+    if (tunnel->n_waiting > 0)
+    {
+        /* It never came up (ssh exits early when it cannot reach or
+         * log in to the host); don't keep the clients waiting.
+         */
+        metrics.start_failures += 1;
+        fail_waiters(tunnel, reason);
+    }
+    else
+    {
+        write_log_warn("ssh process for %s on port %s: %s.",
+                tunnel->upstream->name, tunnel->proxy_port, reason);
+    }
+    if (tunnel->n_connected == 0 && tunnel->n_waiting == 0)
+    {
+        tunnel->state = TUNNEL_STOPPED;
+        return;
+    }
+    respawn_later(tunnel);
+}
+
+/* Still wanted: start it again, backing off if it keeps dying */
+static void respawn_later(struct tunnel* tunnel)
+{
+    if (event_now_usec() - tunnel->started_usec >= TUNNEL_RESPAWN_MAX_MS * 1000LL)
+        tunnel->respawn_delay_ms = 0;
+    if (tunnel->respawn_delay_ms == 0)
+        tunnel->respawn_delay_ms = TUNNEL_RESPAWN_MIN_MS;
+    else if (tunnel->respawn_delay_ms * 2 < TUNNEL_RESPAWN_MAX_MS)
+        tunnel->respawn_delay_ms *= 2;
+    else
+        tunnel->respawn_delay_ms = TUNNEL_RESPAWN_MAX_MS;
+    tunnel->state = TUNNEL_STARTING;
+    write_logf("Restarting ssh process in %lld ms.", tunnel->respawn_delay_ms);
+    timer_start(&tunnel->respawn_timer, tunnel->respawn_delay_ms, on_respawn, tunnel);
+}
+
+void tunnel_adopt(struct tunnel* tunnel, enum tunnel_state state, pid_t ssh_process,
+        unsigned int n_connected, long long started_usec, long long respawn_delay_ms)
+{
+    tunnel->ssh_process = ssh_process;
+    tunnel->n_connected = n_connected;
+    tunnel->started_usec = started_usec;
+    tunnel->respawn_delay_ms = respawn_delay_ms;
+    metrics.leases += n_connected;
+    if (metrics.leases > metrics.peak_leases)
+        metrics.peak_leases = metrics.leases;
+    tunnel->state = state;
+    switch (state)
+    {
+        case TUNNEL_STARTING:
+            if (ssh_process <= 0)
+            {
+                timer_start(&tunnel->respawn_timer, respawn_delay_ms, on_respawn, tunnel);
+                break;
+            }
+            probe_start(&tunnel->probe, on_probe_ready, tunnel);
+            timer_start(&tunnel->start_timer,
+                    (long long) tunnel->options->startup_timeout_seconds * 1000,
+                    on_start_timeout, tunnel);
+            break;
+        case TUNNEL_LINGERING:
+            timer_start(&tunnel->linger_timer,
+                    (long long) tunnel->options->linger_seconds * 1000,
+                    on_linger_expired, tunnel);
+            break;
+        case TUNNEL_STOPPING:
+            timer_start(&tunnel->kill_timer, TUNNEL_KILL_TIMEOUT_MS, on_kill_timeout, tunnel);
+            break;
+        default:
+            break;
+    }
+}
+
+static void on_respawn(struct timer* timer, void* data)
+{
+    struct tunnel* tunnel = data;
+    (void) timer;
+    if (tunnel->n_connected == 0 && tunnel->n_waiting == 0)
+    {
+        /* the clients that wanted it have given up meanwhile */
+        tunnel->state = TUNNEL_STOPPED;
+        return;
+    }
+    metrics.ssh_respawns += 1;
+    tunnel_start(tunnel);
+}
+
+static void on_linger_expired(struct timer* timer, void* data)
+{
+    struct tunnel* tunnel = data;
+    (void) timer;
+    if (tunnel->prewarmed)
+    {
+        write_logf("Pre-warmed tunnel to %s on port %s unused. Stopping.",
+                tunnel->upstream->name, tunnel->proxy_port);
+        tunnel_stop(tunnel);
+        return;
+    }
+    metrics.linger_expiries += 1;
+    write_logf("Linger period expired (%llu reuses, %llu expiries).",
+            metrics.linger_hits, metrics.linger_expiries);
+    tunnel_stop(tunnel);
+}
+
+static void tunnel_ready(struct tunnel* tunnel)
+{
+    timer_stop(&tunnel->start_timer);
+    tunnel->state = TUNNEL_READY;
+    /* Release every parked client in arrival order. Unlink each one
+     * before calling back, since the callback may free the waiter.
+     */
+    long long now = event_now_usec();
+    while (tunnel->waiters_head != NULL)
+    {
+        struct waiter* waiter = tunnel->waiters_head;
+        histogram_observe(&metrics.queue_wait, now - waiter->parked_usec);
+        tunnel_cancel(tunnel, waiter);
+        grant(tunnel, waiter);
+    }
+    if (tunnel->prewarmed)
+    {
+        /* nobody has asked for it yet; wait for a while */
+        tunnel->state = TUNNEL_LINGERING;
+        timer_start(&tunnel->linger_timer, tunnel->prewarm_hold_ms,
+                on_linger_expired, tunnel);
+    }
+}
+
+static void on_probe_ready(struct probe* probe, void* data)
+{
+    struct tunnel* tunnel = data;
+    tunnel->last_ready_usec = probe->elapsed_usec;
+    histogram_observe(&metrics.time_to_ready, probe->elapsed_usec);
+    write_logf("Tunnel to %s on port %s ready after %lld.%03lld ms (%u probes).",
+            tunnel->upstream->name, tunnel->proxy_port,
+            probe->elapsed_usec / 1000, probe->elapsed_usec % 1000,
+            probe->attempts);
+    tunnel_ready(tunnel);
+}
@@ -0,0 +1,135 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_TUNNEL_H
+#define SSH_TUNNELD_TUNNEL_H
+
+#include <sys/types.h>
+
+#include "options.h"
+#include "probe.h"
+#include "protocol.h"
+#include "race.h"
+
+struct upstream;
+
+enum tunnel_state {
+    TUNNEL_STOPPED,
+    TUNNEL_STARTING,
+    TUNNEL_READY,
+    TUNNEL_LINGERING, /* ready, but unused; stops when linger_timer fires */
+    TUNNEL_STOPPING /* ssh has been sent SIGTERM, and not yet reaped */
+};
+
+/*
+ * The ssh process is supervised: its exit is noticed through SIGCHLD.
+ * Clients waiting for it to start are failed at once. If the tunnel is
+ * still leased, it goes back to TUNNEL_STARTING (so new clients wait
+ * rather than being told to use a dead port) and ssh is started again
+ * after a delay, which begins at TUNNEL_RESPAWN_MIN_MS and doubles with
+ * each further failure up to TUNNEL_RESPAWN_MAX_MS; a process that
+ * stayed up that long resets the delay. When the tunnel is stopped, ssh is sent SIGTERM,
+ * and SIGKILL if it has not exited TUNNEL_KILL_TIMEOUT_MS later.
+ */
+#define TUNNEL_RESPAWN_MIN_MS 100
+#define TUNNEL_RESPAWN_MAX_MS 30000
+#define TUNNEL_KILL_TIMEOUT_MS 5000
+
+/*
+ * A client waiting for the tunnel. Waiters are parked on the tunnel
+ * while the ssh process starts and are all released together once
+ * the SOCKS5 port accepts connections. If ssh exits first, or is not
+ * ready within the startup deadline (-w), they are all failed instead,
+ * with a reason to pass on to the client.
+ */
+struct waiter;
+typedef void (*waiter_callback)(struct waiter* waiter);
+typedef void (*waiter_fail_callback)(struct waiter* waiter, const char* reason);
+
+struct waiter {
+    waiter_callback ready;
+    waiter_fail_callback failed;
+    struct waiter* prev;
+    struct waiter* next;
+    int waiting;
+    long long parked_usec; /* when it started waiting, for metrics */
+};
+
+struct tunnel {
+    enum tunnel_state state;
+    pid_t ssh_process;
+    unsigned int n_connected; /* number of clients using the tunnel */
+    unsigned int n_waiting;
+    struct waiter* waiters_head;
+    struct waiter* waiters_tail;
+    struct probe probe;
+    long long last_ready_usec; /* time-to-ready of the last cold start */
+    struct timer linger_timer;
+    /* Started ahead of demand (see prewarm.h), and not yet used; it
+     * lingers for prewarm_hold_ms once ready
+     */
+    int prewarmed;
+    long long prewarm_hold_ms;
+    /* Supervision of the ssh process */
+    long long started_usec;
+    struct timer start_timer; /* startup deadline */
+    long long respawn_delay_ms; /* last backoff; 0 after a healthy run */
+    struct timer respawn_timer;
+    struct timer kill_timer;
+    struct race race; /* with several candidate hosts */
+    /* SOCKS5 port of this tunnel's ssh process */
+    unsigned int port;
+    char proxy_port[8];
+    /* Its ControlMaster socket instead, with -m; "" otherwise */
+    char master_path[PROTO_MASTER_PATH_MAX];
+    /* CPU use of the ssh process, sampled by the pool */
+    unsigned long cpu_ticks;
+    double cpu_load; /* fraction of one CPU */
+    struct upstream* upstream; /* where the ssh process connects to */
+    struct program_options* options;
+};
+
+void tunnel_init(struct tunnel* tunnel, struct program_options* options,
+        struct upstream* upstream, unsigned int port);
+
+/* Take a lease on the tunnel, starting it if necessary. waiter->ready
+ * is called (possibly immediately) once the lease has been granted, or
+ * waiter->failed if the tunnel could not be started.
+ */
+void tunnel_acquire(struct tunnel* tunnel, struct waiter* waiter);
+
+/* Start the tunnel before any client asks for it, and stop it again
+ * if none has by hold_ms after it is ready. If it was pre-warmed
+ * already and is still unused, that hold is renewed instead. Returns 1
+ * if the tunnel was started.
+ */
+int tunnel_prewarm(struct tunnel* tunnel, long long hold_ms);
+
+/* Stop waiting; used when a parked client goes away */
+void tunnel_cancel(struct tunnel* tunnel, struct waiter* waiter);
+
+/* Give back a lease; the tunnel stops when the last one is released,
+ * or after the linger period if one is configured.
+ */
+void tunnel_release(struct tunnel* tunnel);
+
+/* The race to start the tunnel has been won by ssh_process, which is
+ * ready
+ */
+void tunnel_raced(struct tunnel* tunnel, pid_t ssh_process);
+
+/* The ssh process has exited (and been reaped) with status */
+void tunnel_exited(struct tunnel* tunnel, int status);
+
+/* Take over a tunnel left in state by the binary we replaced (see
+ * upgrade.h), with its ssh process (0 if waiting to respawn) and its
+ * n_connected leases; waiters are parked again with tunnel_acquire().
+ * Its timers start afresh.
+ */
+void tunnel_adopt(struct tunnel* tunnel, enum tunnel_state state, pid_t ssh_process,
+        unsigned int n_connected, long long started_usec, long long respawn_delay_ms);
+
+#endif
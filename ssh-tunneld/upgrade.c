@@ -0,0 +1,509 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* memfd_create() */
+#endif
+#define _XOPEN_SOURCE 600
+
+#include "upgrade.h"
+#include "clients.h"
+#include "event.h"
+#include "logging.h"
+#include "socks.h"
+#include "tunnel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+/* How we were started, to start the new binary the same way */
+static char** saved_argv = NULL;
+static char* saved_cwd = NULL;
+
+/* The state left by the binary we replace, one record per line */
+static char* state = NULL;
+static char** lines = NULL;
+static size_t n_lines = 0;
+
+/* Descriptors passed on, to take back if the exec fails */
+static int* passed_fds = NULL;
+static size_t n_passed = 0;
+static size_t passed_cap = 0;
+static int pass_failed = 0;
+
+void upgrade_init(char** argv)
+{
+    char cwd[4096];
+    saved_argv = argv;
+    if (getcwd(cwd, sizeof(cwd)) != NULL)
+        saved_cwd = strdup(cwd);
+}
+
+int upgrade_number(const char* field, long long* value)
+{
+    char* end = NULL;
+    errno = 0;
+    long long result = strtoll(field, &end, 10);
+    if (errno != 0 || end == field || *end != '\0')
+        return -1;
+    *value = result;
+    return 0;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+void upgrade_put_hex(FILE* out, const void* data, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    const unsigned char* bytes = data;
+    if (len == 0)
+    {
+        fputc('-', out);
+        return;
+    }
+    for (size_t i = 0; i < len; ++i)
+    {
+        fputc(digits[bytes[i] >> 4], out);
+        fputc(digits[bytes[i] & 0xf], out);
+    }
+}
+
+int upgrade_get_hex(const char* field, unsigned char** data, size_t* len)
+{
+    *data = NULL;
+    *len = 0;
+    if (strcmp(field, "-") == 0)
+        return 0;
+    size_t n = strlen(field);
+    if (n == 0 || n % 2 != 0)
+        return -1;
+    unsigned char* bytes = malloc(n / 2);
+    if (bytes == NULL)
+        return -1;
+    for (size_t i = 0; i < n / 2; ++i)
+    {
+        int high = hex_digit(field[2 * i]);
+        int low = hex_digit(field[2 * i + 1]);
+        if (high == -1 || low == -1)
+        {
+            free(bytes);
+            return -1;
+        }
+        bytes[i] = (unsigned char) (high << 4 | low);
+    }
+    *data = bytes;
+    *len = n / 2;
+    return 0;
+}
+
+/* Split a record into its fields, in place. Returns how many there
+ * are, or 0 for a blank line or one with too many.
+ */
+static size_t split_record(char* line, char** fields)
+{
+    size_t n = 0;
+    char* p = line;
+    while (1)
+    {
+        while (*p == ' ')
+            *p++ = '\0';
+        if (*p == '\0')
+            return n;
+        if (n == UPGRADE_MAX_FIELDS)
+            return 0;
+        fields[n++] = p;
+        while (*p != ' ' && *p != '\0')
+            ++p;
+    }
+}
+
+int upgrade_load(void)
+{
+    const char* value = getenv(UPGRADE_STATE_ENV);
+    long long fd = -1;
+    if (value == NULL)
+        return 0;
+    if (upgrade_number(value, &fd) == -1 || fd < 0 || fd > INT_MAX)
+    {
+        fprintf(stderr, "Invalid %s. Exiting.\n", UPGRADE_STATE_ENV);
+        exit(EXIT_FAILURE);
+    }
+    unsetenv(UPGRADE_STATE_ENV); /* not for the ssh processes */
+
+    /* Read it all in, from the start */
+    size_t len = 0;
+    size_t cap = 65536;
+    state = malloc(cap);
+    if (state == NULL || lseek((int) fd, 0, SEEK_SET) == -1)
+    {
+        perror("upgrade state");
+        exit(EXIT_FAILURE);
+    }
+    while (1)
+    {
+        if (len + 1 == cap)
+        {
+            char* bigger = realloc(state, cap * 2);
+            if (bigger == NULL)
+            {
+                perror("upgrade state");
+                exit(EXIT_FAILURE);
+            }
+            state = bigger;
+            cap *= 2;
+        }
+        ssize_t n = read((int) fd, state + len, cap - len - 1);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1)
+        {
+            perror("upgrade state");
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0)
+            break;
+        len += (size_t) n;
+    }
+    close((int) fd);
+    state[len] = '\0';
+
+    /* One record per line */
+    for (size_t i = 0; i < len; ++i)
+    {
+        if (state[i] == '\n')
+            n_lines += 1;
+    }
+    lines = malloc((n_lines + 1) * sizeof(char*));
+    if (lines == NULL)
+    {
+        perror("upgrade state");
+        exit(EXIT_FAILURE);
+    }
+    n_lines = 0;
+    char* line = state;
+    for (char* newline; (newline = strchr(line, '\n')) != NULL; line = newline + 1)
+    {
+        *newline = '\0';
+        lines[n_lines++] = line;
+    }
+    if (n_lines == 0 || strncmp(lines[0], "ssh-tunneld-state ", 18) != 0)
+    {
+        fprintf(stderr, "Upgrade state is not ours. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+    return 1;
+}
+
+size_t upgrade_listeners(struct activation_socket* sockets, int* owned)
+{
+    char* fields[UPGRADE_MAX_FIELDS];
+    size_t n_sockets = 0;
+    *owned = 0;
+    for (size_t i = 1; i < n_lines; ++i)
+    {
+        long long values[3];
+        if (strncmp(lines[i], "listener ", 9) != 0)
+            continue;
+        if (split_record(lines[i], fields) != 4
+                || upgrade_number(fields[1], &values[0]) == -1
+                || upgrade_number(fields[2], &values[1]) == -1
+                || upgrade_number(fields[3], &values[2]) == -1
+                || values[0] < 0 || values[1] < ACTIVATION_CONTROL_TCP
+                || values[1] > ACTIVATION_SOCKS || n_sockets == UPGRADE_MAX_LISTENERS)
+        {
+            fprintf(stderr, "Malformed listener in upgrade state. Exiting.\n");
+            exit(EXIT_FAILURE);
+        }
+        sockets[n_sockets].fd = (int) values[0];
+        sockets[n_sockets].kind = (enum activation_kind) values[1];
+        n_sockets += 1;
+        if (values[2])
+            *owned = 1;
+    }
+    return n_sockets;
+}
+
+static int adopt_tunnel(struct upstream_table* table, char** fields, size_t n_fields)
+{
+    /* tunnel port state pid leases started_usec respawn_delay_ms */
+    long long values[6];
+    if (n_fields != 7)
+        return -1;
+    for (size_t i = 0; i < 6; ++i)
+    {
+        if (upgrade_number(fields[1 + i], &values[i]) == -1)
+            return -1;
+    }
+    if (values[1] < TUNNEL_STOPPED || values[1] > TUNNEL_STOPPING || values[3] < 0)
+        return -1;
+    struct tunnel* tunnel = upstreams_find_port(table, (unsigned int) values[0]);
+    if (tunnel == NULL)
+    {
+        /* Gone from the routes file meanwhile; no one can use it now */
+        if (values[2] > 0)
+        {
+            write_log_warn("No tunnel on port %lld any more. Stopping its ssh process.",
+                    values[0]);
+            kill((pid_t) values[2], SIGTERM);
+        }
+        return 0;
+    }
+    tunnel_adopt(tunnel, (enum tunnel_state) values[1], (pid_t) values[2],
+            (unsigned int) values[3], values[4], values[5]);
+    return 0;
+}
+
+static int adopt_candidate(struct upstream_table* table, char** fields, size_t n_fields)
+{
+    /* candidate upstream host ready_usec */
+    long long ready_usec;
+    if (n_fields != 4 || upgrade_number(fields[3], &ready_usec) == -1)
+        return -1;
+    struct upstream* upstream = upstreams_find_name(table, fields[1]);
+    for (size_t i = 0; upstream != NULL && i < upstream->n_candidates; ++i)
+    {
+        if (strcmp(upstream->candidates[i].host, fields[2]) == 0)
+            upstream->candidates[i].ready_usec = ready_usec;
+    }
+    return 0;
+}
+
+static int adopt_racer(char** fields, size_t n_fields)
+{
+    /* The race starts again; this one is not our tunnel's yet */
+    long long pid;
+    if (n_fields != 2 || upgrade_number(fields[1], &pid) == -1 || pid <= 0)
+        return -1;
+    kill((pid_t) pid, SIGTERM);
+    return 0;
+}
+
+void upgrade_adopt(struct upstream_table* table)
+{
+    if (state == NULL)
+        return;
+
+    /* The tunnels come first, so that their leases are counted before
+     * anyone parked on them is parked again.
+     */
+    char* fields[UPGRADE_MAX_FIELDS];
+    size_t n_tunnels = 0;
+    size_t n_clients = 0;
+    size_t n_sessions = 0;
+    for (size_t i = 1; i < n_lines; ++i)
+    {
+        size_t n_fields = split_record(lines[i], fields);
+        int result = 0;
+        if (n_fields == 0 || strcmp(fields[0], "listener") == 0)
+            continue;
+        if (strcmp(fields[0], "tunnel") == 0)
+        {
+            result = adopt_tunnel(table, fields, n_fields);
+            n_tunnels += 1;
+        }
+        else if (strcmp(fields[0], "racer") == 0)
+        {
+            result = adopt_racer(fields, n_fields);
+        }
+        else if (strcmp(fields[0], "candidate") == 0)
+        {
+            result = adopt_candidate(table, fields, n_fields);
+        }
+        else if (strcmp(fields[0], "client") == 0)
+        {
+            result = clients_adopt(fields, n_fields, table);
+            n_clients += 1;
+        }
+        else if (strcmp(fields[0], "socks") == 0)
+        {
+            result = socks_adopt(fields, n_fields, table);
+            n_sessions += 1;
+        }
+        else
+        {
+            write_log_debug("Skipping unknown upgrade record \"%s\".", fields[0]);
+            continue;
+        }
+        if (result == -1)
+            write_log_warn("Malformed \"%s\" record in upgrade state. Skipping it.", fields[0]);
+    }
+    write_logf("tunneld: Upgraded; took over %zu tunnel(s), %zu control connection(s) "
+            "and %zu SOCKS5 session(s).", n_tunnels, n_clients, n_sessions);
+    free(lines);
+    free(state);
+    lines = NULL;
+    state = NULL;
+}
+
+void upgrade_pass_fd(int fd)
+{
+    if (n_passed == passed_cap)
+    {
+        size_t new_cap = passed_cap ? passed_cap * 2 : 64;
+        int* bigger = realloc(passed_fds, new_cap * sizeof(int));
+        if (bigger == NULL)
+        {
+            pass_failed = 1;
+            return;
+        }
+        passed_fds = bigger;
+        passed_cap = new_cap;
+    }
+    int flags = fcntl(fd, F_GETFD, 0);
+    if (flags == -1 || fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC) == -1)
+    {
+        pass_failed = 1;
+        return;
+    }
+    passed_fds[n_passed++] = fd;
+}
+
+static void take_back_fds(void)
+{
+    for (size_t i = 0; i < n_passed; ++i)
+        set_cloexec(passed_fds[i]);
+    n_passed = 0;
+}
+
+/* Anonymous, and so gone with the last descriptor for it */
+static int create_state_file(void)
+{
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    int fd = memfd_create("ssh-tunneld-state", 0);
+    if (fd != -1)
+        return fd;
+#endif
+    char path[] = "/tmp/ssh-tunneld-state.XXXXXX";
+    int temp_fd = mkstemp(path);
+    if (temp_fd != -1)
+        unlink(path);
+    return temp_fd;
+}
+
+static int save_state(int fd, struct upstream_table* table,
+        const struct activation_socket* listeners, size_t n_listeners, int owned)
+{
+    int copy = dup(fd);
+    FILE* out = copy == -1 ? NULL : fdopen(copy, "w");
+    if (out == NULL)
+    {
+        if (copy != -1)
+            close(copy);
+        return -1;
+    }
+    n_passed = 0;
+    pass_failed = 0;
+    fprintf(out, "ssh-tunneld-state %d\n", UPGRADE_STATE_VERSION);
+    for (size_t i = 0; i < n_listeners; ++i)
+    {
+        fprintf(out, "listener %d %d %d\n", listeners[i].fd, (int) listeners[i].kind,
+                owned && listeners[i].kind == ACTIVATION_CONTROL_UNIX);
+        upgrade_pass_fd(listeners[i].fd);
+    }
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+    {
+        struct upstream* upstream = table->upstreams[i];
+        struct pool* pool = &upstream->pool;
+        for (unsigned int j = 0; j < pool->size; ++j)
+        {
+            const struct tunnel* tunnel = &pool->members[j];
+            if (tunnel->state == TUNNEL_STOPPED)
+                continue;
+            fprintf(out, "tunnel %u %d %ld %u %lld %lld\n", tunnel->port, (int) tunnel->state,
+                    (long) tunnel->ssh_process, tunnel->n_connected, tunnel->started_usec,
+                    tunnel->respawn_delay_ms);
+            race_save(tunnel, out);
+        }
+        for (size_t j = 0; upstream->n_candidates > 1 && j < upstream->n_candidates; ++j)
+        {
+            fprintf(out, "candidate %s %s %lld\n", upstream->name,
+                    upstream->candidates[j].host, upstream->candidates[j].ready_usec);
+        }
+    }
+    clients_save(out);
+    socks_save(out);
+    int failed = ferror(out) || pass_failed;
+    if (fclose(out) != 0 || failed || lseek(fd, 0, SEEK_SET) == -1)
+    {
+        take_back_fds();
+        return -1;
+    }
+    return 0;
+}
+
+void upgrade_exec(struct upstream_table* table, const struct activation_socket* listeners,
+        size_t n_listeners, int owned)
+{
+    int fd = create_state_file();
+    if (fd == -1 || save_state(fd, table, listeners, n_listeners, owned) == -1)
+    {
+        write_log_error("Could not save state for upgrade: %s. Carrying on.", strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    char value[16];
+    snprintf(value, sizeof(value), "%d", fd);
+
+    /* Signals that arrive from now on wait for the new binary's
+     * handlers (the mask and pending signals survive exec); ssh
+     * processes that exit meanwhile are reaped once it has taken
+     * them over.
+     */
+    sigset_t signals;
+    sigset_t old_mask;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &signals, &old_mask);
+
+    write_logf("Upgrading: executing %s, passing on %zu descriptor(s).",
+            saved_argv[0], n_passed);
+    log_stop();
+    if (setenv(UPGRADE_STATE_ENV, value, 1) == 0)
+    {
+        /* Relative paths (the binary's, -l, -r) mean what they did;
+         * if the directory has gone, an absolute one may still work
+         */
+        if (saved_cwd != NULL && chdir(saved_cwd) != 0)
+            write_log_warn("Could not change directory to %s. Continuing.", saved_cwd);
+        if (strchr(saved_argv[0], '/') != NULL)
+            execv(saved_argv[0], saved_argv);
+        else
+            execvp(saved_argv[0], saved_argv);
+    }
+
+    /* Still here: carry on as before */
+    int error = errno;
+    log_start();
+    write_log_error("Could not execute %s: %s. Carrying on.", saved_argv[0], strerror(error));
+    if (chdir("/") != 0)
+        write_log_warn("Could not change directory to /. Continuing.");
+    unsetenv(UPGRADE_STATE_ENV);
+    take_back_fds();
+    close(fd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
@@ -0,0 +1,86 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_UPGRADE_H
+#define SSH_TUNNELD_UPGRADE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "activation.h"
+#include "upstream.h"
+
+/*
+ * Live upgrade (SIGUSR2). ssh-tunneld writes its state to an anonymous
+ * file (a memfd on Linux), clears close-on-exec on every descriptor
+ * the state refers to, and executes its binary again, in the same
+ * process, with the same arguments (from the directory it was started
+ * in), passing the file's descriptor in UPGRADE_STATE_ENV. So the ssh
+ * processes stay its children, and the listening sockets, control
+ * connections and SOCKS5 sessions (relay pipes and all) stay open: the
+ * new binary takes them over where the old one left them, and clients
+ * see no difference. If the binary cannot be executed, the old one
+ * carries on.
+ *
+ * The state is text, one record per line, each a keyword and fields
+ * separated by spaces; byte strings are hex ("-" if empty):
+ *
+ *   ssh-tunneld-state 2
+ *   listener <fd> <activation_kind> <owned>
+ *   tunnel <port> <state> <pid> <leases> <started_usec> <respawn_delay_ms>
+ *   racer <pid>    see race_save()
+ *   candidate <upstream> <host> <ready_usec>
+ *   client ...    see clients_save()
+ *   socks ...     see socks_save()
+ *
+ * Tunnels come before the connections that lease them. Unknown
+ * keywords are skipped, so that a newer binary can take over from an
+ * older one (version 1 client records, without fast lanes, are still
+ * read). Metrics start again from zero, but the racing times of
+ * candidate hosts are kept.
+ */
+#define UPGRADE_STATE_ENV "SSH_TUNNELD_STATE"
+#define UPGRADE_STATE_VERSION 2
+#define UPGRADE_MAX_FIELDS 480 /* a client record carries its leases */
+#define UPGRADE_MAX_LISTENERS (ACTIVATION_MAX_FDS + 3)
+
+/* Remember how we were started; call first thing in main() */
+void upgrade_init(char** argv);
+
+/* Read the state left by the binary we replace, if we are an upgrade;
+ * returns 1 if so. Call before daemonize(), which is then skipped.
+ */
+int upgrade_load(void);
+
+/* The listening sockets in the loaded state, as if inherited (at most
+ * UPGRADE_MAX_LISTENERS). *owned is set if the old binary created the
+ * control socket (and so should remove it on exit).
+ */
+size_t upgrade_listeners(struct activation_socket* sockets, int* owned);
+
+/* Take over the tunnels, connections and sessions in the loaded state */
+void upgrade_adopt(struct upstream_table* table);
+
+/* Save the state and execute the binary again. Returns only if that
+ * failed, with everything as it was.
+ */
+void upgrade_exec(struct upstream_table* table, const struct activation_socket* listeners,
+        size_t n_listeners, int owned);
+
+/* For clients_save() and socks_save(): pass fd on to the new binary,
+ * and write len bytes of data as hex
+ */
+void upgrade_pass_fd(int fd);
+void upgrade_put_hex(FILE* out, const void* data, size_t len);
+
+/* For clients_adopt() and socks_adopt(): parse a number, or a hex
+ * string into a new buffer (NULL, with *len 0, for "-"); both return
+ * -1 if the field is malformed.
+ */
+int upgrade_number(const char* field, long long* value);
+int upgrade_get_hex(const char* field, unsigned char** data, size_t* len);
+
+#endif
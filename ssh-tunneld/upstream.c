@@ -0,0 +1,372 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "upstream.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+void upstreams_init(struct upstream_table* table)
+{
+    memset(table, 0, sizeof(struct upstream_table));
+    routes_init(&table->routes);
+}
+
+static struct upstream* find_by_name(struct upstream_table* table, const char* name)
+{
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+    {
+        if (strcmp(table->upstreams[i]->name, name) == 0)
+            return table->upstreams[i];
+    }
+    return NULL;
+}
+
+static struct upstream* add_upstream(struct upstream_table* table, const char* name)
+{
+    struct upstream** upstreams = realloc(table->upstreams,
+            (table->n_upstreams + 1) * sizeof(struct upstream*));
+    struct upstream* upstream = calloc(1, sizeof(struct upstream));
+    if (upstreams == NULL || upstream == NULL)
+    {
+        fprintf(stderr, "Unable to allocate memory. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+    upstream->name = checked_strdup(name);
+    upstream->pool_size = 1;
+    table->upstreams = upstreams;
+    table->upstreams[table->n_upstreams++] = upstream;
+    return upstream;
+}
+
+/* Returns -1 if there are too many */
+static int add_candidate(struct upstream* upstream, const char* host)
+{
+    if (upstream->n_candidates == RACE_MAX_CANDIDATES)
+        return -1;
+    upstream->candidates[upstream->n_candidates++].host = checked_strdup(host);
+    upstream->remote_host = upstream->candidates[0].host;
+    return 0;
+}
+
+void upstreams_add_default(struct upstream_table* table, struct program_options* options)
+{
+    struct upstream* upstream = add_upstream(table, "default");
+    for (int i = 0; i < options->n_remote_hosts; ++i)
+    {
+        if (add_candidate(upstream, options->remote_hosts[i]) != 0)
+        {
+            fprintf(stderr, "At most %d hostnames can be given.\n", RACE_MAX_CANDIDATES);
+            exit(EXIT_FAILURE);
+        }
+    }
+    upstream->remote_port = options->remote_port;
+    upstream->proxy_port = options->proxy_port;
+    upstream->pool_size = options->pool_size;
+    table->fallback = upstream;
+}
+
+static void config_error(const char* filename, int line_number, const char* message)
+{
+    fprintf(stderr, "%s:%d: %s\n", filename, line_number, message);
+    exit(EXIT_FAILURE);
+}
+
+static long parse_number(const char* text, long maximum)
+{
+    char* end = NULL;
+    long value = text ? strtol(text, &end, 10) : 0;
+    if (text == NULL || end == text || *end != '\0' || value <= 0 || value > maximum)
+        return -1;
+    return value;
+}
+
+void upstreams_load(struct upstream_table* table, const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    char line[1024];
+    int line_number = 0;
+    const char* separators = " \t\r\n";
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number += 1;
+        char* keyword = strtok(line, separators);
+        if (keyword == NULL || keyword[0] == '#')
+            continue;
+
+        char* name = strtok(NULL, separators);
+        if (name == NULL)
+            config_error(filename, line_number, "Missing upstream name.");
+
+        if (strcmp(keyword, "upstream") == 0)
+        {
+            if (find_by_name(table, name) != NULL)
+                config_error(filename, line_number, "Duplicate upstream name.");
+            char* host = strtok(NULL, separators);
+            if (host == NULL)
+                config_error(filename, line_number, "Missing hostname.");
+            struct upstream* upstream = add_upstream(table, name);
+            for (char* next = host; host != NULL; host = next)
+            {
+                next = strchr(host, ',');
+                if (next != NULL)
+                    *next++ = '\0';
+                if (host[0] == '\0' || add_candidate(upstream, host) != 0)
+                    config_error(filename, line_number, "Invalid list of hostnames.");
+            }
+            upstream->remote_port = checked_strdup("22");
+
+            char* setting;
+            while ((setting = strtok(NULL, separators)) != NULL)
+            {
+                char* value = strtok(NULL, separators);
+                if (strcmp(setting, "port") == 0 && parse_number(value, 65535) > 0)
+                {
+                    free(upstream->remote_port);
+                    upstream->remote_port = checked_strdup(value);
+                }
+                else if (strcmp(setting, "proxy") == 0 && parse_number(value, 65535) > 0)
+                {
+                    upstream->proxy_port = checked_strdup(value);
+                }
+                else if (strcmp(setting, "pool") == 0 && parse_number(value, 1024) > 0)
+                {
+                    upstream->pool_size = (int) parse_number(value, 1024);
+                }
+                else if (strcmp(setting, "profile") == 0 && value != NULL
+                        && profile_find(value) != NULL)
+                {
+                    upstream->profile = profile_find(value);
+                }
+                else
+                {
+                    config_error(filename, line_number, "Invalid upstream setting.");
+                }
+            }
+            if (upstream->proxy_port == NULL)
+                config_error(filename, line_number, "Upstream needs a proxy port.");
+        }
+        else if (strcmp(keyword, "route") == 0)
+        {
+            struct upstream* upstream = find_by_name(table, name);
+            if (upstream == NULL)
+                config_error(filename, line_number, "Unknown upstream.");
+            char* pattern;
+            while ((pattern = strtok(NULL, separators)) != NULL)
+            {
+                if (routes_add(&table->routes, pattern, upstream) != 0)
+                    config_error(filename, line_number, "Invalid route.");
+            }
+        }
+        else if (strcmp(keyword, "warm") == 0)
+        {
+            struct upstream* upstream = find_by_name(table, name);
+            if (upstream == NULL)
+                config_error(filename, line_number, "Unknown upstream.");
+            char* minute = strtok(NULL, separators);
+            char* hour = strtok(NULL, separators);
+            char* weekday = strtok(NULL, separators);
+            if (prewarm_add_schedule(&upstream->prewarm, minute, hour, weekday) != 0
+                    || strtok(NULL, separators) != NULL)
+                config_error(filename, line_number, "Invalid schedule.");
+        }
+        else if (strcmp(keyword, "lane") == 0)
+        {
+            struct upstream* upstream = find_by_name(table, name);
+            if (upstream == NULL)
+                config_error(filename, line_number, "Unknown upstream.");
+            char* host = strtok(NULL, separators);
+            long port = parse_number(strtok(NULL, separators), 65535);
+            long local_port = parse_number(strtok(NULL, separators), 65535);
+            if (host == NULL || strlen(host) > 255 || port < 0 || local_port < 0
+                    || strtok(NULL, separators) != NULL)
+                config_error(filename, line_number, "Invalid lane.");
+            if (lane_add(upstream, host, (unsigned int) port, (unsigned int) local_port) != 0)
+                config_error(filename, line_number, "Too many lanes.");
+        }
+        else if (strcmp(keyword, "default") == 0)
+        {
+            table->fallback = find_by_name(table, name);
+            if (table->fallback == NULL)
+                config_error(filename, line_number, "Unknown upstream.");
+        }
+        else
+        {
+            config_error(filename, line_number, "Unknown keyword.");
+        }
+    }
+    fclose(file);
+
+    if (table->n_upstreams == 0)
+    {
+        fprintf(stderr, "%s: No upstreams defined.\n", filename);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int overlaps(long first, long last, long other_first, long other_last)
+{
+    return first <= other_last && other_first <= last;
+}
+
+/* Are the local ports of the upstream's lane (one per pool member)
+ * out of range, or used by anything else?
+ */
+static int lane_clashes(struct upstream_table* table, const struct upstream* upstream,
+        const struct lane* lane, long control_port, long socks_port)
+{
+    long first = lane->local_port;
+    long last = first + upstream->pool_size - 1;
+    if (first <= 0 || last > 65535 || overlaps(first, last, control_port, control_port)
+            || overlaps(first, last, socks_port, socks_port))
+        return 1;
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+    {
+        const struct upstream* other = table->upstreams[i];
+        long proxy_first = strtol(other->proxy_port, NULL, 10);
+        if (overlaps(first, last, proxy_first, proxy_first + other->pool_size - 1))
+            return 1;
+        for (size_t j = 0; j < other->n_lanes; ++j)
+        {
+            const struct lane* other_lane = &other->lanes[j];
+            if (other_lane != lane && overlaps(first, last, other_lane->local_port,
+                        other_lane->local_port + other->pool_size - 1))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+void upstreams_start(struct upstream_table* table, struct program_options* options)
+{
+    routes_compile(&table->routes);
+
+    long control_port = strtol(options->tunnel_port, NULL, 10);
+    long socks_port = options->socks_port != NULL ? strtol(options->socks_port, NULL, 10) : -1;
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+    {
+        struct upstream* upstream = table->upstreams[i];
+        long first = strtol(upstream->proxy_port, NULL, 10);
+        long last = first + upstream->pool_size - 1;
+        if (first <= 0 || last > 65535)
+        {
+            write_log_error("Invalid proxy port range for upstream %s. Exiting.", upstream->name);
+            exit(EXIT_FAILURE);
+        }
+        if (control_port >= first && control_port <= last)
+        {
+            write_log_error("Proxy ports of upstream %s overlap the control port. Exiting.",
+                    upstream->name);
+            exit(EXIT_FAILURE);
+        }
+        if (socks_port >= first && socks_port <= last)
+        {
+            write_log_error("Proxy ports of upstream %s overlap the SOCKS5 port. Exiting.",
+                    upstream->name);
+            exit(EXIT_FAILURE);
+        }
+        for (size_t j = 0; j < i; ++j)
+        {
+            struct upstream* other = table->upstreams[j];
+            long other_first = strtol(other->proxy_port, NULL, 10);
+            long other_last = other_first + other->pool_size - 1;
+            if (first <= other_last && other_first <= last)
+            {
+                write_log_error("Proxy ports of upstreams %s and %s overlap. Exiting.",
+                        other->name, upstream->name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (size_t j = 0; j < upstream->n_lanes; ++j)
+        {
+            if (lane_clashes(table, upstream, &upstream->lanes[j], control_port, socks_port))
+            {
+                write_log_error("Lane ports from %u of upstream %s overlap other ports. Exiting.",
+                        upstream->lanes[j].local_port, upstream->name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (upstream->profile == NULL)
+            upstream->profile = options->profile;
+        pool_init(&upstream->pool, options, upstream);
+    }
+}
+
+struct upstream* upstreams_route(struct upstream_table* table, const char* host)
+{
+    struct upstream* upstream = routes_lookup(&table->routes, host);
+    return upstream != NULL ? upstream : table->fallback;
+}
+
+struct upstream* upstreams_find_name(struct upstream_table* table, const char* name)
+{
+    return find_by_name(table, name);
+}
+
+struct tunnel* upstreams_find_port(struct upstream_table* table, unsigned int port)
+{
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+    {
+        struct tunnel* tunnel = pool_find(&table->upstreams[i]->pool, port);
+        if (tunnel != NULL)
+            return tunnel;
+    }
+    return NULL;
+}
+
+struct tunnel* upstreams_find_pid(struct upstream_table* table, pid_t pid)
+{
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+    {
+        struct pool* pool = &table->upstreams[i]->pool;
+        for (unsigned int j = 0; j < pool->size; ++j)
+        {
+            if (pool->members[j].ssh_process == pid
+                    || race_has_pid(&pool->members[j], pid))
+                return &pool->members[j];
+        }
+    }
+    return NULL;
+}
+
+void upstreams_signal(struct upstream_table* table, int signum)
+{
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+    {
+        struct pool* pool = &table->upstreams[i]->pool;
+        for (unsigned int j = 0; j < pool->size; ++j)
+        {
+            if (pool->members[j].ssh_process > 0)
+                kill(pool->members[j].ssh_process, signum);
+            race_signal(&pool->members[j], signum); /* still starting */
+        }
+    }
+}
+
+int upstreams_idle(struct upstream_table* table)
+{
+    for (size_t i = 0; i < table->n_upstreams; ++i)
+    {
+        struct pool* pool = &table->upstreams[i]->pool;
+        for (unsigned int j = 0; j < pool->size; ++j)
+        {
+            if (pool->members[j].state != TUNNEL_STOPPED)
+                return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,98 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_UPSTREAM_H
+#define SSH_TUNNELD_UPSTREAM_H
+
+#include <stddef.h>
+
+#include <sys/types.h>
+
+#include "lane.h"
+#include "options.h"
+#include "pool.h"
+#include "prewarm.h"
+#include "profile.h"
+#include "routes.h"
+
+/*
+ * An upstream is one jump host, with its own pool of "ssh -D"
+ * processes (and so its own leases), started and stopped on demand
+ * independently of every other upstream.
+ */
+struct upstream {
+    char* name;
+    char* remote_host; /* the first candidate */
+    char* remote_port;
+    char* proxy_port; /* first port of the pool */
+    int pool_size;
+    const struct profile* profile; /* ssh options; NULL for none */
+    struct pool pool;
+    struct prewarm prewarm;
+    /* Equivalent jump hosts, raced when there are several (see race.h) */
+    struct candidate candidates[RACE_MAX_CANDIDATES];
+    size_t n_candidates;
+    /* "ssh -L" forwards to hot destinations (see lane.h) */
+    struct lane lanes[LANE_MAX];
+    size_t n_lanes;
+};
+
+/*
+ * All upstreams, and the routes that choose between them by the
+ * destination a client is going to. Destinations that match no route
+ * use the fallback upstream.
+ */
+struct upstream_table {
+    struct upstream** upstreams;
+    size_t n_upstreams;
+    struct upstream* fallback;
+    struct route_table routes;
+};
+
+void upstreams_init(struct upstream_table* table);
+
+/* Add the upstream given on the command line, named "default" */
+void upstreams_add_default(struct upstream_table* table, struct program_options* options);
+
+/*
+ * Read upstreams and routes from a file. Exits with a message on
+ * stderr if the file cannot be read or contains an error. Syntax:
+ *
+ *   upstream <name> <hostname>[,<hostname>...] [port <n>] proxy <n> [pool <n>]
+ *            [profile <bulk | interactive | lossy-link>]    see profile.h
+ *   route <name> <domain-suffix | address[/prefix-length]> ...
+ *   default <name>
+ *   warm <name> <minute> <hour> <day-of-week>    see prewarm.h
+ *   lane <name> <hostname> <port> <local-port>    see lane.h
+ *
+ * Blank lines and lines starting with '#' are ignored.
+ */
+void upstreams_load(struct upstream_table* table, const char* filename);
+
+/* Compile the routes and set up each upstream's pool; upstreams
+ * without a profile of their own get the -o one
+ */
+void upstreams_start(struct upstream_table* table, struct program_options* options);
+
+/* The upstream serving destination host (NULL if none does) */
+struct upstream* upstreams_route(struct upstream_table* table, const char* host);
+
+/* The upstream called name, or NULL */
+struct upstream* upstreams_find_name(struct upstream_table* table, const char* name);
+
+/* The tunnel, in any upstream, whose proxy port is port */
+struct tunnel* upstreams_find_port(struct upstream_table* table, unsigned int port);
+
+/* The tunnel whose ssh process (or one of whose racers) is pid, if any */
+struct tunnel* upstreams_find_pid(struct upstream_table* table, pid_t pid);
+
+/* Send signum to every running ssh process, racers included */
+void upstreams_signal(struct upstream_table* table, int signum);
+
+/* Are all tunnels stopped (so none is leased, waited for or lingering)? */
+int upstreams_idle(struct upstream_table* table);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "wheel.h"
+
+#include <string.h>
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_MAX_TICKS ((1ULL << (WHEEL_SLOT_BITS * WHEEL_LEVELS)) - 1)
+
+static void on_tick(struct timer* timer, void* data);
+
+void wheel_init(struct wheel* wheel, long long tick_ms)
+{
+    memset(wheel, 0, sizeof(struct wheel));
+    wheel->tick_ms = tick_ms;
+    wheel->origin_ms = event_now();
+}
+
+static unsigned long long current_tick(const struct wheel* wheel)
+{
+    return (unsigned long long) ((event_now() - wheel->origin_ms) / wheel->tick_ms);
+}
+
+/* Put an entry in the slot for its expiry: the lowest level whose
+ * span reaches that far from now.
+ */
+static void place(struct wheel* wheel, struct wheel_entry* entry)
+{
+    unsigned long long delta = entry->expires - wheel->now;
+    unsigned int level = 0;
+    while (level + 1 < WHEEL_LEVELS && delta >= 1ULL << (WHEEL_SLOT_BITS * (level + 1)))
+        level += 1;
+    size_t slot = (size_t) (entry->expires >> (WHEEL_SLOT_BITS * level)) & WHEEL_MASK;
+    struct wheel_entry** head = &wheel->slots[level][slot];
+    entry->next = *head;
+    if (*head != NULL)
+        (*head)->pprev = &entry->next;
+    *head = entry;
+    entry->pprev = head;
+}
+
+static void unlink_entry(struct wheel* wheel, struct wheel_entry* entry)
+{
+    *entry->pprev = entry->next;
+    if (entry->next != NULL)
+        entry->next->pprev = entry->pprev;
+    entry->next = NULL;
+    entry->pprev = NULL;
+    wheel->n_entries -= 1;
+}
+
+static void start_ticking(struct wheel* wheel)
+{
+    /* Wake up when the next tick to run has begun */
+    long long delay = wheel->origin_ms + (long long) wheel->now * wheel->tick_ms - event_now();
+    timer_start(&wheel->timer, delay > 0 ? delay : 0, on_tick, wheel);
+}
+
+void wheel_schedule(struct wheel* wheel, struct wheel_entry* entry, long long delay_ms,
+        wheel_callback callback)
+{
+    if (entry->pprev != NULL)
+        unlink_entry(wheel, entry);
+    unsigned long long tick = current_tick(wheel);
+    int idle = wheel->n_entries == 0;
+    if (idle)
+        wheel->now = tick + 1; /* nothing was due in the ticks skipped */
+
+    /* Round up, and count from the end of the current tick, so that
+     * the callback never comes early.
+     */
+    unsigned long long ticks = delay_ms > 0
+        ? (unsigned long long) ((delay_ms + wheel->tick_ms - 1) / wheel->tick_ms)
+        : 0;
+    entry->expires = tick + 1 + ticks;
+    if (entry->expires - wheel->now > WHEEL_MAX_TICKS)
+        entry->expires = wheel->now + WHEEL_MAX_TICKS;
+    entry->callback = callback;
+    place(wheel, entry);
+    wheel->n_entries += 1;
+    if (idle)
+        start_ticking(wheel);
+}
+
+void wheel_cancel(struct wheel* wheel, struct wheel_entry* entry)
+{
+    if (entry->pprev == NULL)
+        return;
+    unlink_entry(wheel, entry);
+    if (wheel->n_entries == 0)
+        timer_stop(&wheel->timer);
+}
+
+static void run_tick(struct wheel* wheel)
+{
+    unsigned long long tick = wheel->now;
+
+    /* Level 0 has come round again: bring the entries due in the next
+     * span down from level 1, and so on up while levels wrap too.
+     */
+    if ((tick & WHEEL_MASK) == 0)
+    {
+        for (unsigned int level = 1; level < WHEEL_LEVELS; ++level)
+        {
+            size_t index = (size_t) (tick >> (WHEEL_SLOT_BITS * level)) & WHEEL_MASK;
+            struct wheel_entry* list = wheel->slots[level][index];
+            wheel->slots[level][index] = NULL;
+            while (list != NULL)
+            {
+                struct wheel_entry* entry = list;
+                list = entry->next;
+                place(wheel, entry);
+            }
+            if (index != 0)
+                break;
+        }
+    }
+
+    /* Everything left in this slot expires now. Take the list out
+     * first, so that anything rescheduled lands in a later tick; a
+     * callback may also cancel entries still on it, so take them one
+     * at a time.
+     */
+    struct wheel_entry* due = wheel->slots[0][tick & WHEEL_MASK];
+    wheel->slots[0][tick & WHEEL_MASK] = NULL;
+    if (due != NULL)
+        due->pprev = &due;
+    wheel->now = tick + 1;
+    while (due != NULL)
+    {
+        struct wheel_entry* entry = due;
+        unlink_entry(wheel, entry);
+        entry->callback(entry);
+    }
+}
+
+static void on_tick(struct timer* timer, void* data)
+{
+    (void) timer;
+    struct wheel* wheel = data;
+    unsigned long long target = current_tick(wheel);
+    while (wheel->now <= target && wheel->n_entries > 0)
+        run_tick(wheel);
+    if (wheel->n_entries > 0)
+        start_ticking(wheel);
+}
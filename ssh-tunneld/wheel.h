@@ -0,0 +1,67 @@
+/*
+ * This file is part of ssh-tunnel.
+ * See the LICENSE file in the top-level directory
+ * of the source distribution for further details.
+ */
+
+#ifndef SSH_TUNNELD_WHEEL_H
+#define SSH_TUNNELD_WHEEL_H
+
+#include <stddef.h>
+
+#include "event.h"
+
+/*
+ * Hierarchical timing wheel, for deadlines that are many and mostly
+ * pushed back before they come (lease heartbeats): scheduling,
+ * rescheduling and cancelling an entry are O(1), and each tick costs
+ * O(1) plus the entries that expire in it, however many are waiting.
+ * The event loop's own timers are a plain list scanned on every
+ * iteration, which is right for a handful of them but not for tens of
+ * thousands.
+ *
+ * Time is counted in ticks. Level 0 has a slot for each of the next
+ * WHEEL_SLOTS ticks; each level above covers WHEEL_SLOTS times the
+ * span of the one below, and whenever a level wraps around, the next
+ * slot of the level above is emptied into the levels below it. With
+ * a one-second tick, the four levels reach about 194 days; longer
+ * delays are cut to that. One event loop timer drives the wheel while
+ * anything is scheduled on it.
+ */
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+
+struct wheel_entry;
+typedef void (*wheel_callback)(struct wheel_entry* entry);
+
+/* Embedded in whatever has the deadline; see lease in clients.h */
+struct wheel_entry {
+    unsigned long long expires; /* tick */
+    wheel_callback callback;
+    struct wheel_entry* next;
+    struct wheel_entry** pprev; /* NULL when not scheduled */
+};
+
+struct wheel {
+    long long tick_ms;
+    long long origin_ms; /* event_now() at tick 0 */
+    unsigned long long now; /* next tick to run */
+    size_t n_entries;
+    struct wheel_entry* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    struct timer timer;
+};
+
+void wheel_init(struct wheel* wheel, long long tick_ms);
+
+/* (Re)schedule entry to have callback called no sooner than delay_ms
+ * from now. The entry is unscheduled before its callback runs, so the
+ * callback may schedule it again, or free it.
+ */
+void wheel_schedule(struct wheel* wheel, struct wheel_entry* entry, long long delay_ms,
+        wheel_callback callback);
+
+/* Unschedule entry, if it is scheduled */
+void wheel_cancel(struct wheel* wheel, struct wheel_entry* entry);
+
+#endif